@@ -14,8 +14,48 @@ struct VarlinkArray {
         unsigned long n_allocated_elements;
 
         bool writable;
+
+        /* the parsed message its strings point into */
+        ScannerBuffer *buffer;
+
+        /* changed by every setter, and when the JSON is written again */
+        uint64_t generation;
+
+        /* the compact JSON of a frozen array, like in VarlinkObject */
+        char *json;
+        size_t json_length;
+        uint64_t *json_generations;
 };
 
+/*
+ * Drops the cached JSON, parents notice the new generation.
+ */
+static void array_changed(VarlinkArray *array) {
+        array->generation += 1;
+
+        free(array->json);
+        array->json = NULL;
+        free(array->json_generations);
+        array->json_generations = NULL;
+}
+
+uint64_t varlink_array_get_generation(VarlinkArray *array) {
+        return array->generation;
+}
+
+bool varlink_array_json_valid(VarlinkArray *array) {
+        unsigned long n = 0;
+
+        if (!array->json)
+                return false;
+
+        for (unsigned long i = 0; i < array->n_elements; i += 1)
+                if (!varlink_value_json_valid(&array->elements[i], array->json_generations, &n))
+                        return false;
+
+        return true;
+}
+
 static long array_append(VarlinkArray *array, VarlinkValue **valuep) {
         if (array->n_elements == array->n_allocated_elements) {
                 unsigned long prev_n_allocated_elements = array->n_allocated_elements;
@@ -54,7 +94,7 @@ _public_ long varlink_array_new(VarlinkArray **arrayp) {
         return 0;
 }
 
-long varlink_array_new_from_scanner(VarlinkArray **arrayp, Scanner *scanner, locale_t locale, unsigned long depth_cnt) {
+long varlink_array_new_from_scanner(VarlinkArray **arrayp, Scanner *scanner, unsigned long depth_cnt) {
         _cleanup_(varlink_array_unrefp) VarlinkArray *array = NULL;
         bool first = true;
         long r;
@@ -63,6 +103,9 @@ long varlink_array_new_from_scanner(VarlinkArray **arrayp, Scanner *scanner, loc
         if (r < 0)
                 return r;
 
+        if (scanner->buffer)
+                array->buffer = scanner_buffer_ref(scanner->buffer);
+
         if (scanner_expect_operator(scanner, "[") < 0)
                 return -VARLINK_ERROR_INVALID_JSON;
 
@@ -78,7 +121,7 @@ long varlink_array_new_from_scanner(VarlinkArray **arrayp, Scanner *scanner, loc
                 if (r < 0)
                         return r;
 
-                if (!varlink_value_read_from_scanner(value, scanner, locale, depth_cnt))
+                if (!varlink_value_read_from_scanner(value, scanner, depth_cnt))
                         return -VARLINK_ERROR_INVALID_JSON;
 
                 /* Accept `null` value for any element kind */
@@ -114,6 +157,12 @@ _public_ VarlinkArray *varlink_array_unref(VarlinkArray *array) {
                         varlink_value_clear(&array->elements[i]);
 
                 free(array->elements);
+
+                if (array->buffer)
+                        scanner_buffer_unref(array->buffer);
+
+                free(array->json);
+                free(array->json_generations);
                 free(array);
         }
 
@@ -178,38 +227,69 @@ _public_ long varlink_array_get_string(VarlinkArray *array, unsigned long index,
 }
 
 _public_ long varlink_array_get_array(VarlinkArray *array, unsigned long index, VarlinkArray **elementp) {
+        long r;
+
         if (index >= array->n_elements)
                 return -VARLINK_ERROR_INVALID_INDEX;
 
         if (array->elements[index].kind != VARLINK_VALUE_ARRAY)
                 return -VARLINK_ERROR_INVALID_TYPE;
 
+        r = varlink_value_materialize(&array->elements[index], array->buffer);
+        if (r < 0)
+                return r;
+
         *elementp = array->elements[index].array;
 
         return 0;
 }
 
 _public_ long varlink_array_get_object(VarlinkArray *array, unsigned long index, VarlinkObject **objectp) {
+        long r;
+
         if (index >= array->n_elements)
                 return -VARLINK_ERROR_INVALID_INDEX;
 
         if (array->elements[index].kind != VARLINK_VALUE_OBJECT)
                 return -VARLINK_ERROR_INVALID_TYPE;
 
+        r = varlink_value_materialize(&array->elements[index], array->buffer);
+        if (r < 0)
+                return r;
+
         *objectp = array->elements[index].object;
 
         return 0;
 }
 
 long varlink_array_get_value(VarlinkArray *array, unsigned long index, VarlinkValue **valuep) {
+        long r;
+
         if (index >= array->n_elements)
                 return -VARLINK_ERROR_INVALID_INDEX;
 
+        r = varlink_value_materialize(&array->elements[index], array->buffer);
+        if (r < 0)
+                return r;
+
         *valuep = &array->elements[index];
 
         return 0;
 }
 
+long varlink_array_peek_value(VarlinkArray *array,
+                              unsigned long index,
+                              VarlinkValue **valuep,
+                              ScannerBuffer **bufferp) {
+        if (index >= array->n_elements)
+                return -VARLINK_ERROR_INVALID_INDEX;
+
+        *valuep = &array->elements[index];
+        *bufferp = array->buffer;
+
+        return 0;
+}
+
 _public_ long varlink_array_append_null(VarlinkArray *array) {
         VarlinkValue *v;
         long r;
@@ -217,6 +297,8 @@ _public_ long varlink_array_append_null(VarlinkArray *array) {
         if (!array->writable)
                 return -VARLINK_ERROR_READ_ONLY;
 
+        array_changed(array);
+
         r = array_append(array, &v);
         if (r < 0)
                 return r;
@@ -233,6 +315,8 @@ _public_ long varlink_array_append_bool(VarlinkArray *array, bool b) {
         if (!array->writable)
                 return -VARLINK_ERROR_READ_ONLY;
 
+        array_changed(array);
+
         if (array->element_kind == VARLINK_VALUE_UNDEFINED)
                 array->element_kind = VARLINK_VALUE_BOOL;
         else if (array->element_kind != VARLINK_VALUE_BOOL)
@@ -255,6 +339,8 @@ _public_ long varlink_array_append_int(VarlinkArray *array, int64_t i) {
         if (!array->writable)
                 return -VARLINK_ERROR_READ_ONLY;
 
+        array_changed(array);
+
         if (array->element_kind == VARLINK_VALUE_UNDEFINED)
                 array->element_kind = VARLINK_VALUE_INT;
         else if (array->element_kind != VARLINK_VALUE_INT)
@@ -277,6 +363,8 @@ _public_ long varlink_array_append_float(VarlinkArray *array, double f) {
         if (!array->writable)
                 return -VARLINK_ERROR_READ_ONLY;
 
+        array_changed(array);
+
         if (array->element_kind == VARLINK_VALUE_UNDEFINED)
                 array->element_kind = VARLINK_VALUE_FLOAT;
         else if (array->element_kind != VARLINK_VALUE_FLOAT)
@@ -299,6 +387,8 @@ _public_ long varlink_array_append_string(VarlinkArray *array, const char *strin
         if (!array->writable)
                 return -VARLINK_ERROR_READ_ONLY;
 
+        array_changed(array);
+
         if (array->element_kind == VARLINK_VALUE_UNDEFINED)
                 array->element_kind = VARLINK_VALUE_STRING;
         else if (array->element_kind != VARLINK_VALUE_STRING)
@@ -323,6 +413,8 @@ _public_ long varlink_array_append_array(VarlinkArray *array, VarlinkArray *elem
         if (!array->writable)
                 return -VARLINK_ERROR_READ_ONLY;
 
+        array_changed(array);
+
         if (array->element_kind == VARLINK_VALUE_UNDEFINED)
                 array->element_kind = VARLINK_VALUE_ARRAY;
         else if (array->element_kind != VARLINK_VALUE_ARRAY)
@@ -345,6 +437,8 @@ _public_ long varlink_array_append_object(VarlinkArray *array, VarlinkObject *ob
         if (!array->writable)
                 return -VARLINK_ERROR_READ_ONLY;
 
+        array_changed(array);
+
         if (array->element_kind == VARLINK_VALUE_UNDEFINED)
                 array->element_kind = VARLINK_VALUE_OBJECT;
         else if (array->element_kind != VARLINK_VALUE_OBJECT)
@@ -395,6 +489,10 @@ long varlink_array_write_json(VarlinkArray *array,
                         if (fprintf(stream, "%*s", (int)(indent + 1) * 2, " ") < 0)
                                 return -VARLINK_ERROR_PANIC;
 
+                r = varlink_value_materialize(&array->elements[i], array->buffer);
+                if (r < 0)
+                        return r;
+
                 r = varlink_value_write_json(&array->elements[i], stream,
                                              indent >= 0 ? indent + 1 : -1,
                                              key_pre, key_post,
@@ -412,3 +510,78 @@ long varlink_array_write_json(VarlinkArray *array,
 
         return 0;
 }
+
+long varlink_array_write_compact_json(VarlinkArray *array, Writer *writer) {
+        long r;
+
+        if (varlink_array_json_valid(array))
+                return writer_write(writer, array->json, array->json_length);
+
+        r = writer_put_char(writer, '[');
+        if (r < 0)
+                return r;
+
+        for (unsigned long i = 0; i < array->n_elements; i += 1) {
+                if (i > 0) {
+                        r = writer_put_char(writer, ',');
+                        if (r < 0)
+                                return r;
+                }
+
+                r = varlink_value_write_compact_json(&array->elements[i], array->buffer, writer);
+                if (r < 0)
+                        return r;
+        }
+
+        return writer_put_char(writer, ']');
+}
+
+_public_ long varlink_array_freeze(VarlinkArray *array) {
+        StringWriter w;
+        unsigned long n = 0;
+        long length;
+        long r;
+
+        if (varlink_array_json_valid(array))
+                return 0;
+
+        /* something nested changed, parents holding the old JSON must notice */
+        if (array->json)
+                array_changed(array);
+
+        for (unsigned long i = 0; i < array->n_elements; i += 1) {
+                r = varlink_value_freeze(&array->elements[i], array->buffer);
+                if (r < 0)
+                        return r;
+
+                n = varlink_value_get_generation(&array->elements[i], NULL, n);
+        }
+
+        if (n > 0) {
+                array->json_generations = calloc(n, sizeof(uint64_t));
+                if (!array->json_generations)
+                        return -VARLINK_ERROR_PANIC;
+
+                n = 0;
+                for (unsigned long i = 0; i < array->n_elements; i += 1)
+                        n = varlink_value_get_generation(&array->elements[i], array->json_generations, n);
+        }
+
+        string_writer_init(&w);
+
+        r = varlink_array_write_compact_json(array, &w.writer);
+        if (r < 0) {
+                string_writer_clear(&w);
+                return r;
+        }
+
+        length = string_writer_steal(&w, &array->json);
+        if (length < 0) {
+                string_writer_clear(&w);
+                return length;
+        }
+
+        array->json_length = length;
+
+        return 0;
+}
@@ -2,16 +2,26 @@
 
 #pragma once
 
-#include <locale.h>
 #include "value.h"
 #include "scanner.h"
 #include "varlink.h"
 
-long varlink_array_new_from_scanner(VarlinkArray **arrayp, Scanner *scanner, locale_t locale, unsigned long depth_cnt);
+long varlink_array_new_from_scanner(VarlinkArray **arrayp, Scanner *scanner, unsigned long depth_cnt);
 long varlink_array_get_value(VarlinkArray *array, unsigned long index, VarlinkValue **valuep);
+
+/*
+ * Returns an element as it is stored, like varlink_object_peek_value().
+ */
+long varlink_array_peek_value(VarlinkArray *array,
+                              unsigned long index,
+                              VarlinkValue **valuep,
+                              ScannerBuffer **bufferp);
 VarlinkValueKind varlink_array_get_element_kind(VarlinkArray *array);
+uint64_t varlink_array_get_generation(VarlinkArray *array);
+bool varlink_array_json_valid(VarlinkArray *array);
 long varlink_array_write_json(VarlinkArray *array,
                               FILE *stream,
                               long indent,
                               const char *key_pre, const char *key_post,
                               const char *value_pre, const char *value_post);
+long varlink_array_write_compact_json(VarlinkArray *array, Writer *writer);
@@ -0,0 +1,96 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "atom.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Open addressing, the table is never filled more than half. */
+#define ATOM_TABLE_SIZE (2 * ATOM_MAX_ATOMS)
+
+/*
+ * One table for the whole process. A slot only ever changes from NULL
+ * to an atom, so lookups need no lock, and a new atom is published
+ * with a compare-and-swap. Atoms are never freed; the table is bounded,
+ * it does not grow with the number of threads or objects.
+ */
+static char *atom_slots[ATOM_TABLE_SIZE];
+static unsigned long atom_count;
+
+static uint32_t atom_hash(const char *string, size_t length) {
+        uint32_t hash = 2166136261u;
+
+        for (size_t i = 0; i < length; i += 1) {
+                hash ^= (uint8_t) string[i];
+                hash *= 16777619u;
+        }
+
+        return hash;
+}
+
+char *atom_find(const char *string) {
+        size_t length;
+
+        length = strnlen(string, ATOM_MAX_LENGTH + 1);
+        if (length > ATOM_MAX_LENGTH)
+                return NULL;
+
+        for (unsigned long i = atom_hash(string, length) % ATOM_TABLE_SIZE;; i = (i + 1) % ATOM_TABLE_SIZE) {
+                char *slot = __atomic_load_n(&atom_slots[i], __ATOMIC_ACQUIRE);
+
+                if (!slot)
+                        return NULL;
+
+                if (strcmp(slot, string) == 0)
+                        return slot;
+        }
+}
+
+static void atom_release(char *atom) {
+        free(atom);
+        __atomic_sub_fetch(&atom_count, 1, __ATOMIC_RELAXED);
+}
+
+char *atom_intern(const char *string) {
+        char *atom = NULL;
+        size_t length;
+
+        length = strnlen(string, ATOM_MAX_LENGTH + 1);
+        if (length > ATOM_MAX_LENGTH)
+                return NULL;
+
+        for (unsigned long i = atom_hash(string, length) % ATOM_TABLE_SIZE;; i = (i + 1) % ATOM_TABLE_SIZE) {
+                char *slot = __atomic_load_n(&atom_slots[i], __ATOMIC_ACQUIRE);
+
+                if (!slot) {
+                        if (!atom) {
+                                /* reserve a place first, so that the table never fills up */
+                                if (__atomic_add_fetch(&atom_count, 1, __ATOMIC_RELAXED) > ATOM_MAX_ATOMS) {
+                                        __atomic_sub_fetch(&atom_count, 1, __ATOMIC_RELAXED);
+                                        return NULL;
+                                }
+
+                                atom = strdup(string);
+                                if (!atom) {
+                                        __atomic_sub_fetch(&atom_count, 1, __ATOMIC_RELAXED);
+                                        return NULL;
+                                }
+                        }
+
+                        if (__atomic_compare_exchange_n(&atom_slots[i], &slot, atom, false,
+                                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                                return atom;
+
+                        /* another thread was faster, slot is what it stored */
+                }
+
+                if (strcmp(slot, string) == 0) {
+                        if (atom)
+                                atom_release(atom);
+
+                        return slot;
+                }
+        }
+}
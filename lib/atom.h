@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+/* Only short strings are interned, longer ones are unlikely to repeat. */
+#define ATOM_MAX_LENGTH 64
+
+/*
+ * The number of atoms of the process. Atoms are only created for the
+ * field names of the interfaces of a service. Keys of received messages
+ * and of fields set by the program are only looked up.
+ */
+#define ATOM_MAX_ATOMS 1024
+
+/*
+ * Returns the interned copy of a string: the same pointer for the
+ * same string, in all threads. Atoms live as long as the process and
+ * must neither be changed nor freed.
+ *
+ * Returns NULL if the string is too long, the table is full, or there
+ * is no memory; the caller keeps its own copy then.
+ */
+char *atom_intern(const char *string);
+
+/*
+ * Returns the atom of a string, if it was interned before, or NULL.
+ */
+char *atom_find(const char *string);
@@ -0,0 +1,143 @@
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Reports how many bytes the stream buffers copy internally per message
+ * for a few traffic patterns.
+ */
+
+#include "stream.h"
+#include "util.h"
+
+#include <assert.h>
+#include <string.h>
+#include <sys/socket.h>
+
+static void stream_pair(VarlinkStream **ap, VarlinkStream **bp) {
+        int sp[2];
+        int size = 16 * 1024;
+
+        assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sp) == 0);
+        assert(setsockopt(sp[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) == 0);
+        assert(varlink_stream_new(ap, sp[0]) == 0);
+        assert(varlink_stream_new(bp, sp[1]) == 0);
+}
+
+static VarlinkObject *message_new(unsigned long length) {
+        VarlinkObject *message;
+        _cleanup_(freep) char *string = NULL;
+
+        string = malloc(length + 1);
+        assert(string);
+        memset(string, 'x', length);
+        string[length] = '\0';
+
+        assert(varlink_object_new(&message) == 0);
+        assert(varlink_object_set_string(message, "string", string) == 0);
+
+        return message;
+}
+
+static unsigned long drain(VarlinkStream *b) {
+        unsigned long n_messages = 0;
+
+        for (;;) {
+                _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
+                long r;
+
+                r = varlink_stream_read(b, &message);
+                assert(r >= 0);
+                if (r == 0)
+                        return n_messages;
+
+                n_messages += 1;
+        }
+}
+
+static void report(const char *name, VarlinkStream *a, VarlinkStream *b, unsigned long n_messages) {
+        unsigned long long moved = a->out.moved + b->in.moved;
+
+        printf("%-12s %8lu messages %14llu bytes moved %10.1f bytes/message\n",
+               name, n_messages, moved, (double) moved / (double) n_messages);
+}
+
+/* Clients sending bursts of small calls without waiting for replies. */
+static void bench_pipelined(void) {
+        VarlinkStream *a, *b;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
+        unsigned long n_messages = 0;
+
+        stream_pair(&a, &b);
+        message = message_new(100);
+
+        for (unsigned long round = 0; round < 1000; round += 1) {
+                for (unsigned long i = 0; i < 64; i += 1)
+                        assert(varlink_stream_write(a, message) >= 0);
+
+                while (varlink_stream_flush(a) > 0)
+                        n_messages += drain(b);
+
+                n_messages += drain(b);
+        }
+
+        report("pipelined", a, b, n_messages);
+
+        varlink_stream_free(a);
+        varlink_stream_free(b);
+}
+
+/* A streaming producer which is faster than its consumer. */
+static void bench_backlog(void) {
+        VarlinkStream *a, *b;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
+        unsigned long n_messages = 0;
+
+        stream_pair(&a, &b);
+        message = message_new(1000);
+
+        for (unsigned long round = 0; round < 100; round += 1) {
+                for (unsigned long i = 0; i < 200; i += 1)
+                        assert(varlink_stream_write(a, message) >= 0);
+
+                while (varlink_stream_flush(a) > 0)
+                        n_messages += drain(b);
+
+                n_messages += drain(b);
+        }
+
+        report("backlog", a, b, n_messages);
+
+        varlink_stream_free(a);
+        varlink_stream_free(b);
+}
+
+/* Large messages arriving in many small reads. */
+static void bench_large(void) {
+        VarlinkStream *a, *b;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
+        unsigned long n_messages = 0;
+
+        stream_pair(&a, &b);
+        message = message_new(1024 * 1024);
+
+        for (unsigned long round = 0; round < 10; round += 1) {
+                assert(varlink_stream_write(a, message) >= 0);
+
+                while (varlink_stream_flush(a) > 0)
+                        n_messages += drain(b);
+
+                n_messages += drain(b);
+        }
+
+        report("large", a, b, n_messages);
+
+        varlink_stream_free(a);
+        varlink_stream_free(b);
+}
+
+int main(void) {
+        bench_pipelined();
+        bench_backlog();
+        bench_large();
+
+        return EXIT_SUCCESS;
+}
@@ -14,11 +14,18 @@
  * critical.
  */
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include "util.h"
 #include "c-utf8.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define C_UTF8_SIMD 1
+#endif
+
 #define c_align_to(n, a) (((n) + (a) - 1) & (~((a) - 1)))
 #define _c_unlikely_(_x) (__builtin_expect(!!(_x), 0))
 
@@ -239,3 +246,254 @@ out:
         if (lenp)
                 *lenp = len;
 }
+
+#ifdef C_UTF8_SIMD
+
+/*
+ * Vectorized validation, after "Validating UTF-8 In Less Than One
+ * Instruction Per Byte" by John Keiser and Daniel Lemire. Each byte is
+ * classified by three table lookups, indexed by the high and low nibble
+ * of the preceding byte and the high nibble of the byte itself; the
+ * error bits they have in common mark an invalid pair of bytes. A third
+ * or fourth byte of a sequence is checked against the lead two or three
+ * bytes before it.
+ */
+
+#define C_UTF8_TOO_SHORT        (1 << 0)
+#define C_UTF8_TOO_LONG         (1 << 1)
+#define C_UTF8_OVERLONG_3       (1 << 2)
+#define C_UTF8_TOO_LARGE        (1 << 3)
+#define C_UTF8_SURROGATE        (1 << 4)
+#define C_UTF8_OVERLONG_2       (1 << 5)
+#define C_UTF8_TOO_LARGE_1000   (1 << 6)
+#define C_UTF8_OVERLONG_4       (1 << 6)
+#define C_UTF8_TWO_CONTS        (1 << 7)
+#define C_UTF8_CARRY            (C_UTF8_TOO_SHORT | C_UTF8_TOO_LONG | C_UTF8_TWO_CONTS)
+
+static const uint8_t c_utf8_byte_1_high[16] = {
+        /* 0_______ ASCII */
+        C_UTF8_TOO_LONG, C_UTF8_TOO_LONG, C_UTF8_TOO_LONG, C_UTF8_TOO_LONG,
+        C_UTF8_TOO_LONG, C_UTF8_TOO_LONG, C_UTF8_TOO_LONG, C_UTF8_TOO_LONG,
+        /* 10______ continuation */
+        C_UTF8_TWO_CONTS, C_UTF8_TWO_CONTS, C_UTF8_TWO_CONTS, C_UTF8_TWO_CONTS,
+        /* 1100____ two byte lead */
+        C_UTF8_TOO_SHORT | C_UTF8_OVERLONG_2,
+        /* 1101____ two byte lead */
+        C_UTF8_TOO_SHORT,
+        /* 1110____ three byte lead */
+        C_UTF8_TOO_SHORT | C_UTF8_OVERLONG_3 | C_UTF8_SURROGATE,
+        /* 1111____ four byte lead */
+        C_UTF8_TOO_SHORT | C_UTF8_TOO_LARGE | C_UTF8_TOO_LARGE_1000 | C_UTF8_OVERLONG_4
+};
+
+static const uint8_t c_utf8_byte_1_low[16] = {
+        /* ____0000 */
+        C_UTF8_CARRY | C_UTF8_OVERLONG_3 | C_UTF8_OVERLONG_2 | C_UTF8_OVERLONG_4,
+        /* ____0001 */
+        C_UTF8_CARRY | C_UTF8_OVERLONG_2,
+        /* ____001_ */
+        C_UTF8_CARRY,
+        C_UTF8_CARRY,
+        /* ____0100 */
+        C_UTF8_CARRY | C_UTF8_TOO_LARGE,
+        /* ____0101 to ____1100 */
+        C_UTF8_CARRY | C_UTF8_TOO_LARGE | C_UTF8_TOO_LARGE_1000,
+        C_UTF8_CARRY | C_UTF8_TOO_LARGE | C_UTF8_TOO_LARGE_1000,
+        C_UTF8_CARRY | C_UTF8_TOO_LARGE | C_UTF8_TOO_LARGE_1000,
+        C_UTF8_CARRY | C_UTF8_TOO_LARGE | C_UTF8_TOO_LARGE_1000,
+        C_UTF8_CARRY | C_UTF8_TOO_LARGE | C_UTF8_TOO_LARGE_1000,
+        C_UTF8_CARRY | C_UTF8_TOO_LARGE | C_UTF8_TOO_LARGE_1000,
+        C_UTF8_CARRY | C_UTF8_TOO_LARGE | C_UTF8_TOO_LARGE_1000,
+        C_UTF8_CARRY | C_UTF8_TOO_LARGE | C_UTF8_TOO_LARGE_1000,
+        /* ____1101 */
+        C_UTF8_CARRY | C_UTF8_TOO_LARGE | C_UTF8_TOO_LARGE_1000 | C_UTF8_SURROGATE,
+        /* ____111_ */
+        C_UTF8_CARRY | C_UTF8_TOO_LARGE | C_UTF8_TOO_LARGE_1000,
+        C_UTF8_CARRY | C_UTF8_TOO_LARGE | C_UTF8_TOO_LARGE_1000
+};
+
+static const uint8_t c_utf8_byte_2_high[16] = {
+        /* 0_______ ASCII */
+        C_UTF8_TOO_SHORT, C_UTF8_TOO_SHORT, C_UTF8_TOO_SHORT, C_UTF8_TOO_SHORT,
+        C_UTF8_TOO_SHORT, C_UTF8_TOO_SHORT, C_UTF8_TOO_SHORT, C_UTF8_TOO_SHORT,
+        /* 1000____ */
+        C_UTF8_TOO_LONG | C_UTF8_OVERLONG_2 | C_UTF8_TWO_CONTS | C_UTF8_OVERLONG_3 | C_UTF8_TOO_LARGE_1000 | C_UTF8_OVERLONG_4,
+        /* 1001____ */
+        C_UTF8_TOO_LONG | C_UTF8_OVERLONG_2 | C_UTF8_TWO_CONTS | C_UTF8_OVERLONG_3 | C_UTF8_TOO_LARGE,
+        /* 101_____ */
+        C_UTF8_TOO_LONG | C_UTF8_OVERLONG_2 | C_UTF8_TWO_CONTS | C_UTF8_SURROGATE | C_UTF8_TOO_LARGE,
+        C_UTF8_TOO_LONG | C_UTF8_OVERLONG_2 | C_UTF8_TWO_CONTS | C_UTF8_SURROGATE | C_UTF8_TOO_LARGE,
+        /* 11______ lead */
+        C_UTF8_TOO_SHORT, C_UTF8_TOO_SHORT, C_UTF8_TOO_SHORT, C_UTF8_TOO_SHORT
+};
+
+/*
+ * A block ends in an incomplete sequence if one of its last three bytes
+ * is a lead byte which needs more bytes than there are left.
+ */
+static const uint8_t c_utf8_incomplete_max[32] = {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xf0 - 1, 0xe0 - 1, 0xc0 - 1
+};
+
+__attribute__((target("ssse3")))
+static bool c_utf8_verify_ssse3(const char *str, size_t len) {
+        const __m128i byte_1_high = _mm_loadu_si128((const __m128i *)(const void *)c_utf8_byte_1_high);
+        const __m128i byte_1_low = _mm_loadu_si128((const __m128i *)(const void *)c_utf8_byte_1_low);
+        const __m128i byte_2_high = _mm_loadu_si128((const __m128i *)(const void *)c_utf8_byte_2_high);
+        const __m128i incomplete_max = _mm_loadu_si128((const __m128i *)(const void *)(c_utf8_incomplete_max + 16));
+        const __m128i nibble = _mm_set1_epi8(0x0f);
+        const __m128i zero = _mm_setzero_si128();
+        __m128i previous = zero;
+        __m128i incomplete = zero;
+        __m128i error = zero;
+
+        while (len > 0) {
+                __m128i input;
+
+                if (len >= 16) {
+                        input = _mm_loadu_si128((const __m128i *)(const void *)str);
+                        str += 16;
+                        len -= 16;
+                } else {
+                        /* pad the last block with ASCII */
+                        uint8_t tail[16];
+
+                        memset(tail, ' ', sizeof(tail));
+                        memcpy(tail, str, len);
+                        input = _mm_loadu_si128((const __m128i *)(const void *)tail);
+                        len = 0;
+                }
+
+                /* U+0000 is invalid, as with c_utf8_verify() */
+                error = _mm_or_si128(error, _mm_cmpeq_epi8(input, zero));
+
+                if (_mm_movemask_epi8(input) == 0) {
+                        error = _mm_or_si128(error, incomplete);
+                        incomplete = zero;
+                } else {
+                        __m128i prev1 = _mm_alignr_epi8(input, previous, 15);
+                        __m128i prev2 = _mm_alignr_epi8(input, previous, 14);
+                        __m128i prev3 = _mm_alignr_epi8(input, previous, 13);
+                        __m128i special, third, fourth;
+
+                        special = _mm_and_si128(
+                                _mm_and_si128(_mm_shuffle_epi8(byte_1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                                              _mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, nibble))),
+                                _mm_shuffle_epi8(byte_2_high, _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+                        third = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xe0 - 0x80)));
+                        fourth = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xf0 - 0x80)));
+
+                        error = _mm_or_si128(error,
+                                             _mm_xor_si128(_mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char)0x80)),
+                                                           special));
+                        incomplete = _mm_subs_epu8(input, incomplete_max);
+                }
+
+                previous = input;
+        }
+
+        error = _mm_or_si128(error, incomplete);
+
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(error, zero)) == 0xffff;
+}
+
+/*
+ * The same with 32 byte blocks. The byte shuffles work within 128-bit
+ * lanes, so the preceding bytes are assembled across the lanes first.
+ */
+__attribute__((target("avx2")))
+static bool c_utf8_verify_avx2(const char *str, size_t len) {
+        const __m256i byte_1_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(const void *)c_utf8_byte_1_high));
+        const __m256i byte_1_low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(const void *)c_utf8_byte_1_low));
+        const __m256i byte_2_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(const void *)c_utf8_byte_2_high));
+        const __m256i incomplete_max = _mm256_loadu_si256((const __m256i *)(const void *)c_utf8_incomplete_max);
+        const __m256i nibble = _mm256_set1_epi8(0x0f);
+        const __m256i zero = _mm256_setzero_si256();
+        __m256i previous = zero;
+        __m256i incomplete = zero;
+        __m256i error = zero;
+
+        while (len > 0) {
+                __m256i input;
+
+                if (len >= 32) {
+                        input = _mm256_loadu_si256((const __m256i *)(const void *)str);
+                        str += 32;
+                        len -= 32;
+                } else {
+                        uint8_t tail[32];
+
+                        memset(tail, ' ', sizeof(tail));
+                        memcpy(tail, str, len);
+                        input = _mm256_loadu_si256((const __m256i *)(const void *)tail);
+                        len = 0;
+                }
+
+                error = _mm256_or_si256(error, _mm256_cmpeq_epi8(input, zero));
+
+                if (_mm256_movemask_epi8(input) == 0) {
+                        error = _mm256_or_si256(error, incomplete);
+                        incomplete = zero;
+                } else {
+                        __m256i shifted = _mm256_permute2x128_si256(previous, input, 0x21);
+                        __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+                        __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+                        __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+                        __m256i special, third, fourth;
+
+                        special = _mm256_and_si256(
+                                _mm256_and_si256(_mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+                                                 _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble))),
+                                _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+                        third = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xe0 - 0x80)));
+                        fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xf0 - 0x80)));
+
+                        error = _mm256_or_si256(error,
+                                                _mm256_xor_si256(_mm256_and_si256(_mm256_or_si256(third, fourth),
+                                                                                  _mm256_set1_epi8((char)0x80)),
+                                                                 special));
+                        incomplete = _mm256_subs_epu8(input, incomplete_max);
+                }
+
+                previous = input;
+        }
+
+        error = _mm256_or_si256(error, incomplete);
+
+        return _mm256_testz_si256(error, error);
+}
+
+#endif
+
+/**
+ * c_utf8_verify_buffer() - verify that a buffer is UTF-8 encoded
+ * @str:                buffer to verify
+ * @len:                length of the buffer
+ *
+ * All @len bytes of @str are verified to be UTF-8 encoded, with the same
+ * rules as c_utf8_verify(); a NULL byte is invalid. Large buffers are
+ * verified with AVX2 or SSSE3 instructions, if the processor supports
+ * them.
+ *
+ * Return: true if the whole buffer is valid.
+ */
+bool c_utf8_verify_buffer(const char *str, size_t len) {
+#ifdef C_UTF8_SIMD
+        if (len >= 64) {
+                if (__builtin_cpu_supports("avx2"))
+                        return c_utf8_verify_avx2(str, len);
+
+                if (__builtin_cpu_supports("ssse3"))
+                        return c_utf8_verify_ssse3(str, len);
+        }
+#endif
+
+        c_utf8_verify(&str, &len);
+
+        return len == 0;
+}
@@ -20,10 +20,12 @@
 extern "C" {
 #endif
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 void c_utf8_verify(const char **strp, size_t *lenp);
+bool c_utf8_verify_buffer(const char *str, size_t len);
 
 #ifdef __cplusplus
 }
@@ -30,10 +30,23 @@ struct VarlinkConnection {
 
         STAILQ_HEAD(pending, ReplyCallback) pending;
 
+        /* replies which have been read but not dispatched yet */
+        VarlinkObject *messages[STREAM_READ_BATCH];
+        unsigned long n_messages;
+        unsigned long i_message;
+
         VarlinkConnectionClosedFunc closed_callback;
         void *closed_userdata;
 };
 
+static void connection_drop_messages(VarlinkConnection *connection) {
+        for (unsigned long i = connection->i_message; i < connection->n_messages; i += 1)
+                varlink_object_unref(connection->messages[i]);
+
+        connection->n_messages = 0;
+        connection->i_message = 0;
+}
+
 long varlink_connection_bridge(int signal_fd, VarlinkStream *client_in, VarlinkStream *client_out,
                                VarlinkConnection *server) {
         return varlink_stream_bridge(signal_fd, client_in, client_out, server->stream);
@@ -103,6 +116,7 @@ _public_ VarlinkConnection *varlink_connection_free(VarlinkConnection *connectio
                 free(cb);
         }
 
+        connection_drop_messages(connection);
         free(connection);
 
         return NULL;
@@ -137,17 +151,27 @@ _public_ long varlink_connection_process_events(VarlinkConnection *connection, u
                 uint64_t flags = 0;
                 ReplyCallback *callback;
 
-                r = varlink_stream_read(connection->stream, &message);
-                if (r < 0)
-                        return r;
+                if (connection->i_message == connection->n_messages) {
+                        r = varlink_stream_read_batch(connection->stream,
+                                                      connection->messages,
+                                                      ARRAY_SIZE(connection->messages));
+                        if (r < 0)
+                                return r;
+
+                        if (connection->stream->hup) {
+                                connection->stream = varlink_stream_free(connection->stream);
+                                return -VARLINK_ERROR_CONNECTION_CLOSED;
+                        }
 
-                if (connection->stream->hup) {
-                        connection->stream = varlink_stream_free(connection->stream);
-                        return -VARLINK_ERROR_CONNECTION_CLOSED;
+                        if (r == 0)
+                                break;
+
+                        connection->n_messages = r;
+                        connection->i_message = 0;
                 }
 
-                if (r == 0)
-                        break;
+                message = connection->messages[connection->i_message];
+                connection->i_message += 1;
 
                 callback = STAILQ_FIRST(&connection->pending);
                 if (!callback)
@@ -185,8 +209,14 @@ _public_ uint32_t varlink_connection_get_events(VarlinkConnection *connection) {
         return connection->events;
 }
 
+_public_ void varlink_connection_set_max_message_size(VarlinkConnection *connection, unsigned long size) {
+        if (connection->stream)
+                varlink_stream_set_max_message_size(connection->stream, size);
+}
+
 _public_ long varlink_connection_close(VarlinkConnection *connection) {
         connection->stream = varlink_stream_free(connection->stream);
+        connection_drop_messages(connection);
 
         if (connection->closed_callback)
                 connection->closed_callback(connection, connection->closed_userdata);
@@ -0,0 +1,423 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "dtoa.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Grisu3, from "Printing Floating-Point Numbers Quickly and Accurately
+ * with Integers" by Florian Loitsch. It produces the shortest digits
+ * which read back to the same double, closest to its exact value, or
+ * reports that it cannot be sure about them. That happens for about one
+ * double in two hundred; those are searched for with the correctly
+ * rounded conversions of the C library instead.
+ */
+
+typedef struct {
+        uint64_t f;
+        int e;
+} DiyFp;
+
+#define DP_SIGNIFICAND_MASK 0x000fffffffffffffULL
+#define DP_EXPONENT_MASK 0x7ff0000000000000ULL
+#define DP_HIDDEN_BIT 0x0010000000000000ULL
+#define DP_SIGNIFICAND_SIZE 52
+#define DP_EXPONENT_BIAS (0x3ff + DP_SIGNIFICAND_SIZE)
+
+/* 10^k for k = -348, -340, ..., 340, normalized to 64 bits */
+static const uint64_t cached_powers_f[] = {
+        0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+        0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+        0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+        0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+        0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+        0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+        0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+        0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+        0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+        0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+        0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+        0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+        0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+        0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+        0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+        0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+        0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+        0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+        0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+        0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+        0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+        0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+        0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+        0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+        0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+        0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+        0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+        0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+        0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+
+static const int16_t cached_powers_e[] = {
+        -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+        -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+        -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+        -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+        -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+        109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+        375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+        641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+        907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static const uint64_t powers_of_ten[] = {
+        1ULL,
+        10ULL,
+        100ULL,
+        1000ULL,
+        10000ULL,
+        100000ULL,
+        1000000ULL,
+        10000000ULL,
+        100000000ULL,
+        1000000000ULL,
+        10000000000ULL,
+        100000000000ULL,
+        1000000000000ULL,
+        10000000000000ULL,
+        100000000000000ULL,
+        1000000000000000ULL,
+        10000000000000000ULL,
+        100000000000000000ULL,
+        1000000000000000000ULL,
+        10000000000000000000ULL
+};
+
+static DiyFp diy_fp_from_double(double d) {
+        uint64_t bits;
+        uint64_t significand;
+        int biased_e;
+
+        memcpy(&bits, &d, sizeof(bits));
+        significand = bits & DP_SIGNIFICAND_MASK;
+        biased_e = (bits & DP_EXPONENT_MASK) >> DP_SIGNIFICAND_SIZE;
+
+        if (biased_e != 0)
+                return (DiyFp) { significand + DP_HIDDEN_BIT, biased_e - DP_EXPONENT_BIAS };
+
+        return (DiyFp) { significand, 1 - DP_EXPONENT_BIAS };
+}
+
+static DiyFp diy_fp_multiply(DiyFp a, DiyFp b) {
+        unsigned __int128 p = (unsigned __int128) a.f * b.f;
+        uint64_t h = p >> 64;
+
+        /* round */
+        if ((uint64_t) p & (1ULL << 63))
+                h += 1;
+
+        return (DiyFp) { h, a.e + b.e + 64 };
+}
+
+static DiyFp diy_fp_normalize(DiyFp v) {
+        int s = __builtin_clzll(v.f);
+
+        return (DiyFp) { v.f << s, v.e - s };
+}
+
+/*
+ * The boundaries m- and m+ halfway to the neighbouring doubles; both
+ * with the exponent of the normalized m+.
+ */
+static void diy_fp_boundaries(DiyFp v, DiyFp *minusp, DiyFp *plusp) {
+        DiyFp plus = { (v.f << 1) + 1, v.e - 1 };
+        DiyFp minus;
+
+        while (!(plus.f & (DP_HIDDEN_BIT << 1))) {
+                plus.f <<= 1;
+                plus.e -= 1;
+        }
+
+        plus.f <<= 64 - DP_SIGNIFICAND_SIZE - 2;
+        plus.e -= 64 - DP_SIGNIFICAND_SIZE - 2;
+
+        /* the lower neighbour is closer if v is a power of two */
+        if (v.f == DP_HIDDEN_BIT)
+                minus = (DiyFp) { (v.f << 2) - 1, v.e - 2 };
+        else
+                minus = (DiyFp) { (v.f << 1) - 1, v.e - 1 };
+
+        minus.f <<= minus.e - plus.e;
+        minus.e = plus.e;
+
+        *minusp = minus;
+        *plusp = plus;
+}
+
+/*
+ * Returns a cached power c = 10^-K, such that the product with a number
+ * of binary exponent e has an exponent between -60 and -32.
+ */
+static DiyFp cached_power(int e, int *Kp) {
+        double dk = (-61 - e) * 0.30102999566398114 + 347;
+        int k = (int) dk;
+        unsigned long index;
+
+        if (dk - k > 0.0)
+                k += 1;
+
+        index = (k >> 3) + 1;
+        *Kp = -(-348 + (int) index * 8);
+
+        return (DiyFp) { cached_powers_f[index], cached_powers_e[index] };
+}
+
+static unsigned long count_decimal_digits(uint32_t n) {
+        unsigned long digits = 1;
+
+        while (digits < 10 && n >= powers_of_ten[digits])
+                digits += 1;
+
+        return digits;
+}
+
+/*
+ * Moves the last digit closer to the exact value, as long as it stays
+ * within the boundaries. The scaled values are only known up to unit,
+ * returns false if that leaves doubt whether the digits are the closest
+ * ones, or whether they are within the boundaries at all.
+ */
+static bool round_weed(char *buffer, unsigned long length, uint64_t too_high_w, uint64_t unsafe_interval,
+                       uint64_t rest, uint64_t ten_kappa, uint64_t unit) {
+        uint64_t small_distance = too_high_w - unit;
+        uint64_t big_distance = too_high_w + unit;
+
+        while (rest < small_distance && unsafe_interval - rest >= ten_kappa &&
+               (rest + ten_kappa < small_distance || small_distance - rest >= rest + ten_kappa - small_distance)) {
+                buffer[length - 1] -= 1;
+                rest += ten_kappa;
+        }
+
+        if (rest < big_distance && unsafe_interval - rest >= ten_kappa &&
+            (rest + ten_kappa < big_distance || big_distance - rest > rest + ten_kappa - big_distance))
+                return false;
+
+        return 2 * unit <= rest && rest <= unsafe_interval - 4 * unit;
+}
+
+/*
+ * Generates the digits of the shortest number between the boundaries
+ * Wm and Wp, which are only known up to one unit either way. The value
+ * is digits * 10^K.
+ */
+static bool digit_gen(DiyFp Wm, DiyFp W, DiyFp Wp, char *buffer, unsigned long *lengthp, int *Kp) {
+        DiyFp one = { 1ULL << -W.e, W.e };
+        uint64_t unit = 1;
+        uint64_t too_high = Wp.f + unit;
+        uint64_t unsafe_interval = too_high - (Wm.f - unit);
+        uint32_t p1 = too_high >> -one.e;
+        uint64_t p2 = too_high & (one.f - 1);
+        unsigned long kappa = count_decimal_digits(p1);
+        unsigned long length = 0;
+
+        while (kappa > 0) {
+                uint32_t d = p1 / powers_of_ten[kappa - 1];
+                uint64_t rest;
+
+                p1 %= powers_of_ten[kappa - 1];
+                buffer[length++] = '0' + d;
+                kappa -= 1;
+
+                rest = ((uint64_t) p1 << -one.e) + p2;
+                if (rest < unsafe_interval) {
+                        *lengthp = length;
+                        *Kp += kappa;
+                        return round_weed(buffer, length, too_high - W.f, unsafe_interval, rest,
+                                          powers_of_ten[kappa] << -one.e, unit);
+                }
+        }
+
+        for (;;) {
+                p2 *= 10;
+                unit *= 10;
+                unsafe_interval *= 10;
+
+                buffer[length++] = '0' + (p2 >> -one.e);
+                p2 &= one.f - 1;
+                *Kp -= 1;
+
+                if (p2 < unsafe_interval) {
+                        *lengthp = length;
+                        return round_weed(buffer, length, (too_high - W.f) * unit, unsafe_interval, p2,
+                                          one.f, unit);
+                }
+        }
+}
+
+static bool reads_back(const char *string, double value) {
+        double parsed = strtod(string, NULL);
+
+        return memcmp(&parsed, &value, sizeof(double)) == 0;
+}
+
+/*
+ * Increments the last digit before end, returns false if that carries
+ * over the first one.
+ */
+static bool increment_digits(char *string, char *end) {
+        for (char *s = end - 1; s >= string; s -= 1) {
+                if (*s < '0' || *s > '9')
+                        continue;
+
+                if (*s < '9') {
+                        *s += 1;
+                        return true;
+                }
+
+                *s = '0';
+        }
+
+        return false;
+}
+
+/*
+ * Finds the shortest digits which read back to value by trying all
+ * lengths, for the doubles Grisu3 is not sure about. The conversions
+ * of the C library round correctly; they use the decimal point of the
+ * locale, but only to read back what they wrote.
+ */
+static unsigned long digit_search(double value, char *buffer, int *Kp) {
+        uint64_t bits;
+        bool power_of_two;
+
+        memcpy(&bits, &value, sizeof(bits));
+        power_of_two = (bits & DP_SIGNIFICAND_MASK) == 0;
+
+        /* 17 digits always read back */
+        for (int precision = 0;; precision += 1) {
+                char string[32];
+                unsigned long length = 0;
+                char *e;
+
+                snprintf(string, sizeof(string), "%.*e", precision, value);
+                e = strchr(string, 'e');
+
+                /* the lower neighbour of a power of two is closer, the digits above might still fit */
+                if (precision < 16 && !reads_back(string, value) &&
+                    !(power_of_two && increment_digits(string, e) && reads_back(string, value)))
+                        continue;
+
+                for (char *s = string; s < e; s += 1)
+                        if (*s >= '0' && *s <= '9')
+                                buffer[length++] = *s;
+
+                *Kp = atoi(e + 1) - precision;
+
+                return length;
+        }
+}
+
+/*
+ * Writes the exponent of the exponential notation.
+ */
+static char *write_exponent(int K, char *p) {
+        *p++ = 'e';
+
+        if (K < 0) {
+                *p++ = '-';
+                K = -K;
+        }
+
+        if (K >= 100) {
+                *p++ = '0' + K / 100;
+                K %= 100;
+                *p++ = '0' + K / 10;
+        } else if (K >= 10)
+                *p++ = '0' + K / 10;
+
+        *p++ = '0' + K % 10;
+
+        return p;
+}
+
+/*
+ * Formats the digits, the value is digits * 10^k. Numbers always get a
+ * fraction or an exponent, so that they are read back as floats.
+ */
+static char *prettify(char *buffer, unsigned long length, int k) {
+        int kk = length + k;
+
+        if (k >= 0 && kk <= 21) {
+                /* 1234e7 -> 12340000000.0 */
+                memset(buffer + length, '0', kk - length);
+                buffer[kk] = '.';
+                buffer[kk + 1] = '0';
+                return buffer + kk + 2;
+        }
+
+        if (kk > 0 && kk <= 21) {
+                /* 1234e-2 -> 12.34 */
+                memmove(buffer + kk + 1, buffer + kk, length - kk);
+                buffer[kk] = '.';
+                return buffer + length + 1;
+        }
+
+        if (kk > -6 && kk <= 0) {
+                /* 1234e-6 -> 0.001234 */
+                unsigned long offset = 2 - kk;
+
+                memmove(buffer + offset, buffer, length);
+                buffer[0] = '0';
+                buffer[1] = '.';
+                memset(buffer + 2, '0', offset - 2);
+                return buffer + length + offset;
+        }
+
+        if (length == 1)
+                /* 1e30 */
+                return write_exponent(kk - 1, buffer + 1);
+
+        /* 1234e30 -> 1.234e33 */
+        memmove(buffer + 2, buffer + 1, length - 1);
+        buffer[1] = '.';
+        return write_exponent(kk - 1, buffer + length + 1);
+}
+
+unsigned long dtoa(double value, char *buffer) {
+        char *p = buffer;
+        DiyFp v, minus, plus, c, W, Wp, Wm;
+        unsigned long length;
+        int K;
+        bool exact;
+
+        if (signbit(value)) {
+                *p++ = '-';
+                value = -value;
+        }
+
+        if (fpclassify(value) == FP_ZERO) {
+                memcpy(p, "0.0", 4);
+                return p + 3 - buffer;
+        }
+
+        v = diy_fp_from_double(value);
+        diy_fp_boundaries(v, &minus, &plus);
+
+        c = cached_power(plus.e, &K);
+        W = diy_fp_multiply(diy_fp_normalize(v), c);
+        Wp = diy_fp_multiply(plus, c);
+        Wm = diy_fp_multiply(minus, c);
+
+        exact = digit_gen(Wm, W, Wp, p, &length, &K);
+        if (!exact)
+                length = digit_search(value, p, &K);
+
+        p = prettify(p, length, K);
+        *p = '\0';
+
+        return p - buffer;
+}
@@ -0,0 +1,15 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+/* Enough for the sign, 17 digits, 21 zeros or an exponent, '.0' and '\0'. */
+#define DTOA_BUFFER_SIZE 48
+
+/*
+ * Writes the shortest decimal representation of a finite double that
+ * reads back to the same value, independently of the current locale.
+ * The result always has a fraction or an exponent.
+ *
+ * Returns the length of the string.
+ */
+unsigned long dtoa(double value, char *buffer);
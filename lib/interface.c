@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: Apache-2.0
 
+#include "array.h"
 #include "interface.h"
+#include "object.h"
 #include "scanner.h"
 #include "util.h"
 
@@ -368,6 +370,397 @@ VarlinkType *varlink_interface_get_type(VarlinkInterface *interface, const char
         return member->alias;
 }
 
+static long interface_check_value(VarlinkInterface *interface,
+                                  VarlinkType *type,
+                                  VarlinkValue *value,
+                                  ScannerBuffer *buffer);
+
+/*
+ * Skips a value which is not part of the type. The message was
+ * validated when it was received.
+ */
+static long interface_skip_raw(Scanner *scanner) {
+        ScannerNumber number;
+
+        switch (scanner_peek(scanner)) {
+                case '{':
+                case '[':
+                        scanner->p = scanner_skip_nested(scanner, scanner->p);
+                        return 0;
+
+                case '"':
+                        return scanner_expect_string(scanner, NULL);
+        }
+
+        if (scanner_read_keyword(scanner, "null") ||
+            scanner_read_keyword(scanner, "true") ||
+            scanner_read_keyword(scanner, "false") ||
+            scanner_read_number(scanner, &number))
+                return 0;
+
+        return -VARLINK_ERROR_INVALID_JSON;
+}
+
+/*
+ * Reads a key or string without copying it; only strings with escape
+ * sequences are decoded into *copyp.
+ */
+static long interface_read_raw_string(Scanner *scanner, const char **stringp, size_t *lengthp, char **copyp) {
+        const char *start;
+        long r;
+
+        start = scanner->p;
+
+        r = scanner_expect_string(scanner, NULL);
+        if (r < 0)
+                return r;
+
+        *stringp = start + 1;
+        *lengthp = scanner->p - start - 2;
+
+        if (memchr(*stringp, '\\', *lengthp)) {
+                scanner->p = start;
+
+                r = scanner_expect_string_copy(scanner, copyp);
+                if (r < 0)
+                        return r;
+
+                *stringp = *copyp;
+                *lengthp = strlen(*copyp);
+        }
+
+        return 0;
+}
+
+static VarlinkTypeField *type_find_field(VarlinkType *type, const char *name, size_t length) {
+        for (unsigned long i = 0; i < type->n_fields; i += 1) {
+                VarlinkTypeField *field = type->fields[i];
+
+                if (strncmp(field->name, name, length) == 0 && field->name[length] == '\0')
+                        return field;
+        }
+
+        return NULL;
+}
+
+/*
+ * Checks a value where it is in the received message, without parsing
+ * it; the value stays lazy until it is read.
+ */
+static long interface_check_raw(VarlinkInterface *interface, VarlinkType *type, Scanner *scanner) {
+        ScannerNumber number;
+        bool first = true;
+        long r;
+
+        if (type->kind == VARLINK_TYPE_MAYBE) {
+                if (scanner_read_keyword(scanner, "null"))
+                        return 0;
+
+                type = type->element_type;
+        }
+
+        if (type->kind == VARLINK_TYPE_ALIAS) {
+                type = varlink_interface_get_type(interface, type->alias);
+                if (!type)
+                        return -VARLINK_ERROR_INVALID_TYPE;
+        }
+
+        switch (type->kind) {
+                case VARLINK_TYPE_UNDEFINED:
+                case VARLINK_TYPE_MAYBE:
+                case VARLINK_TYPE_ALIAS:
+                        abort();
+
+                case VARLINK_TYPE_BOOL:
+                        if (!scanner_read_keyword(scanner, "true") && !scanner_read_keyword(scanner, "false"))
+                                return -VARLINK_ERROR_INVALID_TYPE;
+                        break;
+
+                case VARLINK_TYPE_INT:
+                        if (!scanner_read_number(scanner, &number) || number.is_double)
+                                return -VARLINK_ERROR_INVALID_TYPE;
+                        break;
+
+                case VARLINK_TYPE_FLOAT:
+                        if (!scanner_read_number(scanner, &number))
+                                return -VARLINK_ERROR_INVALID_TYPE;
+                        break;
+
+                case VARLINK_TYPE_STRING:
+                        if (scanner_peek(scanner) != '"')
+                                return -VARLINK_ERROR_INVALID_TYPE;
+
+                        return scanner_expect_string(scanner, NULL);
+
+                case VARLINK_TYPE_ENUM: {
+                        _cleanup_(freep) char *copy = NULL;
+                        const char *string;
+                        size_t length;
+
+                        if (scanner_peek(scanner) != '"')
+                                return -VARLINK_ERROR_INVALID_TYPE;
+
+                        r = interface_read_raw_string(scanner, &string, &length, &copy);
+                        if (r < 0)
+                                return r;
+
+                        if (!type_find_field(type, string, length))
+                                return -VARLINK_ERROR_INVALID_TYPE;
+                        break;
+                }
+
+                case VARLINK_TYPE_ARRAY:
+                        if (scanner_peek(scanner) != '[')
+                                return -VARLINK_ERROR_INVALID_TYPE;
+
+                        scanner->p += 1;
+
+                        while (scanner_peek(scanner) != ']') {
+                                if (!first && scanner_expect_operator(scanner, ",") < 0)
+                                        return -VARLINK_ERROR_INVALID_JSON;
+
+                                r = interface_check_raw(interface, type->element_type, scanner);
+                                if (r < 0)
+                                        return r;
+
+                                first = false;
+                        }
+
+                        scanner->p += 1;
+                        break;
+
+                case VARLINK_TYPE_MAP:
+                case VARLINK_TYPE_OBJECT: {
+                        unsigned long n_required = 0;
+                        unsigned long n_found = 0;
+
+                        if (scanner_peek(scanner) != '{')
+                                return -VARLINK_ERROR_INVALID_TYPE;
+
+                        if (type->kind == VARLINK_TYPE_OBJECT)
+                                for (unsigned long i = 0; i < type->n_fields; i += 1)
+                                        if (type->fields[i]->type->kind != VARLINK_TYPE_MAYBE)
+                                                n_required += 1;
+
+                        scanner->p += 1;
+
+                        while (scanner_peek(scanner) != '}') {
+                                _cleanup_(freep) char *copy = NULL;
+                                VarlinkType *field_type = type->element_type;
+                                const char *name;
+                                size_t length;
+
+                                if (!first && scanner_expect_operator(scanner, ",") < 0)
+                                        return -VARLINK_ERROR_INVALID_JSON;
+
+                                r = interface_read_raw_string(scanner, &name, &length, &copy);
+                                if (r < 0)
+                                        return r;
+
+                                if (scanner_expect_operator(scanner, ":") < 0)
+                                        return -VARLINK_ERROR_INVALID_JSON;
+
+                                if (type->kind == VARLINK_TYPE_OBJECT) {
+                                        VarlinkTypeField *field = type_find_field(type, name, length);
+
+                                        field_type = field ? field->type : NULL;
+                                }
+
+                                if (!field_type) {
+                                        /* fields which are not part of the type are ignored */
+                                        r = interface_skip_raw(scanner);
+                                        if (r < 0)
+                                                return r;
+
+                                /* `null` is the same as a missing field */
+                                } else if (!scanner_read_keyword(scanner, "null")) {
+                                        r = interface_check_raw(interface, field_type, scanner);
+                                        if (r < 0)
+                                                return r;
+
+                                        /* a key only appears again after `null`, see value.c */
+                                        if (type->kind == VARLINK_TYPE_OBJECT && field_type->kind != VARLINK_TYPE_MAYBE)
+                                                n_found += 1;
+                                }
+
+                                first = false;
+                        }
+
+                        scanner->p += 1;
+
+                        if (n_found != n_required)
+                                return -VARLINK_ERROR_INVALID_TYPE;
+                        break;
+                }
+
+                case VARLINK_TYPE_FOREIGN_OBJECT:
+                        if (scanner_peek(scanner) != '{')
+                                return -VARLINK_ERROR_INVALID_TYPE;
+
+                        return interface_skip_raw(scanner);
+        }
+
+        return 0;
+}
+
+static long interface_check_field(VarlinkInterface *interface,
+                                  VarlinkType *type,
+                                  VarlinkObject *object,
+                                  const char *name) {
+        VarlinkValue *value;
+        ScannerBuffer *buffer;
+        long r;
+
+        r = varlink_object_peek_value(object, name, &value, &buffer);
+        if (r == -VARLINK_ERROR_UNKNOWN_FIELD)
+                return type->kind == VARLINK_TYPE_MAYBE ? 0 : -VARLINK_ERROR_INVALID_TYPE;
+        if (r < 0)
+                return r;
+
+        return interface_check_value(interface, type, value, buffer);
+}
+
+static long interface_check_value(VarlinkInterface *interface,
+                                  VarlinkType *type,
+                                  VarlinkValue *value,
+                                  ScannerBuffer *buffer) {
+        _cleanup_(freep) const char **names = NULL;
+        long n_names;
+        long r;
+
+        if (value->lazy) {
+                Scanner scanner = {
+                        .string = buffer->data,
+                        .end = buffer->data + buffer->length,
+                        .p = value->raw,
+                        .utf8_verified = true
+                };
+
+                /* an earlier attempt to parse it failed */
+                if (!value->raw)
+                        return -VARLINK_ERROR_INVALID_TYPE;
+
+                r = interface_check_raw(interface, type, &scanner);
+                if (r == -VARLINK_ERROR_INVALID_JSON)
+                        return -VARLINK_ERROR_INVALID_TYPE;
+
+                return r;
+        }
+
+        if (type->kind == VARLINK_TYPE_MAYBE) {
+                if (value->kind == VARLINK_VALUE_NULL)
+                        return 0;
+
+                type = type->element_type;
+        }
+
+        if (type->kind == VARLINK_TYPE_ALIAS) {
+                type = varlink_interface_get_type(interface, type->alias);
+                if (!type)
+                        return -VARLINK_ERROR_INVALID_TYPE;
+        }
+
+        switch (type->kind) {
+                case VARLINK_TYPE_UNDEFINED:
+                case VARLINK_TYPE_MAYBE:
+                case VARLINK_TYPE_ALIAS:
+                        abort();
+
+                case VARLINK_TYPE_BOOL:
+                        if (value->kind != VARLINK_VALUE_BOOL)
+                                return -VARLINK_ERROR_INVALID_TYPE;
+                        break;
+
+                case VARLINK_TYPE_INT:
+                        if (value->kind != VARLINK_VALUE_INT)
+                                return -VARLINK_ERROR_INVALID_TYPE;
+                        break;
+
+                case VARLINK_TYPE_FLOAT:
+                        /* the same as varlink_object_get_float() */
+                        if (value->kind != VARLINK_VALUE_FLOAT && value->kind != VARLINK_VALUE_INT)
+                                return -VARLINK_ERROR_INVALID_TYPE;
+                        break;
+
+                case VARLINK_TYPE_STRING:
+                        if (value->kind != VARLINK_VALUE_STRING)
+                                return -VARLINK_ERROR_INVALID_TYPE;
+                        break;
+
+                case VARLINK_TYPE_ENUM:
+                        if (value->kind != VARLINK_VALUE_STRING ||
+                            !avl_tree_find(type->fields_sorted, value->s))
+                                return -VARLINK_ERROR_INVALID_TYPE;
+                        break;
+
+                case VARLINK_TYPE_ARRAY:
+                        if (value->kind != VARLINK_VALUE_ARRAY)
+                                return -VARLINK_ERROR_INVALID_TYPE;
+
+                        for (unsigned long i = 0; i < varlink_array_get_n_elements(value->array); i += 1) {
+                                VarlinkValue *element;
+                                ScannerBuffer *element_buffer;
+
+                                r = varlink_array_peek_value(value->array, i, &element, &element_buffer);
+                                if (r < 0)
+                                        return r;
+
+                                r = interface_check_value(interface, type->element_type, element, element_buffer);
+                                if (r < 0)
+                                        return r;
+                        }
+                        break;
+
+                case VARLINK_TYPE_MAP:
+                        if (value->kind != VARLINK_VALUE_OBJECT)
+                                return -VARLINK_ERROR_INVALID_TYPE;
+
+                        n_names = varlink_object_get_field_names(value->object, &names);
+                        if (n_names < 0)
+                                return n_names;
+
+                        for (long i = 0; i < n_names; i += 1) {
+                                r = interface_check_field(interface, type->element_type, value->object, names[i]);
+                                if (r < 0)
+                                        return r;
+                        }
+                        break;
+
+                case VARLINK_TYPE_OBJECT:
+                        if (value->kind != VARLINK_VALUE_OBJECT)
+                                return -VARLINK_ERROR_INVALID_TYPE;
+
+                        return varlink_interface_check_object(interface, type, value->object, NULL);
+
+                case VARLINK_TYPE_FOREIGN_OBJECT:
+                        if (value->kind != VARLINK_VALUE_OBJECT)
+                                return -VARLINK_ERROR_INVALID_TYPE;
+                        break;
+        }
+
+        return 0;
+}
+
+long varlink_interface_check_object(VarlinkInterface *interface,
+                                    VarlinkType *type,
+                                    VarlinkObject *object,
+                                    const char **fieldp) {
+        for (unsigned long i = 0; i < type->n_fields; i += 1) {
+                VarlinkTypeField *field = type->fields[i];
+                long r;
+
+                r = interface_check_field(interface, field->type, object, field->name);
+                if (r < 0) {
+                        if (fieldp)
+                                *fieldp = field->name;
+
+                        return r;
+                }
+        }
+
+        return 0;
+}
+
 VarlinkMethod *varlink_interface_get_method(VarlinkInterface *interface, const char *name) {
         VarlinkInterfaceMember *member;
 
@@ -56,6 +56,20 @@ VarlinkInterface *varlink_interface_free(VarlinkInterface *interface);
 void varlink_interface_freep(VarlinkInterface **interface);
 VarlinkMethod *varlink_interface_get_method(VarlinkInterface *interface, const char *name);
 VarlinkType *varlink_interface_get_type(VarlinkInterface *interface, const char *name);
+
+/*
+ * Checks an object against an object type of the interface, like the
+ * parameters of a method call. Fields which are not part of the type
+ * are ignored. Nested objects and arrays which were not parsed yet are
+ * checked where they are in the received message, and stay unparsed.
+ *
+ * Returns 0, or -VARLINK_ERROR_INVALID_TYPE and the name of the first
+ * field which does not match.
+ */
+long varlink_interface_check_object(VarlinkInterface *interface,
+                                    VarlinkType *type,
+                                    VarlinkObject *object,
+                                    const char **fieldp);
 long varlink_interface_write_description(VarlinkInterface *interface,
                                          char **stringp,
                                          long indent,
@@ -1,14 +1,15 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include "array.h"
+#include "atom.h"
 #include "avltree.h"
+#include "c-utf8.h"
 #include "object.h"
 #include "scanner.h"
 #include "util.h"
 
 #include <inttypes.h>
 #include <string.h>
-#include <locale.h>
 
 typedef struct Field Field;
 
@@ -16,17 +17,71 @@ struct VarlinkObject {
         unsigned long refcount;
         AVLTree *fields;
         bool writable;
+
+        /* the parsed message its names and strings point into */
+        ScannerBuffer *buffer;
+
+        /* changed by every setter, and when the JSON is written again */
+        uint64_t generation;
+
+        /*
+         * The compact JSON of a frozen object, and the generations of
+         * the objects and arrays nested in it when it was written.
+         */
+        char *json;
+        size_t json_length;
+        uint64_t *json_generations;
 };
 
 struct Field {
         char *name;
+        uint64_t prefix;
+
+        /* the name is an atom or points into a parsed message */
+        bool name_borrowed;
         VarlinkValue value;
 };
 
-static long field_compare(const void *key, void *value) {
+/*
+ * Fields are sorted by name. The first eight bytes of a name, read as a
+ * big-endian number, sort the same way, so most comparisons are one
+ * integer comparison. Lookups use the atom of a name, if there is one;
+ * then equal names are the same pointer.
+ */
+typedef struct {
+        const char *name;
+        uint64_t prefix;
+} FieldKey;
+
+static uint64_t name_prefix(const char *name) {
+        uint64_t prefix = 0;
+
+        for (unsigned long i = 0; i < 8 && name[i] != '\0'; i += 1)
+                prefix |= (uint64_t)(uint8_t)name[i] << (56 - 8 * i);
+
+        return prefix;
+}
+
+static void field_key_init(FieldKey *key, const char *name, const char *atom) {
+        key->name = atom ? atom : name;
+        key->prefix = name_prefix(name);
+}
+
+static long field_compare(const void *k, void *value) {
+        const FieldKey *key = k;
         Field *field = value;
 
-        return strcmp(key, field->name);
+        if (key->prefix != field->prefix)
+                return key->prefix < field->prefix ? -1 : 1;
+
+        if (key->name == field->name)
+                return 0;
+
+        /* both names end within the prefix */
+        if ((key->prefix & 0xff) == 0)
+                return 0;
+
+        return strcmp(key->name + 8, field->name + 8);
 }
 
 static void field_freep(void *ptr) {
@@ -35,24 +90,34 @@ static void field_freep(void *ptr) {
         if (!field)
                 return;
 
-        free(field->name);
+        if (!field->name_borrowed)
+                free(field->name);
         varlink_value_clear(&field->value);
         free(field);
 }
 
-static long object_add_field(VarlinkObject *object, const char *name, Field **fieldp) {
+/*
+ * Takes over the name, unless it is borrowed from an atom or a parsed
+ * message.
+ */
+static long object_insert_field(VarlinkObject *object, char *name, bool name_borrowed, Field **fieldp) {
         _cleanup_(field_freep) Field *field = NULL;
+        FieldKey key;
         long r;
 
         field = calloc(1, sizeof(Field));
-        if (!field)
+        if (!field) {
+                if (!name_borrowed)
+                        free(name);
                 return -VARLINK_ERROR_PANIC;
+        }
 
-        field->name = strdup(name);
-        if (!field->name)
-                return -VARLINK_ERROR_PANIC;
+        field_key_init(&key, name, NULL);
+        field->name = name;
+        field->prefix = key.prefix;
+        field->name_borrowed = name_borrowed;
 
-        r = avl_tree_insert(object->fields, field->name, field);
+        r = avl_tree_insert(object->fields, &key, field);
         if (r < 0)
                 return -VARLINK_ERROR_PANIC;
 
@@ -62,8 +127,85 @@ static long object_add_field(VarlinkObject *object, const char *name, Field **fi
         return 0;
 }
 
+static Field *object_find_field(VarlinkObject *object, const char *name) {
+        FieldKey key;
+
+        field_key_init(&key, name, atom_find(name));
+
+        return avl_tree_find(object->fields, &key);
+}
+
+/*
+ * Drops the cached JSON. Parents which cached their JSON with this
+ * object in it notice the new generation when they are written.
+ */
+static void object_changed(VarlinkObject *object) {
+        object->generation += 1;
+
+        free(object->json);
+        object->json = NULL;
+        free(object->json_generations);
+        object->json_generations = NULL;
+}
+
+uint64_t varlink_object_get_generation(VarlinkObject *object) {
+        return object->generation;
+}
+
+bool varlink_object_json_valid(VarlinkObject *object) {
+        unsigned long n = 0;
+
+        if (!object->json)
+                return false;
+
+        for (AVLTreeNode *node = avl_tree_first(object->fields); node; node = avl_tree_node_next(node)) {
+                Field *field = avl_tree_node_get(node);
+
+                if (!varlink_value_json_valid(&field->value, object->json_generations, &n))
+                        return false;
+        }
+
+        return true;
+}
+
+/*
+ * Replaces the field with a new, empty one. The atom of the name is
+ * looked up once for both the removal and the insertion; names are not
+ * interned here, they may come from data like the keys of a map.
+ */
+static long object_set_field(VarlinkObject *object, const char *name, Field **fieldp) {
+        FieldKey key;
+        char *atom;
+        char *copy;
+
+        atom = atom_find(name);
+        field_key_init(&key, name, atom);
+        avl_tree_remove(object->fields, &key);
+
+        if (atom)
+                return object_insert_field(object, atom, true, fieldp);
+
+        copy = strdup(name);
+        if (!copy)
+                return -VARLINK_ERROR_PANIC;
+
+        return object_insert_field(object, copy, false, fieldp);
+}
+
 static void object_remove_field(VarlinkObject *object, const char *name) {
-        avl_tree_remove(object->fields, name);
+        FieldKey key;
+
+        field_key_init(&key, name, atom_find(name));
+        avl_tree_remove(object->fields, &key);
+}
+
+static void object_drop_field(VarlinkObject *object, Field *field) {
+        FieldKey key = {
+                .name = field->name,
+                .prefix = field->prefix
+        };
+
+        avl_tree_remove(object->fields, &key);
 }
 
 _public_ long varlink_object_new(VarlinkObject **objectp) {
@@ -86,8 +228,7 @@ _public_ long varlink_object_new(VarlinkObject **objectp) {
         return 0;
 }
 
-long varlink_object_new_from_scanner(VarlinkObject **objectp, Scanner *scanner, locale_t locale,
-                                     unsigned long depth_cnt) {
+long varlink_object_new_from_scanner(VarlinkObject **objectp, Scanner *scanner, unsigned long depth_cnt) {
         _cleanup_(varlink_object_unrefp) VarlinkObject *object = NULL;
         bool first = true;
         long r;
@@ -99,8 +240,12 @@ long varlink_object_new_from_scanner(VarlinkObject **objectp, Scanner *scanner,
         if (r < 0)
                 return r;
 
+        if (scanner->buffer)
+                object->buffer = scanner_buffer_ref(scanner->buffer);
+
         while (scanner_peek(scanner) != '}') {
-                _cleanup_(freep) char *name = NULL;
+                char *name;
+                char *atom;
                 Field *field;
 
                 if (!first) {
@@ -112,19 +257,30 @@ long varlink_object_new_from_scanner(VarlinkObject **objectp, Scanner *scanner,
                 if (r < 0)
                         return r;
 
-                if (scanner_expect_operator(scanner, ":") < 0)
-                        return -VARLINK_ERROR_INVALID_JSON;
-
-                r = object_add_field(object, name, &field);
+                /*
+                 * Keys which are atoms already are stored only once. Peers
+                 * choose the keys, they are never interned here.
+                 */
+                atom = atom_find(name);
+                if (atom) {
+                        if (!scanner->buffer)
+                                free(name);
+
+                        r = object_insert_field(object, atom, true, &field);
+                } else
+                        r = object_insert_field(object, name, scanner->buffer != NULL, &field);
                 if (r < 0)
                         return r;
 
-                if (!varlink_value_read_from_scanner(&field->value, scanner, locale, depth_cnt))
+                if (scanner_expect_operator(scanner, ":") < 0)
+                        return -VARLINK_ERROR_INVALID_JSON;
+
+                if (!varlink_value_read_from_scanner(&field->value, scanner, depth_cnt))
                         return -VARLINK_ERROR_INVALID_JSON;
 
                 /* Treat `null` the same as non-existent keys */
                 if (field->value.kind == VARLINK_VALUE_NULL)
-                        object_remove_field(object, name);
+                        object_drop_field(object, field);
 
                 first = false;
         }
@@ -138,35 +294,49 @@ long varlink_object_new_from_scanner(VarlinkObject **objectp, Scanner *scanner,
         return 0;
 }
 
-_public_ long varlink_object_new_from_json(VarlinkObject **objectp, const char *json) {
+static long object_new_from_toplevel(VarlinkObject **objectp, Scanner *scanner) {
         _cleanup_(varlink_object_unrefp) VarlinkObject *object = NULL;
-        _cleanup_(scanner_freep) Scanner *scanner = NULL;
         long r;
-        locale_t new_locale;
 
-        r = scanner_new(&scanner, json, false);
+        r = varlink_object_new_from_scanner(&object, scanner, 0);
         if (r < 0)
                 return r;
 
-        new_locale = newlocale(LC_NUMERIC_MASK, "C",  (locale_t) 0);
+        if (scanner_peek(scanner) != '\0')
+                return -VARLINK_ERROR_INVALID_JSON;
 
-        if (new_locale == (locale_t) 0)
-                return -VARLINK_ERROR_PANIC;
+        *objectp = object;
+        object = NULL;
 
-        r = varlink_object_new_from_scanner(&object, scanner, new_locale, 0);
+        return 0;
+}
 
-        freelocale(new_locale);
+_public_ long varlink_object_new_from_json(VarlinkObject **objectp, const char *json) {
+        _cleanup_(scanner_freep) Scanner *scanner = NULL;
+        long r;
 
+        r = scanner_new(&scanner, json, false);
         if (r < 0)
                 return r;
 
-        if (scanner_peek(scanner) != '\0')
-                return -VARLINK_ERROR_INVALID_JSON;
+        return object_new_from_toplevel(objectp, scanner);
+}
 
-        *objectp = object;
-        object = NULL;
+long varlink_object_new_from_message(VarlinkObject **objectp, ScannerBuffer *buffer) {
+        _cleanup_(scanner_freep) Scanner *scanner = NULL;
+        long r;
 
-        return 0;
+        r = scanner_new_in_place(&scanner, buffer);
+        if (r < 0)
+                return r;
+
+        /* invalid messages are parsed the slow way, to fail at the right place */
+        scanner->utf8_verified = c_utf8_verify_buffer(buffer->data, buffer->length);
+
+        /* nested objects and arrays are only parsed when they are accessed */
+        scanner->lazy = true;
+
+        return object_new_from_toplevel(objectp, scanner);
 }
 
 _public_ VarlinkObject *varlink_object_ref(VarlinkObject *object) {
@@ -179,6 +349,12 @@ _public_ VarlinkObject *varlink_object_unref(VarlinkObject *object) {
 
         if (object->refcount == 0) {
                 avl_tree_free(object->fields);
+
+                if (object->buffer)
+                        scanner_buffer_unref(object->buffer);
+
+                free(object->json);
+                free(object->json_generations);
                 free(object);
         }
 
@@ -224,7 +400,7 @@ _public_ long varlink_object_get_field_names(VarlinkObject *object, const char *
 _public_ long varlink_object_get_bool(VarlinkObject *object, const char *field_name, bool *bp) {
         Field *field;
 
-        field = avl_tree_find(object->fields, field_name);
+        field = object_find_field(object, field_name);
         if (!field)
                 return -VARLINK_ERROR_UNKNOWN_FIELD;
 
@@ -239,7 +415,7 @@ _public_ long varlink_object_get_bool(VarlinkObject *object, const char *field_n
 _public_ long varlink_object_get_int(VarlinkObject *object, const char *field_name, int64_t *ip) {
         Field *field;
 
-        field = avl_tree_find(object->fields, field_name);
+        field = object_find_field(object, field_name);
         if (!field)
                 return -VARLINK_ERROR_UNKNOWN_FIELD;
 
@@ -254,7 +430,7 @@ _public_ long varlink_object_get_int(VarlinkObject *object, const char *field_na
 _public_ long varlink_object_get_float(VarlinkObject *object, const char *field_name, double *fp) {
         Field *field;
 
-        field = avl_tree_find(object->fields, field_name);
+        field = object_find_field(object, field_name);
         if (!field)
                 return -VARLINK_ERROR_UNKNOWN_FIELD;
 
@@ -271,7 +447,7 @@ _public_ long varlink_object_get_float(VarlinkObject *object, const char *field_
 _public_ long varlink_object_get_string(VarlinkObject *object, const char *field_name, const char **stringp) {
         Field *field;
 
-        field = avl_tree_find(object->fields, field_name);
+        field = object_find_field(object, field_name);
         if (!field)
                 return -VARLINK_ERROR_UNKNOWN_FIELD;
 
@@ -283,16 +459,37 @@ _public_ long varlink_object_get_string(VarlinkObject *object, const char *field
         return 0;
 }
 
+long varlink_object_peek_value(VarlinkObject *object,
+                               const char *field_name,
+                               VarlinkValue **valuep,
+                               ScannerBuffer **bufferp) {
+        Field *field;
+
+        field = object_find_field(object, field_name);
+        if (!field)
+                return -VARLINK_ERROR_UNKNOWN_FIELD;
+
+        *valuep = &field->value;
+        *bufferp = object->buffer;
+
+        return 0;
+}
+
 _public_ long varlink_object_get_array(VarlinkObject *object, const char *field_name, VarlinkArray **arrayp) {
         Field *field;
+        long r;
 
-        field = avl_tree_find(object->fields, field_name);
+        field = object_find_field(object, field_name);
         if (!field)
                 return -VARLINK_ERROR_UNKNOWN_FIELD;
 
         if (field->value.kind != VARLINK_VALUE_ARRAY)
                 return -VARLINK_ERROR_INVALID_TYPE;
 
+        r = varlink_value_materialize(&field->value, object->buffer);
+        if (r < 0)
+                return r;
+
         *arrayp = field->value.array;
 
         return 0;
@@ -300,14 +497,19 @@ _public_ long varlink_object_get_array(VarlinkObject *object, const char *field_
 
 _public_ long varlink_object_get_object(VarlinkObject *object, const char *field_name, VarlinkObject **nestedp) {
         Field *field;
+        long r;
 
-        field = avl_tree_find(object->fields, field_name);
+        field = object_find_field(object, field_name);
         if (!field)
                 return -VARLINK_ERROR_UNKNOWN_FIELD;
 
         if (field->value.kind != VARLINK_VALUE_OBJECT)
                 return -VARLINK_ERROR_INVALID_TYPE;
 
+        r = varlink_value_materialize(&field->value, object->buffer);
+        if (r < 0)
+                return r;
+
         *nestedp = field->value.object;
 
         return 0;
@@ -317,6 +519,8 @@ _public_ long varlink_object_set_null(VarlinkObject *object, const char *field_n
         if (!object->writable)
                 return -VARLINK_ERROR_READ_ONLY;
 
+        object_changed(object);
+
         object_remove_field(object, field_name);
         return 0;
 }
@@ -328,8 +532,9 @@ _public_ long varlink_object_set_bool(VarlinkObject *object, const char *field_n
         if (!object->writable)
                 return -VARLINK_ERROR_READ_ONLY;
 
-        object_remove_field(object, field_name);
-        r = object_add_field(object, field_name, &field);
+        object_changed(object);
+
+        r = object_set_field(object, field_name, &field);
         if (r < 0)
                 return r;
 
@@ -346,8 +551,9 @@ _public_ long varlink_object_set_int(VarlinkObject *object, const char *field_na
         if (!object->writable)
                 return -VARLINK_ERROR_READ_ONLY;
 
-        object_remove_field(object, field_name);
-        r = object_add_field(object, field_name, &field);
+        object_changed(object);
+
+        r = object_set_field(object, field_name, &field);
         if (r < 0)
                 return r;
 
@@ -364,8 +570,9 @@ _public_ long varlink_object_set_float(VarlinkObject *object, const char *field_
         if (!object->writable)
                 return -VARLINK_ERROR_READ_ONLY;
 
-        object_remove_field(object, field_name);
-        r = object_add_field(object, field_name, &field);
+        object_changed(object);
+
+        r = object_set_field(object, field_name, &field);
         if (r < 0)
                 return r;
 
@@ -382,8 +589,9 @@ _public_ long varlink_object_set_string(VarlinkObject *object, const char *field
         if (!object->writable)
                 return -VARLINK_ERROR_READ_ONLY;
 
-        object_remove_field(object, field_name);
-        r = object_add_field(object, field_name, &field);
+        object_changed(object);
+
+        r = object_set_field(object, field_name, &field);
         if (r < 0)
                 return r;
 
@@ -402,8 +610,9 @@ _public_ long varlink_object_set_array(VarlinkObject *object, const char *field_
         if (!object->writable)
                 return -VARLINK_ERROR_READ_ONLY;
 
-        object_remove_field(object, field_name);
-        r = object_add_field(object, field_name, &field);
+        object_changed(object);
+
+        r = object_set_field(object, field_name, &field);
         if (r < 0)
                 return r;
 
@@ -420,8 +629,9 @@ _public_ long varlink_object_set_object(VarlinkObject *object, const char *field
         if (!object->writable)
                 return -VARLINK_ERROR_READ_ONLY;
 
-        object_remove_field(object, field_name);
-        r = object_add_field(object, field_name, &field);
+        object_changed(object);
+
+        r = object_set_field(object, field_name, &field);
         if (r < 0)
                 return r;
 
@@ -486,10 +696,14 @@ long varlink_object_write_json(VarlinkObject *object,
                 if (fprintf(stream, "\"%s%s%s\":%s", key_pre, field_names[i], key_post, indent >= 0 ? " ": "") < 0)
                         return -VARLINK_ERROR_PANIC;
 
-                field = avl_tree_find(object->fields, field_names[i]);
+                field = object_find_field(object, field_names[i]);
                 if (!field)
                         return -VARLINK_ERROR_UNKNOWN_FIELD;
 
+                r = varlink_value_materialize(&field->value, object->buffer);
+                if (r < 0)
+                        return r;
+
                 r = varlink_value_write_json(&field->value, stream,
                                              indent >= 0 ? indent + 1 : -1,
                                              key_pre, key_post,
@@ -509,6 +723,48 @@ long varlink_object_write_json(VarlinkObject *object,
         return 0;
 }
 
+long varlink_object_write_compact_json(VarlinkObject *object, Writer *writer) {
+        bool first = true;
+        long r;
+
+        if (varlink_object_json_valid(object))
+                return writer_write(writer, object->json, object->json_length);
+
+        r = writer_put_char(writer, '{');
+        if (r < 0)
+                return r;
+
+        for (AVLTreeNode *node = avl_tree_first(object->fields); node; node = avl_tree_node_next(node)) {
+                Field *field = avl_tree_node_get(node);
+                VarlinkValue name = {
+                        .kind = VARLINK_VALUE_STRING,
+                        .s = field->name
+                };
+
+                if (!first) {
+                        r = writer_put_char(writer, ',');
+                        if (r < 0)
+                                return r;
+                }
+
+                r = varlink_value_write_compact_json(&name, NULL, writer);
+                if (r < 0)
+                        return r;
+
+                r = writer_put_char(writer, ':');
+                if (r < 0)
+                        return r;
+
+                r = varlink_value_write_compact_json(&field->value, object->buffer, writer);
+                if (r < 0)
+                        return r;
+
+                first = false;
+        }
+
+        return writer_put_char(writer, '}');
+}
+
 long varlink_object_to_pretty_json(VarlinkObject *object,
                                    char **stringp,
                                    long indent,
@@ -548,32 +804,89 @@ long varlink_object_to_pretty_json(VarlinkObject *object,
         return size;
 }
 
-_public_ long varlink_object_to_json(VarlinkObject *object, char **stringp) {
-        long ret;
-        locale_t old_locale, new_locale;
+_public_ long varlink_object_freeze(VarlinkObject *object) {
+        StringWriter w;
+        unsigned long n = 0;
+        long length;
+        long r;
 
-        old_locale = uselocale((locale_t) 0);
+        if (varlink_object_json_valid(object))
+                return 0;
 
-        if (old_locale == (locale_t) 0)
-                return -VARLINK_ERROR_PANIC;
+        /* something nested changed, parents holding the old JSON must notice */
+        if (object->json)
+                object_changed(object);
 
-        new_locale = duplocale(old_locale);
+        for (AVLTreeNode *node = avl_tree_first(object->fields); node; node = avl_tree_node_next(node)) {
+                Field *field = avl_tree_node_get(node);
 
-        if (new_locale == (locale_t) 0)
-                return -VARLINK_ERROR_PANIC;
+                r = varlink_value_freeze(&field->value, object->buffer);
+                if (r < 0)
+                        return r;
 
-        new_locale = newlocale(LC_NUMERIC_MASK, "C", new_locale);
+                n = varlink_value_get_generation(&field->value, NULL, n);
+        }
 
-        if (new_locale == (locale_t) 0)
-                return -VARLINK_ERROR_PANIC;
+        if (n > 0) {
+                object->json_generations = calloc(n, sizeof(uint64_t));
+                if (!object->json_generations)
+                        return -VARLINK_ERROR_PANIC;
 
-        if (uselocale(new_locale) == (locale_t) 0)
-                return -VARLINK_ERROR_PANIC;
+                n = 0;
+                for (AVLTreeNode *node = avl_tree_first(object->fields); node; node = avl_tree_node_next(node)) {
+                        Field *field = avl_tree_node_get(node);
 
-        ret = varlink_object_to_pretty_json(object, stringp, -1, NULL, NULL, NULL, NULL);
+                        n = varlink_value_get_generation(&field->value, object->json_generations, n);
+                }
+        }
+
+        string_writer_init(&w);
 
-        uselocale(old_locale);
-        freelocale(new_locale);
+        r = varlink_object_write_compact_json(object, &w.writer);
+        if (r < 0) {
+                string_writer_clear(&w);
+                return r;
+        }
+
+        length = string_writer_steal(&w, &object->json);
+        if (length < 0) {
+                string_writer_clear(&w);
+                return length;
+        }
+
+        object->json_length = length;
+
+        return 0;
+}
+
+/*
+ * The same compact JSON as sent over the wire; stdio is only used for
+ * the pretty output of varlink_object_to_pretty_json().
+ */
+_public_ long varlink_object_to_json(VarlinkObject *object, char **stringp) {
+        StringWriter w;
+        _cleanup_(freep) char *string = NULL;
+        long length;
+        long r;
+
+        string_writer_init(&w);
+
+        r = varlink_object_write_compact_json(object, &w.writer);
+        if (r < 0) {
+                string_writer_clear(&w);
+                return r;
+        }
+
+        length = string_writer_steal(&w, &string);
+        if (length < 0) {
+                string_writer_clear(&w);
+                return length;
+        }
+
+        if (stringp) {
+                *stringp = string;
+                string = NULL;
+        }
 
-        return ret;
+        return length;
 }
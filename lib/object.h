@@ -2,15 +2,40 @@
 
 #pragma once
 
-#include <locale.h>
 #include "scanner.h"
 #include "value.h"
 #include "varlink.h"
 
 #include <stdio.h>
 
-long varlink_object_new_from_scanner(VarlinkObject **objectp, Scanner *scanner, locale_t locale,
-                                     unsigned long depth_cnt);
+long varlink_object_new_from_scanner(VarlinkObject **objectp, Scanner *scanner, unsigned long depth_cnt);
+
+/*
+ * Parses a received message in place. The message is verified to be
+ * UTF-8 as a whole, which is faster than verifying its strings one by
+ * one. The object keeps the buffer alive as long as it exists.
+ */
+long varlink_object_new_from_message(VarlinkObject **objectp, ScannerBuffer *buffer);
+
+/*
+ * Returns the value of a field as it is stored, without parsing it if
+ * it is lazy, and the message buffer it was read from, if any.
+ */
+long varlink_object_peek_value(VarlinkObject *object,
+                               const char *field_name,
+                               VarlinkValue **valuep,
+                               ScannerBuffer **bufferp);
+
+/*
+ * Every change of an object increases its generation.
+ */
+uint64_t varlink_object_get_generation(VarlinkObject *object);
+
+/*
+ * Returns true if the object has cached JSON and neither the object nor
+ * anything nested in it changed since it was written.
+ */
+bool varlink_object_json_valid(VarlinkObject *object);
 
 long varlink_object_write_json(VarlinkObject *object,
                                FILE *stream,
@@ -18,6 +43,12 @@ long varlink_object_write_json(VarlinkObject *object,
                                const char *key_pre, const char *key_post,
                                const char *value_pre, const char *value_post);
 
+/*
+ * Writes the object as compact JSON, the way it is sent over the wire.
+ * Numbers are written independently of the current locale.
+ */
+long varlink_object_write_compact_json(VarlinkObject *object, Writer *writer);
+
 long varlink_object_to_pretty_json(VarlinkObject *object,
                                    char **stringp,
                                    long indent,
@@ -0,0 +1,98 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "pool.h"
+#include "util.h"
+
+#include <stdlib.h>
+
+/* Cached chunks are linked through their first bytes. */
+typedef struct PoolChunk PoolChunk;
+
+struct PoolChunk {
+        PoolChunk *next;
+};
+
+struct BufferPool {
+        PoolChunk *chunks;
+
+        BufferPoolStatistics statistics;
+};
+
+long buffer_pool_new(BufferPool **poolp) {
+        BufferPool *pool;
+
+        pool = calloc(1, sizeof(BufferPool));
+        if (!pool)
+                return -VARLINK_ERROR_PANIC;
+
+        *poolp = pool;
+
+        return 0;
+}
+
+BufferPool *buffer_pool_free(BufferPool *pool) {
+        while (pool->chunks) {
+                PoolChunk *chunk = pool->chunks;
+
+                pool->chunks = chunk->next;
+                free(chunk);
+        }
+
+        free(pool);
+
+        return NULL;
+}
+
+void *buffer_pool_get(BufferPool *pool) {
+        PoolChunk *chunk;
+
+        if (!pool)
+                return malloc(POOL_CHUNK_SIZE);
+
+        if (pool->chunks) {
+                chunk = pool->chunks;
+                pool->chunks = chunk->next;
+                pool->statistics.cached -= 1;
+                pool->statistics.hits += 1;
+        } else {
+                chunk = malloc(POOL_CHUNK_SIZE);
+                if (!chunk)
+                        return NULL;
+
+                pool->statistics.misses += 1;
+        }
+
+        pool->statistics.borrowed += 1;
+        pool->statistics.high_water = MAX(pool->statistics.high_water, pool->statistics.borrowed);
+
+        return chunk;
+}
+
+void buffer_pool_put(BufferPool *pool, void *chunk, unsigned long size) {
+        PoolChunk *c = chunk;
+
+        if (!pool) {
+                free(chunk);
+                return;
+        }
+
+        pool->statistics.borrowed -= 1;
+
+        if (size != POOL_CHUNK_SIZE || pool->statistics.cached >= POOL_MAX_CACHED) {
+                free(chunk);
+                return;
+        }
+
+        c->next = pool->chunks;
+        pool->chunks = c;
+        pool->statistics.cached += 1;
+}
+
+void buffer_pool_disown(BufferPool *pool) {
+        if (pool)
+                pool->statistics.borrowed -= 1;
+}
+
+void buffer_pool_get_statistics(BufferPool *pool, BufferPoolStatistics *statistics) {
+        *statistics = pool->statistics;
+}
@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "varlink.h"
+
+/*
+ * The size of the chunks handed out by a pool; the initial size of all
+ * stream buffers.
+ */
+#define POOL_CHUNK_SIZE (4 * 1024)
+
+/* The number of returned chunks a pool keeps for later use. */
+#define POOL_MAX_CACHED 64
+
+typedef struct {
+        /* chunks handed out from the cache */
+        unsigned long hits;
+        /* chunks which had to be allocated */
+        unsigned long misses;
+
+        /* chunks currently handed out */
+        unsigned long borrowed;
+        /* the highest value borrowed ever reached */
+        unsigned long high_water;
+
+        /* chunks currently in the cache */
+        unsigned long cached;
+} BufferPoolStatistics;
+
+/*
+ * A cache of fixed-size memory chunks, which the streams of a service
+ * borrow while they hold data, and give back once they are drained.
+ */
+typedef struct BufferPool BufferPool;
+
+long buffer_pool_new(BufferPool **poolp);
+BufferPool *buffer_pool_free(BufferPool *pool);
+
+/*
+ * Returns a chunk of POOL_CHUNK_SIZE bytes or NULL, if memory could not
+ * be allocated. A NULL pool hands out freshly allocated memory.
+ */
+void *buffer_pool_get(BufferPool *pool);
+
+/*
+ * Gives back memory obtained from buffer_pool_get(). The chunk might
+ * have been resized with realloc() in the meantime, only chunks which
+ * still have their original size are kept for reuse.
+ */
+void buffer_pool_put(BufferPool *pool, void *chunk, unsigned long size);
+
+/*
+ * Stops accounting for a chunk which is not given back, because it is
+ * still in use after its stream is done with it. Whoever holds it last
+ * frees it with free().
+ */
+void buffer_pool_disown(BufferPool *pool);
+
+void buffer_pool_get_statistics(BufferPool *pool, BufferPoolStatistics *statistics);
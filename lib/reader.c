@@ -0,0 +1,377 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "object.h"
+#include "scanner.h"
+#include "util.h"
+#include "value.h"
+#include "writer.h"
+
+#include <string.h>
+
+/*
+ * A reader walks through JSON text without building objects or arrays
+ * from it. Only the current key or string is decoded, the memory it
+ * uses does not depend on the size of the input.
+ */
+struct VarlinkReader {
+        Scanner *scanner;
+
+        /* the received message the scanner reads from */
+        VarlinkObject *object;
+        ScannerBuffer *buffer;
+
+        /* the JSON text, if it was not read from a received message */
+        char *json;
+
+        /* the open objects and arrays, and the kind of the array elements */
+        VarlinkValueKind containers[JSON_MAX_DEPTH];
+        VarlinkValueKind element_kinds[JSON_MAX_DEPTH];
+        unsigned long depth;
+
+        /* the next member is the first one of its container */
+        bool first;
+
+        /* a key was read, its value follows */
+        bool key;
+
+        /* nothing may follow the value */
+        bool check_end;
+        bool done;
+
+        long event;
+        bool b;
+        int64_t i;
+        double f;
+        char *string;
+};
+
+static long reader_new(VarlinkReader **readerp) {
+        VarlinkReader *reader;
+
+        reader = calloc(1, sizeof(VarlinkReader));
+        if (!reader)
+                return -VARLINK_ERROR_PANIC;
+
+        *readerp = reader;
+
+        return 0;
+}
+
+_public_ long varlink_reader_new_from_json(VarlinkReader **readerp, const char *json) {
+        _cleanup_(varlink_reader_freep) VarlinkReader *reader = NULL;
+        long r;
+
+        r = reader_new(&reader);
+        if (r < 0)
+                return r;
+
+        reader->json = strdup(json);
+        if (!reader->json)
+                return -VARLINK_ERROR_PANIC;
+
+        r = scanner_new(&reader->scanner, reader->json, false);
+        if (r < 0)
+                return r;
+
+        reader->check_end = true;
+
+        *readerp = reader;
+        reader = NULL;
+
+        return 0;
+}
+
+_public_ long varlink_reader_new_from_field(VarlinkReader **readerp,
+                                            VarlinkObject *object,
+                                            const char *field_name) {
+        _cleanup_(varlink_reader_freep) VarlinkReader *reader = NULL;
+        VarlinkValue *value;
+        ScannerBuffer *buffer;
+        long r;
+
+        r = varlink_object_peek_value(object, field_name, &value, &buffer);
+        if (r < 0)
+                return r;
+
+        r = reader_new(&reader);
+        if (r < 0)
+                return r;
+
+        if (value->lazy) {
+                if (!value->raw)
+                        return -VARLINK_ERROR_INVALID_JSON;
+
+                /* read the value where it is in the received message */
+                r = scanner_new(&reader->scanner, value->raw, false);
+                if (r < 0)
+                        return r;
+
+                /* it was validated when the message was received */
+                reader->scanner->utf8_verified = true;
+                reader->object = varlink_object_ref(object);
+
+                /* the value must not be parsed in place while we read it */
+                reader->buffer = buffer;
+                buffer->n_readers += 1;
+
+        } else {
+                StringWriter w;
+
+                string_writer_init(&w);
+
+                r = varlink_value_write_compact_json(value, buffer, &w.writer);
+                if (r >= 0)
+                        r = string_writer_steal(&w, &reader->json);
+                if (r < 0) {
+                        string_writer_clear(&w);
+                        return r;
+                }
+
+                r = scanner_new(&reader->scanner, reader->json, false);
+                if (r < 0)
+                        return r;
+
+                reader->check_end = true;
+        }
+
+        *readerp = reader;
+        reader = NULL;
+
+        return 0;
+}
+
+_public_ VarlinkReader *varlink_reader_free(VarlinkReader *reader) {
+        if (reader->scanner)
+                scanner_free(reader->scanner);
+
+        if (reader->buffer)
+                reader->buffer->n_readers -= 1;
+
+        if (reader->object)
+                varlink_object_unref(reader->object);
+
+        free(reader->json);
+        free(reader->string);
+        free(reader);
+
+        return NULL;
+}
+
+_public_ void varlink_reader_freep(VarlinkReader **readerp) {
+        if (*readerp)
+                varlink_reader_free(*readerp);
+}
+
+/*
+ * Varlink arrays hold elements of one kind, `null` is accepted for
+ * any kind.
+ */
+static bool reader_check_element(VarlinkReader *reader, VarlinkValueKind kind) {
+        VarlinkValueKind *element_kind;
+
+        if (reader->depth == 0 || reader->containers[reader->depth - 1] != VARLINK_VALUE_ARRAY)
+                return true;
+
+        if (kind == VARLINK_VALUE_NULL)
+                return true;
+
+        element_kind = &reader->element_kinds[reader->depth - 1];
+        if (*element_kind == VARLINK_VALUE_UNDEFINED)
+                *element_kind = kind;
+
+        return *element_kind == kind;
+}
+
+static long reader_event(VarlinkReader *reader, long event) {
+        if (reader->depth == 0) {
+                reader->done = true;
+
+                if (reader->check_end && scanner_peek(reader->scanner) != '\0')
+                        return -VARLINK_ERROR_INVALID_JSON;
+        }
+
+        reader->event = event;
+
+        return event;
+}
+
+_public_ long varlink_reader_next(VarlinkReader *reader) {
+        Scanner *scanner = reader->scanner;
+        VarlinkValueKind kind;
+        ScannerNumber number;
+        long event;
+
+        free(reader->string);
+        reader->string = NULL;
+
+        if (reader->done) {
+                reader->event = VARLINK_READER_END;
+                return VARLINK_READER_END;
+        }
+
+        if (reader->depth > 0 && !reader->key) {
+                VarlinkValueKind container = reader->containers[reader->depth - 1];
+
+                if (container == VARLINK_VALUE_OBJECT && scanner_peek(scanner) == '}') {
+                        scanner->p += 1;
+                        reader->depth -= 1;
+                        reader->first = false;
+                        return reader_event(reader, VARLINK_READER_OBJECT_END);
+                }
+
+                if (container == VARLINK_VALUE_ARRAY && scanner_peek(scanner) == ']') {
+                        scanner->p += 1;
+                        reader->depth -= 1;
+                        reader->first = false;
+                        return reader_event(reader, VARLINK_READER_ARRAY_END);
+                }
+
+                if (!reader->first) {
+                        if (scanner_expect_operator(scanner, ",") < 0)
+                                return -VARLINK_ERROR_INVALID_JSON;
+                }
+
+                reader->first = false;
+
+                if (container == VARLINK_VALUE_OBJECT) {
+                        if (scanner_expect_string(scanner, &reader->string) < 0)
+                                return -VARLINK_ERROR_INVALID_JSON;
+
+                        if (scanner_expect_operator(scanner, ":") < 0)
+                                return -VARLINK_ERROR_INVALID_JSON;
+
+                        reader->key = true;
+                        reader->event = VARLINK_READER_KEY;
+
+                        return VARLINK_READER_KEY;
+                }
+        }
+
+        reader->key = false;
+
+        if (scanner_peek(scanner) == '{' || scanner_peek(scanner) == '[') {
+                if (scanner_peek(scanner) == '{') {
+                        kind = VARLINK_VALUE_OBJECT;
+                        event = VARLINK_READER_OBJECT_BEGIN;
+                } else {
+                        kind = VARLINK_VALUE_ARRAY;
+                        event = VARLINK_READER_ARRAY_BEGIN;
+                }
+
+                if (reader->depth + 1 >= JSON_MAX_DEPTH || !reader_check_element(reader, kind))
+                        return -VARLINK_ERROR_INVALID_JSON;
+
+                scanner->p += 1;
+                reader->containers[reader->depth] = kind;
+                reader->element_kinds[reader->depth] = VARLINK_VALUE_UNDEFINED;
+                reader->depth += 1;
+                reader->first = true;
+                reader->event = event;
+
+                return event;
+        }
+
+        if (scanner_read_keyword(scanner, "null")) {
+                kind = VARLINK_VALUE_NULL;
+                event = VARLINK_READER_NULL;
+
+        } else if (scanner_read_keyword(scanner, "true")) {
+                reader->b = true;
+                kind = VARLINK_VALUE_BOOL;
+                event = VARLINK_READER_BOOL;
+
+        } else if (scanner_read_keyword(scanner, "false")) {
+                reader->b = false;
+                kind = VARLINK_VALUE_BOOL;
+                event = VARLINK_READER_BOOL;
+
+        } else if (scanner_peek(scanner) == '"') {
+                if (scanner_expect_string(scanner, &reader->string) < 0)
+                        return -VARLINK_ERROR_INVALID_JSON;
+
+                kind = VARLINK_VALUE_STRING;
+                event = VARLINK_READER_STRING;
+
+        } else if (scanner_read_number(scanner, &number)) {
+                if (number.is_double) {
+                        reader->f = number.d;
+                        kind = VARLINK_VALUE_FLOAT;
+                        event = VARLINK_READER_FLOAT;
+                } else {
+                        reader->i = number.i;
+                        kind = VARLINK_VALUE_INT;
+                        event = VARLINK_READER_INT;
+                }
+
+        } else
+                return -VARLINK_ERROR_INVALID_JSON;
+
+        if (!reader_check_element(reader, kind))
+                return -VARLINK_ERROR_INVALID_JSON;
+
+        return reader_event(reader, event);
+}
+
+_public_ long varlink_reader_skip(VarlinkReader *reader) {
+        long r;
+
+        if (reader->event == VARLINK_READER_KEY) {
+                r = varlink_reader_next(reader);
+                if (r < 0)
+                        return r;
+        }
+
+        if (reader->event == VARLINK_READER_OBJECT_BEGIN || reader->event == VARLINK_READER_ARRAY_BEGIN) {
+                unsigned long depth = reader->depth - 1;
+
+                while (reader->depth > depth) {
+                        r = varlink_reader_next(reader);
+                        if (r < 0)
+                                return r;
+                }
+        }
+
+        return 0;
+}
+
+_public_ unsigned long varlink_reader_get_depth(VarlinkReader *reader) {
+        return reader->depth;
+}
+
+_public_ long varlink_reader_get_bool(VarlinkReader *reader, bool *bp) {
+        if (reader->event != VARLINK_READER_BOOL)
+                return -VARLINK_ERROR_INVALID_TYPE;
+
+        *bp = reader->b;
+
+        return 0;
+}
+
+_public_ long varlink_reader_get_int(VarlinkReader *reader, int64_t *ip) {
+        if (reader->event != VARLINK_READER_INT)
+                return -VARLINK_ERROR_INVALID_TYPE;
+
+        *ip = reader->i;
+
+        return 0;
+}
+
+_public_ long varlink_reader_get_float(VarlinkReader *reader, double *fp) {
+        if (reader->event == VARLINK_READER_INT)
+                *fp = reader->i;
+        else if (reader->event == VARLINK_READER_FLOAT)
+                *fp = reader->f;
+        else
+                return -VARLINK_ERROR_INVALID_TYPE;
+
+        return 0;
+}
+
+_public_ long varlink_reader_get_string(VarlinkReader *reader, const char **stringp) {
+        if (reader->event != VARLINK_READER_STRING && reader->event != VARLINK_READER_KEY)
+                return -VARLINK_ERROR_INVALID_TYPE;
+
+        *stringp = reader->string;
+
+        return 0;
+}
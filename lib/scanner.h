@@ -4,7 +4,6 @@
 
 #include <stdbool.h>
 #include <stdint.h>
-#include <locale.h>
 
 enum {
         SCANNER_ERROR_PANIC = 1,
@@ -25,13 +24,80 @@ enum {
         SCANNER_ERROR_MAX
 };
 
+/*
+ * A received message, which is parsed in place: its strings are decoded
+ * within the buffer and handed out without copying them. Every object
+ * and array parsed from it holds a reference.
+ */
+typedef struct {
+        unsigned long refcount;
+        unsigned long length;
+        char *data;
+
+        /*
+         * The readers which walk through lazy values in data. As long as
+         * there are any, lazy values are parsed into copies, not in place.
+         */
+        unsigned long n_readers;
+
+        /* the memory data points into, if it does not belong to the buffer */
+        void *owner;
+        void (*owner_unref)(void *owner);
+
+        char inline_data[];
+} ScannerBuffer;
+
+long scanner_buffer_new(ScannerBuffer **bufferp, unsigned long length);
+
+/*
+ * Creates a buffer for length bytes at data, which are followed by a
+ * NUL. It takes over a reference to owner, which keeps data alive, and
+ * drops it with owner_unref() when the buffer is freed.
+ */
+long scanner_buffer_new_borrowed(ScannerBuffer **bufferp,
+                                 char *data,
+                                 unsigned long length,
+                                 void *owner,
+                                 void (*owner_unref)(void *owner));
+ScannerBuffer *scanner_buffer_ref(ScannerBuffer *buffer);
+ScannerBuffer *scanner_buffer_unref(ScannerBuffer *buffer);
+void scanner_buffer_unrefp(ScannerBuffer **bufferp);
+
+/*
+ * A key of an object which is only validated. It points to the raw key
+ * in the string, or to a decoded copy if the key has escape sequences.
+ */
+typedef struct {
+        const char *name;
+        unsigned long length;
+        unsigned long index;
+        char *copy;
+        bool null;
+} ScannerKey;
+
 typedef struct {
         const char *string;
+        const char *end;
         const char *p;
         const char *pline;
         unsigned long line_nr;
 
         bool comments;
+
+        /* the whole string is valid UTF-8, its strings are not verified again */
+        bool utf8_verified;
+
+        /* parse strings in place, string points to its data */
+        ScannerBuffer *buffer;
+
+        /* nested objects and arrays are only validated, see VarlinkValue */
+        bool lazy;
+
+        /* keys of the validated objects, to find duplicates without copies */
+        ScannerKey *keys;
+        unsigned long n_keys;
+        unsigned long n_keys_allocated;
+
         const char *last_comment_start;
 
         struct {
@@ -53,6 +119,14 @@ void scanner_error(Scanner *scanner, long error);
 const char *scanner_error_string(long error);
 
 long scanner_new(Scanner **scannerp, const char *string, bool comments);
+long scanner_new_in_place(Scanner **scannerp, ScannerBuffer *buffer);
+
+/*
+ * Returns the end of the object or array at p, which was validated
+ * before.
+ */
+const char *scanner_skip_nested(Scanner *scanner, const char *p);
+
 Scanner *scanner_free(Scanner *scanner);
 void scanner_freep(Scanner **scannerp);
 
@@ -76,10 +150,19 @@ char scanner_peek(Scanner *scanner);
  * expected token. If it is, they advance the scanner past that token
  * and return 0. Otherwise, they return an error and set the scanner's
  * error.
+ *
+ * A string parsed in place points into the buffer of the scanner, and
+ * must not be freed.
  */
 long scanner_expect_interface_name(Scanner *scanner, char **namep);
 long scanner_expect_field_name(Scanner *scanner, char **namep);
 long scanner_expect_string(Scanner *scanner, char **stringp);
+
+/*
+ * Reads a string into newly allocated memory, also when the scanner
+ * parses in place; the buffer is left untouched.
+ */
+long scanner_expect_string_copy(Scanner *scanner, char **stringp);
 long scanner_expect_member_name(Scanner *scanner, char **namep);
 long scanner_expect_operator(Scanner *scanner, const char *op);
 long scanner_expect_type_name(Scanner *scanner, char **namep);
@@ -89,4 +172,10 @@ long scanner_expect_type_name(Scanner *scanner, char **namep);
  * is of the expected type. Otherwise, they return false.
  */
 bool scanner_read_keyword(Scanner *scanner, const char *keyword);
-bool scanner_read_number(Scanner *scanner, ScannerNumber *numberp, locale_t locale);
+
+/*
+ * Numbers are parsed independently of the current locale. Integers
+ * which do not fit into an int64_t and floats which overflow a double
+ * are not accepted.
+ */
+bool scanner_read_number(Scanner *scanner, ScannerNumber *numberp);
@@ -7,8 +7,11 @@
 #include "stream.h"
 #include "transport.h"
 #include "uri.h"
+#include "uring.h"
 #include "util.h"
 
+#include <errno.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -16,16 +19,63 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/queue.h>
 #include <unistd.h>
 
 #include "org.varlink.service.varlink.c.inc"
+#include "org.varlink.statistics.varlink.c.inc"
+
+/*
+ * Requests on the ring carry the service or connection they belong to,
+ * with the kind of request in the low bits.
+ */
+enum {
+        URING_OP_ACCEPT = 0,
+        URING_OP_RECV,
+        URING_OP_SEND,
+        URING_OP_WAKE,
+        URING_OP_CANCEL,
+        URING_OP_MASK = 7
+};
+
+#define URING_USER_DATA(_ptr, _op) ((uint64_t)(uintptr_t)(_ptr) | (_op))
 
-typedef struct {
+typedef struct ServiceConnection ServiceConnection;
+
+struct ServiceConnection {
+        VarlinkService *service;
         VarlinkStream *stream;
         uint32_t events_mask;
         uint32_t current_events_mask;
         VarlinkCall *call;
-} ServiceConnection;
+
+        /* calls which have been read but not dispatched yet */
+        VarlinkObject *messages[STREAM_READ_BATCH];
+        unsigned long n_messages;
+        unsigned long i_message;
+
+        bool dispatching;
+
+        /* the output went above the high watermark and did not drain yet */
+        bool blocked;
+
+        /* corked replies are waiting to be flushed */
+        bool flush_pending;
+        LIST_ENTRY(ServiceConnection) flush_entry;
+
+        /* requests on the ring which did not complete yet */
+        unsigned long n_requests;
+        bool receiving;
+        bool canceling;
+
+        /* closed, but freed only with the last completion of its requests */
+        bool closed;
+
+        /* the output handed to the ring, while a send is in flight */
+        struct msghdr send_message;
+        struct iovec send_iov[2];
+        bool sending;
+};
 
 struct VarlinkService {
         char *vendor;
@@ -41,6 +91,28 @@ struct VarlinkService {
         int epoll_fd;
 
         AVLTree *connections;
+        BufferPool *pool;
+        unsigned long max_message_size;
+
+        unsigned long cork_threshold;
+        bool dispatching;
+
+        unsigned long high_watermark;
+        unsigned long low_watermark;
+
+        LIST_HEAD(, ServiceConnection) flush_list;
+
+        /* the ring of the io_uring backend, NULL with epoll */
+        Uring *uring;
+        unsigned long n_requests;
+        bool accepting;
+        bool multishot_accept;
+        bool multishot_recv;
+
+        /* the counters of the connections which were closed already */
+        StreamStatistics closed_statistics;
+        unsigned long long n_accepted;
+
         VarlinkMethodCallback method_callback;
         void *method_callback_userdata;
 };
@@ -57,6 +129,9 @@ struct VarlinkCall {
 
         VarlinkCallConnectionClosed closed_callback;
         void *closed_callback_userdata;
+
+        VarlinkCallWritable writable_callback;
+        void *writable_callback_userdata;
 };
 
 static long varlink_call_new(VarlinkCall **callp,
@@ -109,9 +184,55 @@ _public_ void varlink_call_unrefp(VarlinkCall **callp) {
                 varlink_call_unref(*callp);
 }
 
+static long service_connection_set_events_mask(VarlinkService *service,
+                                               ServiceConnection *connection,
+                                               uint32_t events_mask);
+static long service_connection_update_receive(VarlinkService *service, ServiceConnection *connection);
+static void service_uring_free(VarlinkService *service);
+
+/*
+ * The connection is idle again. Listen for the next call, and wake up
+ * right away if it has already been received.
+ */
+static void service_connection_resume(VarlinkService *service, ServiceConnection *connection) {
+        if (service->uring) {
+                if (connection->i_message < connection->n_messages || connection->stream->in.length > 0) {
+                        if (uring_nop(service->uring, URING_USER_DATA(connection, URING_OP_WAKE)) == 0) {
+                                connection->n_requests += 1;
+                                service->n_requests += 1;
+                        }
+                }
+
+                service_connection_update_receive(service, connection);
+
+                if (!service->dispatching)
+                        uring_submit(service->uring);
+
+                return;
+        }
+
+        connection->events_mask |= EPOLLIN;
+        if (connection->i_message < connection->n_messages || connection->stream->in.length > 0)
+                connection->events_mask |= EPOLLOUT;
+
+        service_connection_set_events_mask(service, connection, connection->events_mask);
+}
+
 static void varlink_call_remove_from_connection(VarlinkCall *call) {
+        VarlinkService *service = call->service;
         ServiceConnection *connection = call->connection;
+
         connection->call = varlink_call_unref(call);
+
+        /* A reply from inside of a method callback, dispatching continues. */
+        if (connection->dispatching)
+                return;
+
+        /* Reading resumes when the output drained. */
+        if (connection->blocked)
+                return;
+
+        service_connection_resume(service, connection);
 }
 
 _public_ const char *varlink_call_get_method(VarlinkCall *call) {
@@ -139,10 +260,50 @@ static ServiceConnection *service_connection_free(ServiceConnection *connection)
                         call->closed_callback(call, call->closed_callback_userdata);
 
                 varlink_call_unref(call);
+                connection->call = NULL;
+        }
+
+        if (connection->flush_pending) {
+                LIST_REMOVE(connection, flush_entry);
+                connection->flush_pending = false;
+        }
+
+        for (unsigned long i = connection->i_message; i < connection->n_messages; i += 1)
+                varlink_object_unref(connection->messages[i]);
+
+        connection->i_message = connection->n_messages = 0;
+
+        /*
+         * The ring still uses the socket and the output, keep both until
+         * the last request completed. The socket stays open, so that its
+         * number is not reused in the meantime.
+         */
+        if (connection->n_requests > 0) {
+                VarlinkService *service = connection->service;
+
+                if (!connection->closed) {
+                        connection->closed = true;
+
+                        if (uring_cancel(service->uring, 0, connection->stream->fd,
+                                         URING_USER_DATA(connection, URING_OP_CANCEL)) == 0) {
+                                connection->n_requests += 1;
+                                service->n_requests += 1;
+                        }
+
+                        if (!service->dispatching)
+                                uring_submit(service->uring);
+                }
+
+                return NULL;
         }
 
-        if (connection->stream)
+        if (connection->stream) {
+                StreamStatistics statistics;
+
+                varlink_stream_get_statistics(connection->stream, &statistics);
+                stream_statistics_add(&connection->service->closed_statistics, &statistics);
                 varlink_stream_free(connection->stream);
+        }
 
         free(connection);
         return NULL;
@@ -156,7 +317,9 @@ static void service_connection_freep(ServiceConnection **connectionp) {
 static long service_connection_close(VarlinkService *service,
                                      ServiceConnection *connection) {
         if (connection->stream) {
-                epoll_ctl(service->epoll_fd, EPOLL_CTL_DEL, connection->stream->fd, NULL);
+                if (!service->uring)
+                        epoll_ctl(service->epoll_fd, EPOLL_CTL_DEL, connection->stream->fd, NULL);
+
                 avl_tree_remove(service->connections, (void *)(unsigned long)connection->stream->fd);
         }
 
@@ -267,6 +430,7 @@ static long varlink_service_method_callback(VarlinkService *service,
         _cleanup_(varlink_uri_freep) VarlinkURI *uri = NULL;
         VarlinkInterface *interface;
         VarlinkMethod *method;
+        const char *parameter;
         long r;
 
         r = varlink_uri_new(&uri, call->method, true, true);
@@ -284,6 +448,23 @@ static long varlink_service_method_callback(VarlinkService *service,
         if (!method->callback)
                 return varlink_call_reply_method_not_implemented(call, uri->member);
 
+        /* handlers only see parameters which match the method's signature */
+        if (call->parameters) {
+                r = varlink_interface_check_object(interface, method->type_in, call->parameters, &parameter);
+        } else {
+                _cleanup_(varlink_object_unrefp) VarlinkObject *empty = NULL;
+
+                r = varlink_object_new(&empty);
+                if (r < 0)
+                        return r;
+
+                r = varlink_interface_check_object(interface, method->type_in, empty, &parameter);
+        }
+        if (r == -VARLINK_ERROR_INVALID_TYPE)
+                return varlink_call_reply_invalid_parameter(call, parameter);
+        if (r < 0)
+                return r;
+
         return method->callback(service, call, call->parameters, call->flags, method->callback_userdata);
 }
 
@@ -301,6 +482,7 @@ _public_ long varlink_service_new_raw(VarlinkService **servicep,
 
         service->listen_fd = -1;
         service->epoll_fd = -1;
+        LIST_INIT(&service->flush_list);
 
         r = varlink_uri_new(&service->uri, address, false, false);
         if (r < 0)
@@ -311,6 +493,10 @@ _public_ long varlink_service_new_raw(VarlinkService **servicep,
 
         avl_tree_new(&service->connections, connection_compare, (AVLFreepFunc)service_connection_freep);
 
+        r = buffer_pool_new(&service->pool);
+        if (r < 0)
+                return r;
+
         if (listen_fd < 0) {
                 _cleanup_(freep) char *path = NULL;
 
@@ -409,6 +595,14 @@ _public_ VarlinkService *varlink_service_free(VarlinkService *service) {
         if (service->connections)
                 avl_tree_free(service->connections);
 
+        /* after the connections, which wait for their requests on the ring */
+        if (service->uring)
+                service_uring_free(service);
+
+        /* after the connections, which return their buffers to it */
+        if (service->pool)
+                buffer_pool_free(service->pool);
+
         if (service->interfaces)
                 avl_tree_free(service->interfaces);
 
@@ -461,6 +655,26 @@ _public_ long varlink_service_add_interface(VarlinkService *service,
         }
         va_end(args);
 
+        /* the keys of the messages we expect, peers cannot add atoms */
+        for (unsigned long i = 0; i < interface->n_members; i += 1) {
+                VarlinkInterfaceMember *member = interface->members[i];
+
+                switch (member->type) {
+                        case VARLINK_MEMBER_ALIAS:
+                                varlink_type_intern_field_names(member->alias);
+                                break;
+
+                        case VARLINK_MEMBER_METHOD:
+                                varlink_type_intern_field_names(member->method->type_in);
+                                varlink_type_intern_field_names(member->method->type_out);
+                                break;
+
+                        case VARLINK_MEMBER_ERROR:
+                                varlink_type_intern_field_names(member->error);
+                                break;
+                }
+        }
+
         switch (avl_tree_insert(service->interfaces, interface->name, interface)) {
                 case 0:
                         break;
@@ -481,32 +695,208 @@ _public_ int varlink_service_get_fd(VarlinkService *service) {
         return service->epoll_fd;
 }
 
-static long varlink_service_accept(VarlinkService *service) {
+_public_ void varlink_service_set_max_message_size(VarlinkService *service, unsigned long size) {
+        service->max_message_size = size;
+
+        for (AVLTreeNode *node = avl_tree_first(service->connections); node; node = avl_tree_node_next(node)) {
+                ServiceConnection *connection = avl_tree_node_get(node);
+
+                varlink_stream_set_max_message_size(connection->stream, size);
+        }
+}
+
+_public_ void varlink_service_set_cork_threshold(VarlinkService *service, unsigned long threshold) {
+        service->cork_threshold = threshold;
+
+        for (AVLTreeNode *node = avl_tree_first(service->connections); node; node = avl_tree_node_next(node)) {
+                ServiceConnection *connection = avl_tree_node_get(node);
+
+                varlink_stream_set_cork(connection->stream, threshold);
+        }
+}
+
+_public_ void varlink_service_set_output_watermarks(VarlinkService *service, unsigned long high, unsigned long low) {
+        service->high_watermark = high;
+        service->low_watermark = MIN(low, high);
+}
+
+_public_ long varlink_service_get_buffer_statistics(VarlinkService *service, VarlinkObject **statisticsp) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *statistics = NULL;
+        BufferPoolStatistics s;
+        long r;
+
+        buffer_pool_get_statistics(service->pool, &s);
+
+        r = varlink_object_new(&statistics);
+        if (r < 0)
+                return r;
+
+        varlink_object_set_int(statistics, "hits", s.hits);
+        varlink_object_set_int(statistics, "misses", s.misses);
+        varlink_object_set_int(statistics, "borrowed", s.borrowed);
+        varlink_object_set_int(statistics, "highWater", s.high_water);
+        varlink_object_set_int(statistics, "cached", s.cached);
+
+        *statisticsp = statistics;
+        statistics = NULL;
+
+        return 0;
+}
+
+static long stream_statistics_to_object(const StreamStatistics *s, VarlinkObject **objectp) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *object = NULL;
+        long r;
+
+        r = varlink_object_new(&object);
+        if (r < 0)
+                return r;
+
+        varlink_object_set_int(object, "bytesRead", s->bytes_read);
+        varlink_object_set_int(object, "bytesWritten", s->bytes_written);
+        varlink_object_set_int(object, "reads", s->reads);
+        varlink_object_set_int(object, "writes", s->writes);
+        varlink_object_set_int(object, "readsBlocked", s->reads_blocked);
+        varlink_object_set_int(object, "writesBlocked", s->writes_blocked);
+        varlink_object_set_int(object, "partialWrites", s->partial_writes);
+        varlink_object_set_int(object, "moved", s->moved);
+        varlink_object_set_int(object, "copied", s->copied);
+        varlink_object_set_int(object, "inHighWater", s->in_high_water);
+        varlink_object_set_int(object, "outHighWater", s->out_high_water);
+
+        *objectp = object;
+        object = NULL;
+
+        return 0;
+}
+
+_public_ long varlink_service_get_statistics(VarlinkService *service, VarlinkObject **statisticsp) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *statistics = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *total_object = NULL;
+        _cleanup_(varlink_array_unrefp) VarlinkArray *connections = NULL;
+        StreamStatistics total = service->closed_statistics;
+        long r;
+
+        r = varlink_array_new(&connections);
+        if (r < 0)
+                return r;
+
+        for (AVLTreeNode *node = avl_tree_first(service->connections); node; node = avl_tree_node_next(node)) {
+                ServiceConnection *connection = avl_tree_node_get(node);
+                _cleanup_(varlink_object_unrefp) VarlinkObject *entry = NULL;
+                _cleanup_(varlink_object_unrefp) VarlinkObject *object = NULL;
+                StreamStatistics s;
+
+                varlink_stream_get_statistics(connection->stream, &s);
+                stream_statistics_add(&total, &s);
+
+                r = stream_statistics_to_object(&s, &object);
+                if (r < 0)
+                        return r;
+
+                r = varlink_object_new(&entry);
+                if (r < 0)
+                        return r;
+
+                varlink_object_set_int(entry, "fd", connection->stream->fd);
+                varlink_object_set_int(entry, "pending", varlink_stream_get_pending(connection->stream));
+                varlink_object_set_object(entry, "statistics", object);
+
+                r = varlink_array_append_object(connections, entry);
+                if (r < 0)
+                        return r;
+        }
+
+        r = stream_statistics_to_object(&total, &total_object);
+        if (r < 0)
+                return r;
+
+        r = varlink_object_new(&statistics);
+        if (r < 0)
+                return r;
+
+        varlink_object_set_int(statistics, "accepted", service->n_accepted);
+        varlink_object_set_object(statistics, "total", total_object);
+        varlink_object_set_array(statistics, "connections", connections);
+
+        *statisticsp = statistics;
+        statistics = NULL;
+
+        return 0;
+}
+
+static long org_varlink_statistics_GetStatistics(VarlinkService *service,
+                                                 VarlinkCall *call,
+                                                 VarlinkObject *UNUSED(parameters),
+                                                 uint64_t UNUSED(flags),
+                                                 void *UNUSED(userdata)) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *statistics = NULL;
+        long r;
+
+        r = varlink_service_get_statistics(service, &statistics);
+        if (r < 0)
+                return r;
+
+        return varlink_call_reply(call, statistics, 0);
+}
+
+_public_ long varlink_service_enable_statistics(VarlinkService *service) {
+        return varlink_service_add_interface(service, org_varlink_statistics_varlink,
+                                             "GetStatistics", org_varlink_statistics_GetStatistics, NULL,
+                                             NULL);
+}
+
+/*
+ * Takes over an accepted socket.
+ */
+static long service_add_connection(VarlinkService *service, int fd) {
         _cleanup_(service_connection_freep) ServiceConnection *connection = NULL;
+        _cleanup_(closep) int fd_owned = fd;
         long r;
 
         connection = calloc(1, sizeof(ServiceConnection));
         if (!connection)
                 return -VARLINK_ERROR_PANIC;
 
+        connection->service = service;
         connection->current_events_mask = EPOLLIN;
 
-        r = varlink_transport_accept(service->uri, service->listen_fd);
+        r = varlink_stream_new(&connection->stream, fd);
         if (r < 0)
-                return r; /* CannotAccept */
+                return r;
 
-        varlink_stream_new(&connection->stream, (int)r);
+        fd_owned = -1;
+        connection->stream->pool = service->pool;
+        connection->stream->external_io = service->uring != NULL;
+        varlink_stream_set_max_message_size(connection->stream, service->max_message_size);
+        varlink_stream_set_cork(connection->stream, service->cork_threshold);
 
-        r = epoll_add(service->epoll_fd, connection->stream->fd, connection->current_events_mask, connection);
-        if (r < 0)
-                return -VARLINK_ERROR_PANIC;
+        if (service->uring) {
+                r = service_connection_update_receive(service, connection);
+                if (r < 0)
+                        return r;
+        } else {
+                r = epoll_add(service->epoll_fd, connection->stream->fd, connection->current_events_mask, connection);
+                if (r < 0)
+                        return -VARLINK_ERROR_PANIC;
+        }
 
         avl_tree_insert(service->connections, (void *)(unsigned long)connection->stream->fd, connection);
+        service->n_accepted += 1;
 
         connection = NULL;
         return 0;
 }
 
+static long varlink_service_accept(VarlinkService *service) {
+        int fd;
+
+        fd = varlink_transport_accept(service->uri, service->listen_fd);
+        if (fd < 0)
+                return fd; /* CannotAccept */
+
+        return service_add_connection(service, fd);
+}
+
 static long service_connection_set_events_mask(VarlinkService *service,
                                                ServiceConnection *connection,
                                                uint32_t events_mask) {
@@ -524,6 +914,78 @@ static long service_connection_set_events_mask(VarlinkService *service,
         return 0;
 }
 
+/*
+ * Unblocks the connection once its output drained to the low watermark
+ * and tells the producer of the current call to continue.
+ */
+static void service_connection_check_writable(VarlinkService *service, ServiceConnection *connection) {
+        VarlinkCall *call = connection->call;
+
+        if (!connection->blocked || varlink_stream_get_pending(connection->stream) > service->low_watermark)
+                return;
+
+        connection->blocked = false;
+
+        if (!call) {
+                service_connection_resume(service, connection);
+                return;
+        }
+
+        if (call->writable_callback)
+                call->writable_callback(call, call->writable_callback_userdata);
+}
+
+/*
+ * Dispatches the received calls one after the other, until a call does
+ * not reply right away or the output is blocked. Returns 1 if the
+ * connection has been closed.
+ */
+static long service_connection_dispatch_calls(VarlinkService *service, ServiceConnection *connection) {
+        long r;
+
+        while (!connection->call && !connection->blocked) {
+                _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
+
+                if (connection->i_message == connection->n_messages) {
+                        r = varlink_stream_read_batch(connection->stream,
+                                                      connection->messages,
+                                                      ARRAY_SIZE(connection->messages));
+                        if (r < 0) {
+                                service_connection_close(service, connection);
+                                return 1;
+                        }
+
+                        /* We did not receive a full message. */
+                        if (r == 0)
+                                break;
+
+                        connection->n_messages = r;
+                        connection->i_message = 0;
+                }
+
+                message = connection->messages[connection->i_message];
+                connection->i_message += 1;
+
+                r = varlink_call_new(&connection->call, service, connection, message);
+                if (r < 0)
+                        return r;
+
+                connection->dispatching = true;
+                r = service->method_callback(service,
+                                             connection->call,
+                                             connection->call->parameters,
+                                             connection->call->flags,
+                                             service->method_callback_userdata);
+                connection->dispatching = false;
+                if (r < 0) {
+                        service_connection_close(service, connection);
+                        return 1;
+                }
+        }
+
+        return 0;
+}
+
 static long varlink_service_dispatch_connection(VarlinkService *service,
                                                 ServiceConnection *connection,
                                                 uint32_t events) {
@@ -539,46 +1001,397 @@ static long varlink_service_dispatch_connection(VarlinkService *service,
                 /* We did not write all data, wake up when we can write to the socket. */
                 if (r > 0)
                         connection->events_mask |= EPOLLOUT;
+
+                service_connection_check_writable(service, connection);
         }
 
-        if (events & EPOLLIN) {
-                while (!connection->call) {
-                        _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
+        if (events & EPOLLIN ||
+            connection->i_message < connection->n_messages ||
+            connection->stream->in.length > 0) {
+                r = service_connection_dispatch_calls(service, connection);
+                if (r != 0)
+                        return r < 0 ? r : 0;
+        }
 
-                        r = varlink_stream_read(connection->stream, &message);
-                        if (r < 0)
-                                return service_connection_close(service, connection);
+        /* Catch POLLHUP, we never try to read the EOF from a busy connection. */
+        if (events & EPOLLHUP || connection->stream->hup)
+                return service_connection_close(service, connection);
 
-                        /* We did not receive a full message. */
-                        if (r == 0)
-                                break;
+        /* Listen for incoming data whenever the connection is idle. */
+        if (!connection->call && !connection->blocked)
+                connection->events_mask |= EPOLLIN;
 
-                        r = varlink_call_new(&connection->call, service, connection, message);
-                        if (r < 0)
-                                return r;
+        return service_connection_set_events_mask(service, connection, connection->events_mask);
+}
 
-                        r = service->method_callback(service,
-                                                     connection->call,
-                                                     connection->call->parameters,
-                                                     connection->call->flags,
-                                                     service->method_callback_userdata);
-                        if (r < 0)
+/*
+ * Queues a send of the output of the connection, unless an earlier one
+ * is still in flight; its completion sends what was written in the
+ * meantime.
+ */
+static long service_connection_send(VarlinkService *service, ServiceConnection *connection) {
+        unsigned long n_iov;
+        long r;
+
+        if (connection->closed || connection->sending)
+                return 0;
+
+        n_iov = varlink_stream_start_send(connection->stream, connection->send_iov);
+        if (n_iov == 0)
+                return 0;
+
+        connection->send_message = (struct msghdr){
+                .msg_iov = connection->send_iov,
+                .msg_iovlen = n_iov,
+        };
+
+        r = uring_send(service->uring, connection->stream->fd, &connection->send_message,
+                       URING_USER_DATA(connection, URING_OP_SEND));
+        if (r < 0)
+                return r;
+
+        connection->sending = true;
+        connection->n_requests += 1;
+        service->n_requests += 1;
+
+        return 0;
+}
+
+/*
+ * Keeps a receive request on the ring while the connection accepts
+ * calls. A busy connection buffers up to one chunk of further input,
+ * then receiving pauses until the connection is idle again.
+ */
+static long service_connection_update_receive(VarlinkService *service, ServiceConnection *connection) {
+        bool paused = (connection->call || connection->blocked) &&
+                      connection->stream->in.length >= STREAM_BUFFER_SIZE;
+        long r;
+
+        if (connection->closed || connection->stream->hup)
+                return 0;
+
+        if (!connection->receiving) {
+                if (paused)
+                        return 0;
+
+                r = uring_recv(service->uring, connection->stream->fd, service->multishot_recv,
+                               URING_USER_DATA(connection, URING_OP_RECV));
+                if (r < 0)
+                        return r;
+
+                connection->receiving = true;
+                connection->n_requests += 1;
+                service->n_requests += 1;
+
+                return 0;
+        }
+
+        if (paused && !connection->canceling) {
+                r = uring_cancel(service->uring, URING_USER_DATA(connection, URING_OP_RECV), -1,
+                                 URING_USER_DATA(connection, URING_OP_CANCEL));
+                if (r < 0)
+                        return r;
+
+                connection->canceling = true;
+                connection->n_requests += 1;
+                service->n_requests += 1;
+        }
+
+        return 0;
+}
+
+static bool fd_hung_up(int fd) {
+        struct pollfd pollfd = {
+                .fd = fd
+        };
+
+        return poll(&pollfd, 1, 0) == 1 && (pollfd.revents & POLLHUP);
+}
+
+static long service_connection_dispatch_uring(VarlinkService *service, ServiceConnection *connection) {
+        long r;
+
+        r = service_connection_dispatch_calls(service, connection);
+        if (r != 0)
+                return r < 0 ? r : 0;
+
+        /* Like with epoll, a connection which only shut down its sending side still gets its reply. */
+        if (connection->stream->hup && (!connection->call || fd_hung_up(connection->stream->fd)))
+                return service_connection_close(service, connection);
+
+        return service_connection_update_receive(service, connection);
+}
+
+static long service_uring_accept(VarlinkService *service) {
+        long r;
+
+        r = uring_accept(service->uring, service->listen_fd, service->multishot_accept,
+                         URING_USER_DATA(service, URING_OP_ACCEPT));
+        if (r < 0)
+                return r;
+
+        service->accepting = true;
+        service->n_requests += 1;
+
+        return 0;
+}
+
+static long service_handle_accept(VarlinkService *service, UringCompletion *completion) {
+        long r = 0;
+
+        if (!completion->more)
+                service->accepting = false;
+
+        if (completion->res >= 0)
+                r = service_add_connection(service, completion->res);
+        else if (completion->res == -EINVAL && service->multishot_accept)
+                service->multishot_accept = false;
+        else if (completion->res != -ECANCELED)
+                r = -VARLINK_ERROR_CANNOT_ACCEPT;
+
+        if (!service->accepting) {
+                long r_accept;
+
+                r_accept = service_uring_accept(service);
+                if (r_accept < 0)
+                        return r_accept;
+        }
+
+        return r;
+}
+
+static long service_handle_completion(VarlinkService *service, UringCompletion *completion) {
+        void *ptr = (void *)(uintptr_t)(completion->user_data & ~(uint64_t)URING_OP_MASK);
+        unsigned long op = completion->user_data & URING_OP_MASK;
+        ServiceConnection *connection = ptr;
+        long r;
+
+        if (!completion->more)
+                service->n_requests -= 1;
+
+        if (ptr == service)
+                return op == URING_OP_ACCEPT ? service_handle_accept(service, completion) : 0;
+
+        if (!completion->more)
+                connection->n_requests -= 1;
+
+        switch (op) {
+                case URING_OP_RECV:
+                        if (!completion->more) {
+                                connection->receiving = false;
+                                connection->canceling = false;
+                        }
+
+                        if (completion->data) {
+                                r = 0;
+                                if (!connection->closed)
+                                        r = varlink_stream_feed(connection->stream, completion->data, completion->res);
+
+                                uring_recycle_buffer(service->uring, completion->buffer_id);
+                                if (r < 0)
+                                        return service_connection_close(service, connection);
+                        } else if (completion->res == 0)
+                                connection->stream->hup = true;
+                        else if (completion->res == -EINVAL && service->multishot_recv)
+                                service->multishot_recv = false;
+                        else if (completion->res != -ECANCELED && completion->res != -ENOBUFS && !connection->closed)
                                 return service_connection_close(service, connection);
+                        break;
+
+                case URING_OP_SEND:
+                        connection->sending = false;
+
+                        /* The rest of a short send is sent again. */
+                        if (completion->res > 0)
+                                varlink_stream_finish_send(connection->stream, completion->res);
+                        else if (completion->res < 0 && completion->res != -ECANCELED && !connection->closed)
+                                return service_connection_close(service, connection);
+                        break;
+        }
+
+        if (connection->closed) {
+                if (connection->n_requests == 0)
+                        service_connection_free(connection);
+
+                return 0;
+        }
+
+        if (op == URING_OP_SEND) {
+                r = service_connection_send(service, connection);
+                if (r < 0)
+                        return r;
+
+                service_connection_check_writable(service, connection);
+        }
+
+        return service_connection_dispatch_uring(service, connection);
+}
+
+static long service_uring_new(VarlinkService *service) {
+        Uring *uring;
+        long r;
+
+        r = uring_new(&uring);
+        if (r < 0)
+                return r;
+
+        if (epoll_add(service->epoll_fd, uring_get_fd(uring), EPOLLIN, service) < 0) {
+                uring_free(uring);
+                return -VARLINK_ERROR_PANIC;
+        }
+
+        service->uring = uring;
+        service->multishot_accept = true;
+        service->multishot_recv = true;
+
+        r = service_uring_accept(service);
+        if (r >= 0)
+                r = uring_submit(service->uring);
+
+        if (r < 0) {
+                epoll_del(service->epoll_fd, uring_get_fd(uring));
+                service_uring_free(service);
+                return r;
+        }
+
+        epoll_del(service->epoll_fd, service->listen_fd);
+
+        return 0;
+}
+
+/*
+ * Cancels all requests and waits for their completions, which free
+ * the connections waiting for them.
+ */
+static void service_uring_free(VarlinkService *service) {
+        UringCompletion completion;
+
+        if (uring_cancel(service->uring, 0, -1, URING_USER_DATA(service, URING_OP_CANCEL)) == 0)
+                service->n_requests += 1;
+
+        uring_submit(service->uring);
+
+        while (service->n_requests > 0 && uring_next_completion(service->uring, true, &completion)) {
+                void *ptr = (void *)(uintptr_t)(completion.user_data & ~(uint64_t)URING_OP_MASK);
+                unsigned long op = completion.user_data & URING_OP_MASK;
+
+                if (completion.data)
+                        uring_recycle_buffer(service->uring, completion.buffer_id);
+
+                if (completion.more)
+                        continue;
+
+                service->n_requests -= 1;
+
+                if (ptr == service) {
+                        if (op == URING_OP_ACCEPT && completion.res >= 0)
+                                close(completion.res);
+
+                        continue;
                 }
+
+                ((ServiceConnection *)ptr)->n_requests -= 1;
+                if (((ServiceConnection *)ptr)->n_requests == 0)
+                        service_connection_free(ptr);
         }
 
-        /* Catch POLLHUP, we never try to read the EOF from a busy connection. */
-        if (events & EPOLLHUP || connection->stream->hup)
-                return service_connection_close(service, connection);
+        service->uring = uring_free(service->uring);
+        service->n_requests = 0;
+        service->accepting = false;
+}
 
-        /* Listen for incoming data whenever the connection is idle. */
-        if (!connection->call)
-                connection->events_mask |= EPOLLIN;
+static long service_process_completions(VarlinkService *service) {
+        UringCompletion completion;
+
+        while (uring_next_completion(service->uring, false, &completion)) {
+                long r;
+
+                r = service_handle_completion(service, &completion);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+/*
+ * Called when a reply could not be written completely. Corked replies
+ * of the current varlink_service_process_events() are flushed when it
+ * returns, everything else once the socket becomes writable.
+ */
+static long service_connection_output_pending(VarlinkService *service, ServiceConnection *connection) {
+        if (service->high_watermark > 0 &&
+            varlink_stream_get_pending(connection->stream) >= service->high_watermark)
+                connection->blocked = true;
+
+        /* With io_uring, replies are always collected while dispatching. */
+        if (service->uring && !service->dispatching) {
+                long r;
+
+                r = service_connection_send(service, connection);
+                if (r < 0)
+                        return r;
+
+                return uring_submit(service->uring);
+        }
+
+        if (service->dispatching && (connection->stream->cork > 0 || service->uring)) {
+                if (!connection->flush_pending) {
+                        LIST_INSERT_HEAD(&service->flush_list, connection, flush_entry);
+                        connection->flush_pending = true;
+                }
+
+                return 0;
+        }
+
+        connection->events_mask |= EPOLLOUT;
 
         return service_connection_set_events_mask(service, connection, connection->events_mask);
 }
 
-_public_ long varlink_service_process_events(VarlinkService *service) {
+/*
+ * Writes out the corked replies, with one write per connection.
+ */
+static long service_flush_connections(VarlinkService *service) {
+        ServiceConnection *connection;
+
+        while ((connection = LIST_FIRST(&service->flush_list))) {
+                long r;
+
+                LIST_REMOVE(connection, flush_entry);
+                connection->flush_pending = false;
+
+                /* Completions of the sends take care of the rest. */
+                if (service->uring) {
+                        r = service_connection_send(service, connection);
+                        if (r < 0)
+                                return r;
+
+                        continue;
+                }
+
+                r = varlink_stream_flush(connection->stream);
+                if (r < 0) {
+                        service_connection_close(service, connection);
+                        continue;
+                }
+
+                /* We did not write all data, wake up when we can write to the socket. */
+                if (r > 0) {
+                        connection->events_mask |= EPOLLOUT;
+
+                        r = service_connection_set_events_mask(service, connection, connection->events_mask);
+                        if (r < 0)
+                                return r;
+                }
+
+                service_connection_check_writable(service, connection);
+        }
+
+        return 0;
+}
+
+static long service_process_events(VarlinkService *service) {
         for(;;) {
                 int n;
                 struct epoll_event ev;
@@ -615,6 +1428,70 @@ _public_ long varlink_service_process_events(VarlinkService *service) {
         return 0;
 }
 
+_public_ long varlink_service_process_events(VarlinkService *service) {
+        long r, r_flush;
+
+        service->dispatching = true;
+        if (service->uring)
+                r = service_process_completions(service);
+        else
+                r = service_process_events(service);
+        service->dispatching = false;
+
+        /* Flush corked replies, even if dispatching failed. */
+        r_flush = service_flush_connections(service);
+
+        /* Submit the requests queued while dispatching in a single system call. */
+        if (service->uring && uring_submit(service->uring) < 0 && r_flush == 0)
+                r_flush = -VARLINK_ERROR_PANIC;
+
+        if (r < 0)
+                return r;
+
+        return r_flush;
+}
+
+_public_ long varlink_service_set_backend(VarlinkService *service, long backend) {
+        if (avl_tree_first(service->connections))
+                return -VARLINK_ERROR_PANIC;
+
+        switch (backend) {
+                case VARLINK_SERVICE_BACKEND_EPOLL:
+                        if (!service->uring)
+                                return VARLINK_SERVICE_BACKEND_EPOLL;
+
+                        epoll_del(service->epoll_fd, uring_get_fd(service->uring));
+                        service_uring_free(service);
+
+                        if (epoll_add(service->epoll_fd, service->listen_fd, EPOLLIN, service) < 0)
+                                return -VARLINK_ERROR_PANIC;
+
+                        return VARLINK_SERVICE_BACKEND_EPOLL;
+
+                case VARLINK_SERVICE_BACKEND_IO_URING:
+                        if (service->uring)
+                                return VARLINK_SERVICE_BACKEND_IO_URING;
+
+                        /* Fall back to epoll if the kernel does not support what we need. */
+                        if (service_uring_new(service) < 0)
+                                return VARLINK_SERVICE_BACKEND_EPOLL;
+
+                        return VARLINK_SERVICE_BACKEND_IO_URING;
+
+                default:
+                        return -VARLINK_ERROR_PANIC;
+        }
+}
+
+_public_ long varlink_call_set_writable_callback(VarlinkCall *call,
+                                                 VarlinkCallWritable callback,
+                                                 void *userdata) {
+        call->writable_callback = callback;
+        call->writable_callback_userdata = userdata;
+
+        return 0;
+}
+
 _public_ long varlink_call_set_connection_closed_callback(VarlinkCall *call,
                                                           VarlinkCallConnectionClosed callback,
                                                           void *userdata) {
@@ -659,20 +1536,18 @@ _public_ long varlink_call_reply(VarlinkCall *call,
 
         /* We did not write all data, wake up when we can write to the socket. */
         if (r == 0) {
-                call->connection->events_mask |= EPOLLOUT;
-
-                r = service_connection_set_events_mask(
-                            call->service, call->connection,
-                            call->connection->events_mask);
-                if (r < 0) {
+                r = service_connection_output_pending(call->service, call->connection);
+                if (r < 0)
                         return r;
-                }
         }
 
-        if (!(flags & VARLINK_REPLY_CONTINUES))
+        if (!(flags & VARLINK_REPLY_CONTINUES)) {
                 varlink_call_remove_from_connection(call);
+                return 0;
+        }
 
-        return 0;
+        /* Ask the producer to wait for the writable callback. */
+        return call->connection->blocked ? 1 : 0;
 }
 
 _public_ long varlink_call_reply_error(VarlinkCall *call,
@@ -720,8 +1595,11 @@ _public_ long varlink_call_reply_error(VarlinkCall *call,
                 return r;
 
         /* We did not write all data, wake up when we can write to the socket. */
-        if (r == 0)
-                call->connection->events_mask |= EPOLLOUT;
+        if (r == 0) {
+                r = service_connection_output_pending(call->service, call->connection);
+                if (r < 0)
+                        return r;
+        }
 
         varlink_call_remove_from_connection(call);
         return 0;
@@ -1,75 +1,413 @@
 // SPDX-License-Identifier: Apache-2.0
 
+#include "object.h"
 #include "stream.h"
 #include "util.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <poll.h>
 #include <unistd.h>
-#include <sys/epoll.h>
-
-#define CONNECTION_BUFFER_SIZE (16 * 1024 * 1024)
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/*
+ * Memory of an input buffer which parsed messages point into. The
+ * stream holds one reference while it uses the memory, every message
+ * another one.
+ */
+struct StreamMemory {
+        unsigned long refcount;
+        uint8_t *data;
+        unsigned long size;
+        int spill_fd;
+};
+
+/*
+ * Drops the reference of a message. The last one frees the memory, the
+ * stream has given it up then.
+ */
+static void stream_memory_unref(void *owner) {
+        StreamMemory *memory = owner;
+
+        memory->refcount -= 1;
+        if (memory->refcount > 0)
+                return;
+
+        if (memory->spill_fd >= 0) {
+                munmap(memory->data, memory->size);
+                close(memory->spill_fd);
+        } else
+                free(memory->data);
+
+        free(memory);
+}
 
 long varlink_stream_new(VarlinkStream **streamp, int fd) {
-        _cleanup_(freep) VarlinkStream *stream = NULL;
+        VarlinkStream *stream;
 
         stream = calloc(1, sizeof(VarlinkStream));
         if (!stream)
                 return -VARLINK_ERROR_PANIC;
 
         stream->fd = fd;
+        stream->in.spill_fd = -1;
+        stream->out.spill_fd = -1;
+        stream->sending.spill_fd = -1;
+        stream->max_message_size = STREAM_MAX_MESSAGE_SIZE;
+
+        *streamp = stream;
+
+        return 0;
+}
+
+void varlink_stream_set_max_message_size(VarlinkStream *stream, unsigned long size) {
+        stream->max_message_size = size > 0 ? size : STREAM_MAX_MESSAGE_SIZE;
+}
+
+void varlink_stream_set_cork(VarlinkStream *stream, unsigned long threshold) {
+        stream->cork = threshold;
+}
+
+/*
+ * Fills iov with the segments of the buffer holding data and returns
+ * their number.
+ */
+static unsigned long stream_buffer_get_data(StreamBuffer *buffer, struct iovec *iov) {
+        unsigned long first;
+
+        if (buffer->length == 0)
+                return 0;
+
+        first = MIN(buffer->length, buffer->size - buffer->start);
+        iov[0].iov_base = buffer->data + buffer->start;
+        iov[0].iov_len = first;
+
+        if (first == buffer->length)
+                return 1;
+
+        iov[1].iov_base = buffer->data;
+        iov[1].iov_len = buffer->length - first;
+
+        return 2;
+}
+
+/*
+ * Fills iov with the free segments of the buffer and returns their
+ * number.
+ */
+static unsigned long stream_buffer_get_space(StreamBuffer *buffer, struct iovec *iov) {
+        unsigned long space, end, first;
+
+        space = buffer->size - buffer->length;
+        if (space == 0)
+                return 0;
+
+        end = (buffer->start + buffer->length) % buffer->size;
+        first = MIN(space, buffer->size - end);
+        iov[0].iov_base = buffer->data + end;
+        iov[0].iov_len = first;
+
+        if (first == space)
+                return 1;
+
+        iov[1].iov_base = buffer->data;
+        iov[1].iov_len = space - first;
+
+        return 2;
+}
+
+static void stream_buffer_copy_out(StreamBuffer *buffer, uint8_t *dest, unsigned long length) {
+        struct iovec iov[2];
+        unsigned long n_iov;
+
+        n_iov = stream_buffer_get_data(buffer, iov);
+        for (unsigned long i = 0; i < n_iov && length > 0; i += 1) {
+                unsigned long n = MIN(length, iov[i].iov_len);
+
+                memcpy(dest, iov[i].iov_base, n);
+                dest += n;
+                length -= n;
+        }
+}
+
+/*
+ * Points the buffer to its new memory of size bytes, which starts with
+ * a copy of the old memory. If the data wraps around, its first part is
+ * moved to the new end of the ring.
+ */
+static void stream_buffer_set_data(StreamBuffer *buffer, uint8_t *data, unsigned long size) {
+        if (buffer->start + buffer->length > buffer->size) {
+                unsigned long first = buffer->size - buffer->start;
+
+                memmove(data + size - first, data + buffer->start, first);
+                buffer->moved += first;
+                buffer->start = size - first;
+        }
+
+        buffer->data = data;
+        buffer->size = size;
+}
+
+/*
+ * Moves the buffer into a memfd mapping, or grows the mapping it
+ * already lives in. Large buffers do not fragment the heap this way,
+ * growing them moves pages instead of copying them, and all of the
+ * memory is given back as soon as the buffer drains.
+ */
+static long stream_buffer_spill(BufferPool *pool, StreamBuffer *buffer, unsigned long size) {
+        _cleanup_(closep) int fd = -1;
+        uint8_t *data;
+
+        if (buffer->spill_fd >= 0) {
+                if (ftruncate(buffer->spill_fd, size) < 0)
+                        return -VARLINK_ERROR_PANIC;
 
-        stream->in = malloc(CONNECTION_BUFFER_SIZE);
-        if (!stream->in)
+                data = mremap(buffer->data, buffer->size, size, MREMAP_MAYMOVE);
+                if (data == MAP_FAILED)
+                        return -VARLINK_ERROR_PANIC;
+
+                stream_buffer_set_data(buffer, data, size);
+
+                return 0;
+        }
+
+        fd = memfd_create("varlink-stream", MFD_CLOEXEC);
+        if (fd < 0)
                 return -VARLINK_ERROR_PANIC;
 
-        stream->out = malloc(CONNECTION_BUFFER_SIZE);
-        if (!stream->out) {
-                free(stream->in);
+        if (ftruncate(fd, size) < 0)
                 return -VARLINK_ERROR_PANIC;
+
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+                return -VARLINK_ERROR_PANIC;
+
+        memcpy(data, buffer->data, buffer->size);
+        buffer_pool_put(pool, buffer->data, buffer->size);
+
+        stream_buffer_set_data(buffer, data, size);
+        buffer->spill_fd = fd;
+        fd = -1;
+
+        return 0;
+}
+
+/*
+ * Gives up the reference of the buffer to its memory. Returns true if no
+ * message points into it any more, and the memory belongs to the buffer
+ * alone again; otherwise, the last message frees it.
+ */
+static bool stream_buffer_drop_memory(BufferPool *pool, StreamBuffer *buffer) {
+        StreamMemory *memory = buffer->memory;
+
+        buffer->memory = NULL;
+
+        if (memory->refcount == 1) {
+                free(memory);
+                return true;
         }
 
-        *streamp = stream;
-        stream = NULL;
+        if (memory->spill_fd < 0)
+                buffer_pool_disown(pool);
+
+        memory->refcount -= 1;
+
+        return false;
+}
+
+static long stream_buffer_reserve(BufferPool *pool, StreamBuffer *buffer, unsigned long size, unsigned long max);
+
+/*
+ * Makes sure the buffer may write to its memory. If messages still point
+ * into it, the data which was not consumed yet is moved to new memory.
+ */
+static long stream_buffer_reclaim(BufferPool *pool, StreamBuffer *buffer) {
+        StreamBuffer fresh = { .spill_fd = -1 };
+        long r;
+
+        if (!buffer->memory)
+                return 0;
+
+        if (buffer->memory->refcount == 1) {
+                stream_buffer_drop_memory(pool, buffer);
+                return 0;
+        }
+
+        if (buffer->length > 0) {
+                r = stream_buffer_reserve(pool, &fresh, buffer->length, buffer->size);
+                if (r < 0)
+                        return r;
+
+                stream_buffer_copy_out(buffer, fresh.data, buffer->length);
+                fresh.length = buffer->length;
+        }
+
+        fresh.moved = buffer->moved + buffer->length;
+
+        stream_buffer_drop_memory(pool, buffer);
+        *buffer = fresh;
 
         return 0;
 }
 
+/*
+ * Creates a buffer for the parser, which points to the message of
+ * length bytes (including the NUL delimiter) at the front of the buffer
+ * and keeps its memory alive. The message must not wrap around.
+ */
+static long stream_buffer_lend(StreamBuffer *buffer, unsigned long length, ScannerBuffer **scanner_bufferp) {
+        StreamMemory *memory = buffer->memory;
+        long r;
+
+        if (!memory) {
+                memory = calloc(1, sizeof(StreamMemory));
+                if (!memory)
+                        return -VARLINK_ERROR_PANIC;
+
+                memory->refcount = 1;
+                memory->data = buffer->data;
+                memory->size = buffer->size;
+                memory->spill_fd = buffer->spill_fd;
+                buffer->memory = memory;
+        }
+
+        r = scanner_buffer_new_borrowed(scanner_bufferp, (char *) buffer->data + buffer->start, length - 1,
+                                        memory, stream_memory_unref);
+        if (r < 0)
+                return r;
+
+        memory->refcount += 1;
+
+        return 0;
+}
+
+static long stream_buffer_resize(BufferPool *pool, StreamBuffer *buffer, unsigned long size) {
+        uint8_t *data;
+
+        if (!buffer->data) {
+                buffer->data = buffer_pool_get(pool);
+                if (!buffer->data)
+                        return -VARLINK_ERROR_PANIC;
+
+                buffer->size = STREAM_BUFFER_SIZE;
+                if (size == STREAM_BUFFER_SIZE)
+                        return 0;
+        }
+
+        /* Fall back to the heap if there is no memfd. */
+        if (size > STREAM_SPILL_SIZE && stream_buffer_spill(pool, buffer, size) == 0)
+                return 0;
+
+        if (buffer->spill_fd >= 0)
+                return -VARLINK_ERROR_PANIC;
+
+        data = realloc(buffer->data, size);
+        if (!data)
+                return -VARLINK_ERROR_PANIC;
+
+        stream_buffer_set_data(buffer, data, size);
+
+        return 0;
+}
+
+/*
+ * Frees the memory of the buffer, wherever it came from.
+ */
+static void stream_buffer_free_data(BufferPool *pool, StreamBuffer *buffer) {
+        if (buffer->memory && !stream_buffer_drop_memory(pool, buffer)) {
+                /* the messages which point into it free it */
+                buffer->spill_fd = -1;
+        } else if (buffer->spill_fd >= 0) {
+                munmap(buffer->data, buffer->size);
+                close(buffer->spill_fd);
+                buffer->spill_fd = -1;
+        } else
+                buffer_pool_put(pool, buffer->data, buffer->size);
+
+        buffer->data = NULL;
+        buffer->size = 0;
+}
+
+/*
+ * Makes room for at least size more bytes in the buffer. The caller
+ * makes sure that the buffer does not need to grow beyond max.
+ */
+static long stream_buffer_reserve(BufferPool *pool, StreamBuffer *buffer, unsigned long size, unsigned long max) {
+        unsigned long new_size;
+        long r;
+
+        r = stream_buffer_reclaim(pool, buffer);
+        if (r < 0)
+                return r;
+
+        if (buffer->size - buffer->length >= size)
+                return 0;
+
+        new_size = MAX(buffer->size, STREAM_BUFFER_SIZE);
+        while (new_size - buffer->length < size)
+                new_size *= 2;
+
+        new_size = MIN(new_size, max);
+        if (new_size <= buffer->size)
+                return 0;
+
+        return stream_buffer_resize(pool, buffer, new_size);
+}
+
 VarlinkStream *varlink_stream_free(VarlinkStream *stream) {
         if (stream->fd >= 0)
                 close(stream->fd);
 
-        free(stream->in);
-        free(stream->out);
+        if (stream->in.data)
+                stream_buffer_free_data(stream->pool, &stream->in);
+
+        if (stream->out.data)
+                stream_buffer_free_data(stream->pool, &stream->out);
+
+        if (stream->sending.data)
+                stream_buffer_free_data(stream->pool, &stream->sending);
 
         free(stream);
         return NULL;
 }
 
-static void move_rest(uint8_t **bufferp, unsigned long *startp, unsigned long *endp) {
-        uint8_t *buffer;
-        unsigned long start, end, rest;
+/*
+ * Gives the memory of an empty buffer back to the pool.
+ */
+static void stream_buffer_release(BufferPool *pool, StreamBuffer *buffer) {
+        if (buffer->length > 0 || !buffer->data)
+                return;
 
-        buffer = *bufferp;
-        start = *startp;
-        end = *endp;
+        stream_buffer_free_data(pool, buffer);
+        buffer->start = 0;
+}
 
-        rest = end - start;
-        if (rest > 0)
-                *bufferp = memmove(buffer, buffer + start, rest);
+/*
+ * Drops length bytes from the front of the buffer. Once all data is
+ * consumed, the memory is released.
+ */
+static void stream_buffer_consume(BufferPool *pool, StreamBuffer *buffer, unsigned long length) {
+        buffer->start = (buffer->start + length) % buffer->size;
+        buffer->length -= length;
 
-        *startp = 0;
-        *endp = rest;
+        stream_buffer_release(pool, buffer);
 }
 
 size_t varlink_stream_flush(VarlinkStream *stream) {
+        struct iovec iov[2];
+        unsigned long n_iov;
         long n;
 
+        n_iov = stream_buffer_get_data(&stream->out, iov);
+        if (n_iov == 0)
+                return 0;
+
 write_again:
-        n = write(stream->fd,
-                  stream->out + stream->out_start,
-                  stream->out_end - stream->out_start);
+        n = writev(stream->fd, iov, n_iov);
+        stream->statistics.writes += 1;
 
         switch (n) { // NOLINT(hicpp-multiway-paths-covered)
                 case -1:
@@ -79,6 +417,7 @@ write_again:
 
                                 case EAGAIN:
                                         // this function returns the number of bytes still to send
+                                        stream->statistics.writes_blocked += 1;
                                         break;
 
                                 case EPIPE:
@@ -91,12 +430,91 @@ write_again:
                         break;
 
                 default:
-                        stream->out_start += n;
+                        stream_buffer_consume(stream->pool, &stream->out, n);
+                        stream->statistics.bytes_written += n;
+                        if (stream->out.length > 0)
+                                stream->statistics.partial_writes += 1;
                         break;
         }
 
-        move_rest(&stream->out, &stream->out_start, &stream->out_end);
-        return stream->out_end - stream->out_start;
+        return stream->out.length;
+}
+
+void varlink_stream_get_statistics(VarlinkStream *stream, StreamStatistics *statistics) {
+        *statistics = stream->statistics;
+        statistics->moved = stream->in.moved + stream->out.moved;
+}
+
+void stream_statistics_add(StreamStatistics *total, const StreamStatistics *statistics) {
+        total->bytes_read += statistics->bytes_read;
+        total->bytes_written += statistics->bytes_written;
+        total->reads += statistics->reads;
+        total->writes += statistics->writes;
+        total->reads_blocked += statistics->reads_blocked;
+        total->writes_blocked += statistics->writes_blocked;
+        total->partial_writes += statistics->partial_writes;
+        total->moved += statistics->moved;
+        total->copied += statistics->copied;
+        total->in_high_water = MAX(total->in_high_water, statistics->in_high_water);
+        total->out_high_water = MAX(total->out_high_water, statistics->out_high_water);
+}
+
+unsigned long varlink_stream_get_pending(VarlinkStream *stream) {
+        return stream->out.length + stream->sending.length;
+}
+
+long varlink_stream_feed(VarlinkStream *stream, const uint8_t *data, unsigned long length) {
+        struct iovec iov[2];
+        unsigned long n_iov;
+        long r;
+
+        /* Oversized messages are rejected by the reader, the data has to go somewhere until then. */
+        r = stream_buffer_reserve(stream->pool, &stream->in, length,
+                                  MAX(stream->max_message_size, stream->in.length + length));
+        if (r < 0)
+                return r;
+
+        n_iov = stream_buffer_get_space(&stream->in, iov);
+        for (unsigned long i = 0; i < n_iov && length > 0; i += 1) {
+                unsigned long n = MIN(length, iov[i].iov_len);
+
+                memcpy(iov[i].iov_base, data, n);
+                stream->in.length += n;
+                stream->statistics.bytes_read += n;
+                data += n;
+                length -= n;
+        }
+
+        stream->statistics.reads += 1;
+        stream->statistics.in_high_water = MAX(stream->statistics.in_high_water, stream->in.length);
+
+        return 0;
+}
+
+unsigned long varlink_stream_start_send(VarlinkStream *stream, struct iovec *iov) {
+        /* The output buffer is handed over as a whole, it may grow while it is being sent. */
+        if (stream->sending.length == 0 && stream->out.length > 0) {
+                unsigned long long moved = stream->out.moved;
+
+                if (stream->sending.data)
+                        stream_buffer_free_data(stream->pool, &stream->sending);
+
+                stream->sending = stream->out;
+                stream->sending.moved = 0;
+
+                stream->out = (StreamBuffer){ .spill_fd = -1, .moved = moved };
+        }
+
+        return stream_buffer_get_data(&stream->sending, iov);
+}
+
+void varlink_stream_finish_send(VarlinkStream *stream, unsigned long length) {
+        stream->statistics.writes += 1;
+        stream->statistics.bytes_written += length;
+
+        stream_buffer_consume(stream->pool, &stream->sending, length);
+        if (stream->sending.length > 0)
+                stream->statistics.partial_writes += 1;
 }
 
 static long fd_nonblock(int fd) {
@@ -115,133 +533,449 @@ static long fd_nonblock(int fd) {
         return 0;
 }
 
-static long fd_block(int fd) {
-        int flags;
+/*
+ * One direction of a bridge. Data is moved from in to out through a
+ * pipe with splice(), without copying it to user space. Data which was
+ * already buffered by the stream, and data between file descriptors
+ * which do not support splice(), goes through a buffer instead.
+ */
+typedef struct {
+        int in;
+        int out;
 
-        flags = fcntl(fd, F_GETFL, 0);
-        if (flags < 0)
-                return -errno;
+        int pipe[2];
+        unsigned long capacity;
+        unsigned long pending;
 
-        if ((flags & O_NONBLOCK) == 0)
-                return 0;
+        uint8_t *buffer;
+        unsigned long size;
+        unsigned long start;
+        unsigned long length;
+
+        bool copy;
+        bool eof;
+
+        /* the last operation on the fd did not block */
+        bool in_ready;
+        bool out_ready;
+} BridgeDirection;
+
+#define BRIDGE_PIPE_SIZE (1024 * 1024)
+#define BRIDGE_BUFFER_SIZE (64 * 1024)
+
+/*
+ * Takes over the data which is still buffered in the streams: what was
+ * not sent to out yet, followed by what was already received from in.
+ */
+static long bridge_direction_init(BridgeDirection *d, VarlinkStream *in, VarlinkStream *out) {
+        VarlinkStream *streams[] = { out, in };
+        StreamBuffer *buffered[] = { &out->out, &in->in };
+        int capacity;
+
+        d->in = in->fd;
+        d->out = out->fd;
+        d->in_ready = true;
+        d->out_ready = true;
+
+        if (pipe2(d->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+                d->pipe[0] = d->pipe[1] = -1;
+                return -VARLINK_ERROR_PANIC;
+        }
 
-        if (fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0)
-                return -errno;
+        /* A larger pipe means fewer system calls; the default is fine if we are not allowed to. */
+        fcntl(d->pipe[1], F_SETPIPE_SZ, BRIDGE_PIPE_SIZE);
+        capacity = fcntl(d->pipe[1], F_GETPIPE_SZ);
+        if (capacity <= 0)
+                return -VARLINK_ERROR_PANIC;
+
+        d->capacity = capacity;
+
+        d->size = MAX(out->out.length + in->in.length, BRIDGE_BUFFER_SIZE);
+        d->buffer = malloc(d->size);
+        if (!d->buffer)
+                return -VARLINK_ERROR_PANIC;
+
+        for (unsigned long i = 0; i < ARRAY_SIZE(buffered); i += 1) {
+                StreamBuffer *buffer = buffered[i];
+
+                stream_buffer_copy_out(buffer, d->buffer + d->length, buffer->length);
+                d->length += buffer->length;
+
+                buffer->length = 0;
+                stream_buffer_release(streams[i]->pool, buffer);
+        }
+
+        in->in_scanned = 0;
 
         return 0;
 }
 
+static void bridge_direction_deinit(BridgeDirection *d) {
+        if (d->pipe[0] >= 0)
+                close(d->pipe[0]);
+
+        if (d->pipe[1] >= 0)
+                close(d->pipe[1]);
+
+        free(d->buffer);
+}
+
+static bool bridge_direction_done(BridgeDirection *d) {
+        return d->eof && d->pending == 0 && d->length == 0;
+}
+
+/*
+ * Moves data from the input into the pipe, or the buffer. Returns 1 if
+ * data was moved, 0 if nothing could be moved.
+ */
+static long bridge_direction_receive(BridgeDirection *d) {
+        long n;
+
+        if (!d->in_ready || d->eof)
+                return 0;
+
+        if (d->copy) {
+                if (d->length > 0 || d->pending > 0)
+                        return 0;
+
+                n = read(d->in, d->buffer, d->size);
+                if (n > 0) {
+                        d->start = 0;
+                        d->length = n;
+                }
+        } else {
+                if (d->pending >= d->capacity)
+                        return 0;
+
+                n = splice(d->in, NULL, d->pipe[1], NULL, d->capacity - d->pending,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n > 0)
+                        d->pending += n;
+        }
+
+        if (n == 0)
+                d->eof = true;
+
+        if (n >= 0)
+                return 1;
+
+        switch (errno) {
+                case EINTR:
+                        return 1;
+
+                case EAGAIN:
+                        d->in_ready = false;
+                        return 0;
+
+                case EINVAL:
+                        if (d->copy)
+                                return -VARLINK_ERROR_RECEIVING_MESSAGE;
+
+                        d->copy = true;
+                        return 1;
+
+                default:
+                        return -VARLINK_ERROR_RECEIVING_MESSAGE;
+        }
+}
+
+/*
+ * Moves data from the buffer or the pipe to the output. Returns 1 if
+ * data was moved, 0 if nothing could be moved.
+ */
+static long bridge_direction_send(BridgeDirection *d) {
+        long n;
+
+        if (!d->out_ready)
+                return 0;
+
+        if (d->length > 0) {
+                n = write(d->out, d->buffer + d->start, d->length);
+                if (n > 0) {
+                        d->start += n;
+                        d->length -= n;
+                }
+        } else if (d->pending > 0) {
+                if (d->copy) {
+                        /* the pipe was filled before we learned that splice() does not work */
+                        n = read(d->pipe[0], d->buffer, MIN(d->pending, d->size));
+                        if (n > 0) {
+                                d->pending -= n;
+                                d->start = 0;
+                                d->length = n;
+                        }
+                } else {
+                        n = splice(d->pipe[0], NULL, d->out, NULL, d->pending,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                        if (n > 0)
+                                d->pending -= n;
+                }
+        } else
+                return 0;
+
+        if (n >= 0)
+                return 1;
+
+        switch (errno) {
+                case EINTR:
+                        return 1;
+
+                case EAGAIN:
+                        d->out_ready = false;
+                        return 0;
+
+                case EINVAL:
+                        if (d->copy)
+                                return -VARLINK_ERROR_SENDING_MESSAGE;
+
+                        d->copy = true;
+                        return 1;
+
+                case EPIPE:
+                case ECONNRESET:
+                        return -VARLINK_ERROR_CONNECTION_CLOSED;
+
+                default:
+                        return -VARLINK_ERROR_SENDING_MESSAGE;
+        }
+}
+
+/*
+ * Moves data until both ends of the direction would block.
+ */
+static long bridge_direction_pump(BridgeDirection *d) {
+        for (;;) {
+                long received, sent;
+
+                received = bridge_direction_receive(d);
+                if (received < 0)
+                        return received;
+
+                sent = bridge_direction_send(d);
+                if (sent < 0)
+                        return sent;
+
+                if (received == 0 && sent == 0)
+                        return 0;
+        }
+}
+
+/*
+ * Adds the file descriptors the direction waits for to pollfds and
+ * returns their number.
+ */
+static unsigned long bridge_direction_poll(BridgeDirection *d, struct pollfd *pollfds) {
+        unsigned long n = 0;
+
+        if (!d->eof && !d->in_ready)
+                pollfds[n++] = (struct pollfd){ .fd = d->in, .events = POLLIN };
+
+        if ((d->length > 0 || d->pending > 0) && !d->out_ready)
+                pollfds[n++] = (struct pollfd){ .fd = d->out, .events = POLLOUT };
+
+        return n;
+}
+
+static void bridge_direction_update(BridgeDirection *d, struct pollfd *pollfds, unsigned long n_pollfds) {
+        for (unsigned long i = 0; i < n_pollfds; i += 1) {
+                if (pollfds[i].revents == 0)
+                        continue;
+
+                /* errors and hangups show up with the next operation */
+                if (pollfds[i].fd == d->in && pollfds[i].events & POLLIN)
+                        d->in_ready = true;
+
+                if (pollfds[i].fd == d->out && pollfds[i].events & POLLOUT)
+                        d->out_ready = true;
+        }
+}
+
+/*
+ * Data the streams buffered before is sent first. When the client
+ * stops sending, the server's side of the connection is shut down and
+ * its remaining replies are still forwarded. Either direction only
+ * waits for its own file descriptors to become ready.
+ */
 long varlink_stream_bridge(int signal_fd, VarlinkStream *client_in, VarlinkStream *client_out, VarlinkStream *server) {
+        BridgeDirection up = { .pipe = { -1, -1 } };
+        BridgeDirection down = { .pipe = { -1, -1 } };
+        bool shut_down = false;
         long r;
-        unsigned char buf[8192];
-        int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
 
-        if (fd_nonblock(client_in->fd) < 0)
-                return -1;
-        if (fd_nonblock(client_out->fd) < 0)
-                return -1;
-        if (fd_nonblock(server->fd) < 0)
-                return -1;
+        if (fd_nonblock(client_in->fd) < 0 ||
+            fd_nonblock(client_out->fd) < 0 ||
+            fd_nonblock(server->fd) < 0) {
+                r = -VARLINK_ERROR_PANIC;
+                goto out;
+        }
+
+        r = bridge_direction_init(&up, client_in, server);
+        if (r < 0)
+                goto out;
 
-        epoll_add(epoll_fd, client_in->fd, EPOLLIN, (void *) &server->fd);
-        epoll_add(epoll_fd, server->fd, EPOLLIN, (void *) &client_out->fd);
-        epoll_add(epoll_fd, signal_fd, EPOLLIN, (void *) &signal_fd);
+        r = bridge_direction_init(&down, server, client_out);
+        if (r < 0)
+                goto out;
 
         for (;;) {
-                struct epoll_event ev[3];
-                int in, out;
-                size_t towrite;
-                int num_ev;
+                struct pollfd pollfds[5];
+                unsigned long n_up, n_down;
 
-                num_ev = epoll_wait(epoll_fd, ev, 3, -1);
-                if (num_ev < 0)
+                /* errors end the bridge like hangups do */
+                if (bridge_direction_pump(&up) < 0 || bridge_direction_pump(&down) < 0)
                         break;
 
-                for (int i = 0; i < num_ev; i++) {
-                        if (!(ev[i].events & EPOLLIN))
-                                goto bridge_out;
+                if (bridge_direction_done(&up) && !shut_down) {
+                        shutdown(server->fd, SHUT_WR);
+                        shut_down = true;
+                }
 
-                        out = *(int *) ev[i].data.ptr;
+                if (bridge_direction_done(&down))
+                        break;
 
-                        if (out == server->fd)
-                                in = client_in->fd;
-                        else if (out == client_out->fd) {
-                                in = server->fd;
-                        } else {
-                                goto bridge_out;
-                        }
-read_again:
-                        r = read(in, buf, sizeof buf);
-                        if (r == 0)
-                                goto bridge_out;
+                n_up = bridge_direction_poll(&up, pollfds);
+                n_down = bridge_direction_poll(&down, pollfds + n_up);
+                pollfds[n_up + n_down] = (struct pollfd){ .fd = signal_fd, .events = POLLIN };
 
-                        if (r < 0) {
-                                switch (errno) {
-                                        case EINTR:
-                                                goto read_again;
+                if (poll(pollfds, n_up + n_down + 1, -1) < 0) {
+                        if (errno == EINTR)
+                                continue;
 
-                                        case EAGAIN:
-                                                // The next epoll will let us retry
-                                                continue;
+                        r = -VARLINK_ERROR_PANIC;
+                        break;
+                }
 
-                                        default:
-                                                goto bridge_out;
-                                }
-                        }
+                if (pollfds[n_up + n_down].revents)
+                        break;
 
-                        fd_block(out);
-                        towrite = (size_t) r;
-                        while (towrite) {
-                                r = write(out, buf, towrite);
-                                if (r < 0)
-                                        switch (errno) {
-                                                case EINTR:
-                                                        continue;
-
-                                                case EAGAIN:
-                                                        // Retry until success, we don't want to cache
-                                                        usleep(10000);
-                                                        continue;
-
-                                                default:
-                                                        fd_nonblock(out);
-                                                        goto bridge_out;
-                                        }
-                                towrite -= r;
-                        }
-                        fd_nonblock(out);
+                bridge_direction_update(&up, pollfds, n_up);
+                bridge_direction_update(&down, pollfds + n_up, n_down);
+        }
+
+out:
+        bridge_direction_deinit(&up);
+        bridge_direction_deinit(&down);
+
+        return r;
+}
 
-                        if (ev[i].events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR))
-                                goto bridge_out;
+/*
+ * Parses the message of length bytes (including the NUL delimiter) at
+ * the front of the buffer, in place; its strings are not copied. Only a
+ * message which wraps around the end of the ring is copied out first.
+ *
+ * Parsing changes the message, so it is consumed even if it is invalid,
+ * and the error is kept for the following reads.
+ */
+static long stream_parse_message(VarlinkStream *stream, unsigned long length, VarlinkObject **messagep) {
+        _cleanup_(scanner_buffer_unrefp) ScannerBuffer *buffer = NULL;
+        long r;
+
+        if (stream->in.start + length <= stream->in.size) {
+                r = stream_buffer_lend(&stream->in, length, &buffer);
+                if (r < 0)
+                        return r;
+        } else {
+                r = scanner_buffer_new(&buffer, length - 1);
+                if (r < 0)
+                        return r;
+
+                stream_buffer_copy_out(&stream->in, (uint8_t *) buffer->data, length);
+                stream->statistics.copied += length;
+        }
+
+        r = varlink_object_new_from_message(messagep, buffer);
+        stream_buffer_consume(stream->pool, &stream->in, length);
+        if (r < 0) {
+                stream->in_error = r;
+                return r;
+        }
+
+        return 0;
+}
+
+/*
+ * Returns the length (including the NUL delimiter) of the first complete
+ * message in the input buffer, or 0 if there is none.
+ *
+ * Only the bytes which arrived since the last call are searched, a large
+ * message arriving in small chunks is not rescanned from its beginning
+ * every time.
+ */
+static unsigned long stream_find_message(VarlinkStream *stream) {
+        struct iovec iov[2];
+        unsigned long n_iov;
+        unsigned long offset = 0;
+
+        n_iov = stream_buffer_get_data(&stream->in, iov);
+        for (unsigned long i = 0; i < n_iov; i += 1) {
+                unsigned long skip = 0;
+                uint8_t *nul;
+
+                if (stream->in_scanned > offset)
+                        skip = MIN(stream->in_scanned - offset, iov[i].iov_len);
+
+                nul = memchr((uint8_t *) iov[i].iov_base + skip, 0, iov[i].iov_len - skip);
+                if (nul) {
+                        stream->in_scanned = 0;
+                        return offset + (nul - (uint8_t *) iov[i].iov_base) + 1;
                 }
+
+                offset += iov[i].iov_len;
         }
-bridge_out:
+
+        stream->in_scanned = stream->in.length;
+
         return 0;
 }
 
-long varlink_stream_read(VarlinkStream *stream, VarlinkObject **messagep) {
+long varlink_stream_read_batch(VarlinkStream *stream, VarlinkObject **messages, unsigned long n_messages) {
+        if (stream->in_error < 0)
+                return stream->in_error;
+
         for (;;) {
-                uint8_t *nul;
+                struct iovec iov[2];
+                unsigned long n_iov;
+                unsigned long length;
+                unsigned long n_read = 0;
                 long r, n;
 
-                nul = memchr(&stream->in[stream->in_start], 0, stream->in_end - stream->in_start);
-                if (nul) {
-                        r = varlink_object_new_from_json(messagep, (const char *) &stream->in[stream->in_start]);
-                        if (r < 0)
+                while (n_read < n_messages) {
+                        length = stream_find_message(stream);
+                        if (length == 0)
+                                break;
+
+                        r = stream_parse_message(stream, length, &messages[n_read]);
+                        if (r < 0) {
+                                /* return what we have, the next call reports the error */
+                                if (n_read > 0)
+                                        break;
+
                                 return r;
+                        }
 
-                        stream->in_start = (nul + 1) - stream->in;
-                        return 1;
+                        n_read += 1;
                 }
 
-                move_rest(&stream->in, &stream->in_start, &stream->in_end);
+                if (n_read > 0)
+                        return n_read;
 
-                if (stream->in_end == CONNECTION_BUFFER_SIZE)
+                if (stream->in.length >= stream->max_message_size)
                         return -VARLINK_ERROR_INVALID_MESSAGE;
+
+                if (stream->external_io)
+                        return 0;
+
+                r = stream_buffer_reserve(stream->pool, &stream->in,
+                                          MIN(STREAM_BUFFER_SIZE / 4, stream->max_message_size - stream->in.length),
+                                          stream->max_message_size);
+                if (r < 0)
+                        return r;
+
+                n_iov = stream_buffer_get_space(&stream->in, iov);
 again:
-                n = read(stream->fd,
-                         stream->in + stream->in_end,
-                         CONNECTION_BUFFER_SIZE - stream->in_end);
+                n = readv(stream->fd, iov, n_iov);
+                stream->statistics.reads += 1;
 
                 switch (n) {
                         case -1:
@@ -250,12 +984,15 @@ again:
                                                 goto again;
 
                                         case EAGAIN:
-                                                *messagep = NULL;
+                                                stream->statistics.reads_blocked += 1;
+
+                                                /* do not hold on to memory while waiting for data */
+                                                stream_buffer_release(stream->pool, &stream->in);
                                                 return 0;
 
                                         case ECONNRESET:
                                                 stream->hup = true;
-                                                *messagep = NULL;
+                                                stream_buffer_release(stream->pool, &stream->in);
                                                 return 0;
 
                                         default:
@@ -270,11 +1007,14 @@ again:
                         /* fall through */
                         case 0:
                                 stream->hup = true;
-                                *messagep = NULL;
+                                stream_buffer_release(stream->pool, &stream->in);
                                 return 0;
 
                         default:
-                                stream->in_end += n;
+                                stream->in.length += n;
+                                stream->statistics.bytes_read += n;
+                                stream->statistics.in_high_water = MAX(stream->statistics.in_high_water,
+                                                                       stream->in.length);
                                 break;
                 }
         }
@@ -286,31 +1026,92 @@ again:
 #pragma clang diagnostic pop
 }
 
-long varlink_stream_write(VarlinkStream *stream, VarlinkObject *message) {
-        _cleanup_(freep) char *json = NULL;
-        long length;
-        unsigned long ulength;
-        size_t r;
+long varlink_stream_read(VarlinkStream *stream, VarlinkObject **messagep) {
+        long r;
 
-        length = varlink_object_to_json(message, &json);
-        if (length < 0)
-                return length;
+        r = varlink_stream_read_batch(stream, messagep, 1);
+        if (r == 0)
+                *messagep = NULL;
 
-        ulength = (unsigned long) length;
+        return r;
+}
 
-        if (ulength >= CONNECTION_BUFFER_SIZE - 1)
-                return -VARLINK_ERROR_INVALID_MESSAGE;
+typedef struct {
+        Writer writer;
+
+        VarlinkStream *stream;
+        unsigned long length;
+        char *window;
+} StreamWriter;
+
+/*
+ * Commits the bytes written to the current window to the out buffer and
+ * points the writer to the next free segment, growing the buffer when
+ * there is none left.
+ */
+static long stream_writer_refill(Writer *writer) {
+        StreamWriter *w = (StreamWriter *) writer;
+        StreamBuffer *buffer = &w->stream->out;
+        unsigned long max = w->stream->max_message_size;
+        struct iovec iov[2];
+        long r;
 
-        if (stream->out_end + ulength + 1 >= CONNECTION_BUFFER_SIZE)
-                return -VARLINK_ERROR_SENDING_MESSAGE;
+        buffer->length += writer->p - w->window;
 
-        memcpy(stream->out + stream->out_end, json, ulength + 1);
-        stream->out_end += ulength + 1;
+        if (buffer->length >= max) {
+                if (buffer->length - w->length >= max)
+                        return -VARLINK_ERROR_INVALID_MESSAGE;
 
-        r = varlink_stream_flush(stream);
+                return -VARLINK_ERROR_SENDING_MESSAGE;
+        }
+
+        r = stream_buffer_reserve(w->stream->pool, buffer, 1, max);
         if (r < 0)
-                return (long) r;
+                return r;
+
+        stream_buffer_get_space(buffer, iov);
+
+        w->window = iov[0].iov_base;
+        writer->p = w->window;
+        writer->end = w->window + MIN(iov[0].iov_len, max - buffer->length);
+
+        return 0;
+}
+
+/*
+ * The message is serialized directly into the out buffer. If that
+ * fails, everything written so far is dropped again.
+ */
+long varlink_stream_write(VarlinkStream *stream, VarlinkObject *message) {
+        StreamWriter w = {
+                .writer.refill = stream_writer_refill,
+                .stream = stream,
+                .length = stream->out.length
+        };
+        size_t rest;
+        long r;
+
+        r = varlink_object_write_compact_json(message, &w.writer);
+        if (r >= 0)
+                r = writer_put_char(&w.writer, '\0');
+
+        if (r < 0) {
+                stream->out.length = w.length;
+                stream_buffer_release(stream->pool, &stream->out);
+                return r;
+        }
+
+        stream->out.length += w.writer.p - w.window;
+        stream->statistics.out_high_water = MAX(stream->statistics.out_high_water,
+                                                varlink_stream_get_pending(stream));
+
+        if (stream->external_io || stream->out.length < stream->cork)
+                return 0;
+
+        rest = varlink_stream_flush(stream);
+        if ((long) rest < 0)
+                return (long) rest;
 
         /* return 1 when flush() wrote the whole message */
-        return r == 0 ? 1 : 0;
+        return rest == 0 ? 1 : 0;
 }
@@ -2,33 +2,139 @@
 
 #pragma once
 
+#include "pool.h"
 #include "varlink.h"
 
+#include <sys/uio.h>
+
+/*
+ * Buffers start with a chunk of this size from the stream's pool and
+ * grow geometrically when a message does not fit.
+ */
+#define STREAM_BUFFER_SIZE POOL_CHUNK_SIZE
+
+/*
+ * The default upper bound for the size of a single message, including
+ * its NUL delimiter. Neither buffer of a stream grows beyond it.
+ */
+#define STREAM_MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+
+/*
+ * Buffers which grow beyond this size are moved from the heap to a
+ * memfd mapping.
+ */
+#define STREAM_SPILL_SIZE (1024 * 1024)
+
+/* The number of messages services and connections parse in one go. */
+#define STREAM_READ_BATCH 16
+
 typedef struct VarlinkStream VarlinkStream;
+typedef struct StreamMemory StreamMemory;
+
+/*
+ * A ring buffer: length bytes starting at start, wrapping around at
+ * size, have been received but not consumed yet, or are waiting to be
+ * sent. Data is read and written with readv()/writev() and never moved
+ * after it arrived, except when the buffer grows or a message which
+ * wraps around is handed to the parser. The memory is only held while
+ * the buffer is not empty, an idle stream does not own any.
+ *
+ * Received messages are parsed where they are in the ring. The memory
+ * is then shared with them, and the stream moves to new memory before
+ * it writes to the ring again while any of them is still alive.
+ */
+typedef struct {
+        uint8_t *data;
+        unsigned long size;
+        unsigned long start;
+        unsigned long length;
+
+        /* the memfd which backs large buffers, or -1 */
+        int spill_fd;
+
+        /* set while parsed messages point into the memory */
+        StreamMemory *memory;
+
+        /* bytes moved inside of the buffer */
+        unsigned long long moved;
+} StreamBuffer;
+
+/*
+ * Counters of the I/O of a stream. The high water marks are the
+ * largest amounts of data which were buffered at once.
+ */
+typedef struct {
+        unsigned long long bytes_read;
+        unsigned long long bytes_written;
+        unsigned long long reads;
+        unsigned long long writes;
+        unsigned long long reads_blocked;
+        unsigned long long writes_blocked;
+        unsigned long long partial_writes;
+        unsigned long long moved;
+        unsigned long long copied;
+        unsigned long in_high_water;
+        unsigned long out_high_water;
+} StreamStatistics;
 
 struct VarlinkStream {
         int fd;
 
-        uint8_t *in;
-        unsigned long in_start;
-        unsigned long in_end;
+        /* where the buffers come from, NULL for plain allocations */
+        BufferPool *pool;
+
+        StreamBuffer in;
+        StreamBuffer out;
 
-        uint8_t *out;
-        unsigned long out_start;
-        unsigned long out_end;
+        /* output handed to the kernel, but not completely sent yet */
+        StreamBuffer sending;
+
+        /* bytes at the start of the input known not to contain a NUL */
+        unsigned long in_scanned;
+
+        /* a received message was invalid, the stream cannot be read any more */
+        long in_error;
+
+        unsigned long max_message_size;
+
+        /* writes are not flushed while less than this is buffered */
+        unsigned long cork;
 
         bool hup;
+
+        StreamStatistics statistics;
+
+        /*
+         * The socket is read and written by the owner of the stream,
+         * which feeds received data with varlink_stream_feed() and sends
+         * the output with varlink_stream_start_send().
+         */
+        bool external_io;
 };
 
 long varlink_stream_new(VarlinkStream **streamp, int fd);
 VarlinkStream *varlink_stream_free(VarlinkStream *stream);
 
+/*
+ * Sets the maximum size of a message (including its NUL delimiter),
+ * which also bounds the size of the buffers. Zero restores the default.
+ */
+void varlink_stream_set_max_message_size(VarlinkStream *stream, unsigned long size);
+
 /*
  * Reads a message from the stream. If a full message is available,
  * return 1 and store it in messagep. Otherwise, returns 0.
  */
 long varlink_stream_read(VarlinkStream *stream, VarlinkObject **messagep);
 
+/*
+ * Reads up to n_messages messages from the stream. All complete messages
+ * in the input buffer are returned before the socket is read again, and
+ * at most one read is issued per call. Returns the number of messages
+ * stored in messages, 0 if there is no complete message.
+ */
+long varlink_stream_read_batch(VarlinkStream *stream, VarlinkObject **messages, unsigned long n_messages);
+
 /*
  * Writes message to the stream. Returns 1 if the whole message was
  * written. Otherwise, returns 0. Use varlink_stream_flush() to write
@@ -36,10 +142,52 @@ long varlink_stream_read(VarlinkStream *stream, VarlinkObject **messagep);
  */
 long varlink_stream_write(VarlinkStream *stream, VarlinkObject *message);
 
+/*
+ * Corks the stream: varlink_stream_write() only appends to the write
+ * buffer and returns 0 until at least threshold bytes are pending, the
+ * caller flushes the stream when it is done writing. Zero uncorks it.
+ */
+void varlink_stream_set_cork(VarlinkStream *stream, unsigned long threshold);
+
 /*
  * Flushes the write buffer. Returns the amount of bytes that are still
  * in the buffer.
  */
 size_t varlink_stream_flush(VarlinkStream *stream);
 
+/*
+ * Fills statistics with the counters of the stream.
+ */
+void varlink_stream_get_statistics(VarlinkStream *stream, StreamStatistics *statistics);
+
+/*
+ * Adds the counters of statistics to total.
+ */
+void stream_statistics_add(StreamStatistics *total, const StreamStatistics *statistics);
+
+/*
+ * The amount of output which has not been sent yet.
+ */
+unsigned long varlink_stream_get_pending(VarlinkStream *stream);
+
+/*
+ * Appends data received by the owner of the stream to the input buffer.
+ */
+long varlink_stream_feed(VarlinkStream *stream, const uint8_t *data, unsigned long length);
+
+/*
+ * Hands the output to the owner of the stream for sending: fills iov
+ * with the segments to send and returns their number. The segments stay
+ * valid until they are acknowledged with varlink_stream_finish_send();
+ * output written in the meantime is sent with the next call.
+ */
+unsigned long varlink_stream_start_send(VarlinkStream *stream, struct iovec *iov);
+void varlink_stream_finish_send(VarlinkStream *stream, unsigned long length);
+
+/*
+ * Forwards the data from client_in to server and from server to
+ * client_out, until the server hangs up, a side fails, or signal_fd
+ * becomes readable. Returns 0, or a negative VARLINK_ERROR if the bridge
+ * could not be set up.
+ */
 long varlink_stream_bridge(int signal_fd, VarlinkStream *client_in, VarlinkStream *client_out, VarlinkStream *server);
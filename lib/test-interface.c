@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include "interface.h"
+#include "object.h"
 #include "util.h"
 
 #include <assert.h>
@@ -252,12 +253,111 @@ static void test_writer(void) {
         }
 }
 
+static VarlinkObject *json_new(const char *json) {
+        VarlinkObject *object;
+
+        assert(varlink_object_new_from_json(&object, json) == 0);
+
+        return object;
+}
+
+static VarlinkObject *message_new(const char *json) {
+        _cleanup_(scanner_buffer_unrefp) ScannerBuffer *buffer = NULL;
+        VarlinkObject *message;
+
+        assert(scanner_buffer_new(&buffer, strlen(json)) == 0);
+        memcpy(buffer->data, json, strlen(json));
+        assert(varlink_object_new_from_message(&message, buffer) == 0);
+
+        return message;
+}
+
+static void test_check(void) {
+        const char *string = "interface com.example.test\n"
+                             "type Node (name: string, children: ?[]Node)\n"
+                             "method Foo(\n"
+                             "  i: int,\n"
+                             "  f: float,\n"
+                             "  color: (red, green),\n"
+                             "  maybe: ?string,\n"
+                             "  list: []?bool,\n"
+                             "  map: [string]int,\n"
+                             "  node: Node,\n"
+                             "  any: object\n"
+                             ") -> ()\n";
+        const char *valid[] = {
+                "{\"i\":1,\"f\":1,\"color\":\"red\",\"list\":[true,null],\"map\":{\"a\":1},"
+                "\"node\":{\"name\":\"a\",\"children\":[{\"name\":\"b\"}]},\"any\":{\"x\":[]},"
+                "\"unknown\":true}",
+                "{\"i\":-1,\"f\":1.5e3,\"color\":\"\\u0072ed\",\"maybe\":null,\"list\":[],\"map\":{\"a\":null,\"b\":2},"
+                "\"node\":{\"name\":null,\"extra\":{\"x\":[{\"}\":\"]\"}]},\"name\":\"a\",\"children\":null},"
+                "\"any\":{}}"
+        };
+        const struct {
+                const char *json;
+                const char *field;
+        } invalid[] = {
+                { "{\"i\":1.5,\"f\":1,\"color\":\"red\",\"list\":[],\"map\":{},\"node\":{\"name\":\"a\"},\"any\":{}}", "i" },
+                { "{\"i\":1,\"f\":1,\"color\":\"blue\",\"list\":[],\"map\":{},\"node\":{\"name\":\"a\"},\"any\":{}}", "color" },
+                { "{\"i\":1,\"f\":1,\"color\":\"red\",\"maybe\":1,\"list\":[],\"map\":{},\"node\":{\"name\":\"a\"},\"any\":{}}", "maybe" },
+                { "{\"i\":1,\"f\":1,\"color\":\"red\",\"list\":[1],\"map\":{},\"node\":{\"name\":\"a\"},\"any\":{}}", "list" },
+                { "{\"i\":1,\"f\":1,\"color\":\"red\",\"list\":[],\"map\":{\"a\":\"b\"},\"node\":{\"name\":\"a\"},\"any\":{}}", "map" },
+                { "{\"i\":1,\"f\":1,\"color\":\"red\",\"list\":[],\"map\":{},\"node\":{\"name\":\"a\",\"children\":[{}]},\"any\":{}}", "node" },
+                { "{\"i\":1,\"f\":1,\"color\":\"red\",\"list\":[],\"map\":{},\"node\":{\"name\":\"a\"},\"any\":[]}", "any" },
+                { "{\"i\":1,\"f\":1,\"color\":\"red\",\"list\":[],\"map\":{},\"any\":{}}", "node" },
+                { "{\"i\":1,\"f\":1,\"color\":\"red\",\"list\":[],\"map\":{},\"node\":{\"name\":null},\"any\":{}}", "node" },
+                { "{\"i\":1,\"f\":1,\"color\":\"red\",\"list\":[],\"map\":{},\"node\":{\"name\":\"a\",\"children\":[null]},\"any\":{}}", "node" }
+        };
+        _cleanup_(varlink_interface_freep) VarlinkInterface *interface = NULL;
+        const char *nested[] = { "list", "map", "node", "any" };
+        VarlinkMethod *method;
+        VarlinkObject *object;
+        const char *field = NULL;
+
+        assert(varlink_interface_new(&interface, string, NULL) == 0);
+        method = varlink_interface_get_method(interface, "Foo");
+        assert(method);
+
+        for (unsigned long i = 0; i < ARRAY_SIZE(valid); i += 1) {
+                /* parsed values, and received ones which are checked without parsing them */
+                for (unsigned long received = 0; received < 2; received += 1) {
+                        object = received ? message_new(valid[i]) : json_new(valid[i]);
+                        field = NULL;
+                        assert(varlink_interface_check_object(interface, method->type_in, object, &field) == 0);
+                        assert(field == NULL);
+                        assert(varlink_object_unref(object) == NULL);
+                }
+        }
+
+        for (unsigned long i = 0; i < ARRAY_SIZE(invalid); i += 1) {
+                for (unsigned long received = 0; received < 2; received += 1) {
+                        object = received ? message_new(invalid[i].json) : json_new(invalid[i].json);
+                        assert(varlink_interface_check_object(interface, method->type_in, object, &field) == -VARLINK_ERROR_INVALID_TYPE);
+                        assert(strcmp(field, invalid[i].field) == 0);
+                        assert(varlink_object_unref(object) == NULL);
+                }
+        }
+
+        /* nested values which are checked, but not read, are not parsed */
+        object = message_new(valid[0]);
+        assert(varlink_interface_check_object(interface, method->type_in, object, &field) == 0);
+        for (unsigned long i = 0; i < ARRAY_SIZE(nested); i += 1) {
+                VarlinkValue *value;
+                ScannerBuffer *buffer;
+
+                assert(varlink_object_peek_value(object, nested[i], &value, &buffer) == 0);
+                assert(value->lazy);
+        }
+        assert(varlink_object_unref(object) == NULL);
+}
+
 int main(void) {
         test_invalid();
         test_method_name();
         test_name();
         test_docstrings();
         test_writer();
+        test_check();
 
         return 0;
 }
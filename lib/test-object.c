@@ -6,6 +6,7 @@
 #include "util.h"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <math.h>
 #include <string.h>
 #include <locale.h>
@@ -124,12 +125,356 @@ static void test_json(void) {
         assert(varlink_object_unref(s) == NULL);
 }
 
+static void test_to_json(void) {
+        const struct {
+                const char *in;
+                const char *out;
+        } cases[] = {
+                { "{ \"a\": 0, \"b\": -1, \"c\": 9, \"d\": 10, \"e\": 99, \"f\": 100, \"g\": -1234567 }",
+                  "{\"a\":0,\"b\":-1,\"c\":9,\"d\":10,\"e\":99,\"f\":100,\"g\":-1234567}" },
+                { "{ \"max\": 9223372036854775807, \"min\": -9223372036854775808 }",
+                  "{\"max\":9223372036854775807,\"min\":-9223372036854775808}" },
+                { "{ \"s\": \"plain \\\" \\\\ \\n\\u0001\\u001f\u00e4 end\", \"t\": [ \"\", \"x\" ] }",
+                  "{\"s\":\"plain \\\" \\\\ \\n\\u0001\\u001f\u00e4 end\",\"t\":[\"\",\"x\"]}" },
+                { "{ \"a\": 0.1, \"b\": 1.0, \"c\": -0.0, \"d\": 100e0, \"e\": 1e20, \"f\": 1e21 }",
+                  "{\"a\":0.1,\"b\":1.0,\"c\":-0.0,\"d\":100.0,\"e\":100000000000000000000.0,\"f\":1e21}" },
+                { "{ \"a\": 0.000001, \"b\": 1.5e-7, \"c\": 1e300, \"d\": 4.9e-324, \"e\": 1.7976931348623157e308 }",
+                  "{\"a\":0.000001,\"b\":1.5e-7,\"c\":1e300,\"d\":5e-324,\"e\":1.7976931348623157e308}" },
+                { "{ \"a\": 1e23, \"b\": 9.5e-5, \"c\": 2.2250738585072014e-308, \"d\": 9007199254740992.0 }",
+                  "{\"a\":1e23,\"b\":0.000095,\"c\":2.2250738585072014e-308,\"d\":9007199254740992.0}" }
+        };
+
+        for (unsigned long i = 0; i < ARRAY_SIZE(cases); i += 1) {
+                _cleanup_(varlink_object_unrefp) VarlinkObject *object = NULL;
+                _cleanup_(freep) char *json = NULL;
+
+                assert(varlink_object_new_from_json(&object, cases[i].in) == 0);
+                assert(varlink_object_to_json(object, &json) == (long) strlen(cases[i].out));
+                assert(strcmp(json, cases[i].out) == 0);
+        }
+}
+
+static void test_escape(void) {
+        const struct {
+                char c;
+                const char *escaped;
+        } cases[] = {
+                { '"', "\\\"" },
+                { '\\', "\\\\" },
+                { '\n', "\\n" },
+                { '\x01', "\\u0001" },
+                { '\x1f', "\\u001f" },
+                { ' ', " " },
+                { '\x7f', "\x7f" }
+        };
+
+        /* the escape at every position of strings around the vector sizes */
+        for (unsigned long length = 1; length < 80; length += 1) {
+                for (unsigned long i = 0; i < length; i += 1) {
+                        for (unsigned long c = 0; c < ARRAY_SIZE(cases); c += 1) {
+                                _cleanup_(varlink_object_unrefp) VarlinkObject *object = NULL;
+                                _cleanup_(freep) char *json = NULL;
+                                char string[80];
+                                char expected[128];
+
+                                memset(string, 'a', length);
+                                string[length] = '\0';
+                                string[i] = cases[c].c;
+
+                                assert(snprintf(expected, sizeof(expected), "{\"s\":\"%.*s%s%s\"}",
+                                                (int)i, string, cases[c].escaped, string + i + 1) > 0);
+
+                                assert(varlink_object_new(&object) == 0);
+                                assert(varlink_object_set_string(object, "s", string) == 0);
+                                assert(varlink_object_to_json(object, &json) > 0);
+                                assert(strcmp(json, expected) == 0);
+                        }
+                }
+        }
+}
+
+static void test_freeze(void) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *object = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *parent = NULL;
+        _cleanup_(varlink_array_unrefp) VarlinkArray *parents = NULL;
+        _cleanup_(freep) char *json = NULL;
+        _cleanup_(freep) char *frozen = NULL;
+        _cleanup_(freep) char *spliced = NULL;
+        _cleanup_(freep) char *expected = NULL;
+        _cleanup_(freep) char *changed = NULL;
+        _cleanup_(freep) char *refrozen = NULL;
+        _cleanup_(freep) char *extended = NULL;
+        VarlinkObject *nested;
+        VarlinkArray *array;
+        long length;
+
+        assert(varlink_object_new_from_json(&object, "{ \"a\": [ { \"b\": 1 }, { \"b\": 2 } ], \"c\": { \"d\": \"e\" }, \"f\": 1.5 }") == 0);
+        length = varlink_object_to_json(object, &json);
+        assert(length > 0);
+
+        assert(varlink_object_freeze(object) == 0);
+        assert(varlink_object_freeze(object) == 0);
+        assert(varlink_object_to_json(object, &frozen) == length);
+        assert(strcmp(frozen, json) == 0);
+
+        /* the frozen object is copied into the objects and arrays it is part of */
+        assert(varlink_array_new(&parents) == 0);
+        assert(varlink_array_append_object(parents, object) == 0);
+        assert(varlink_array_append_object(parents, object) == 0);
+        assert(varlink_array_freeze(parents) == 0);
+
+        assert(varlink_object_new(&parent) == 0);
+        assert(varlink_object_set_array(parent, "parents", parents) == 0);
+        assert(varlink_object_set_object(parent, "object", object) == 0);
+        assert(varlink_object_to_json(parent, &spliced) > 0);
+        assert(asprintf(&expected, "{\"object\":%s,\"parents\":[%s,%s]}", json, json, json) > 0);
+        assert(strcmp(spliced, expected) == 0);
+        assert(varlink_object_freeze(parent) == 0);
+
+        /* changing anything nested drops the cache of all its parents */
+        assert(varlink_object_get_array(object, "a", &array) == 0);
+        assert(varlink_array_get_object(array, 1, &nested) == 0);
+        assert(varlink_object_set_int(nested, "b", 3) == 0);
+        assert(varlink_object_to_json(parent, &changed) > 0);
+        assert(strstr(changed, "{\"b\":3}"));
+        assert(!strstr(changed, "{\"b\":2}"));
+
+        /* the nested object is frozen again, its parents still notice the change */
+        assert(varlink_object_freeze(object) == 0);
+        assert(varlink_object_to_json(parent, &refrozen) > 0);
+        assert(strcmp(refrozen, changed) == 0);
+
+        /* a frozen object can still be changed itself */
+        assert(varlink_object_freeze(parent) == 0);
+        assert(varlink_object_set_int(parent, "g", 1) == 0);
+        assert(varlink_object_to_json(parent, &extended) > 0);
+        assert(strncmp(extended, "{\"g\":1,", 7) == 0);
+        assert(strcmp(extended + 7, changed + 1) == 0);
+}
+
+static void test_float(const char *json, double expected) {
+        VarlinkObject *s;
+        char *input;
+        double f;
+
+        assert(asprintf(&input, "{ \"f\": %s }", json) > 0);
+        assert(varlink_object_new_from_json(&s, input) == 0);
+        assert(varlink_object_get_float(s, "f", &f) == 0);
+
+        /* correctly rounded, bit by bit */
+        assert(memcmp(&f, &expected, sizeof(double)) == 0);
+
+        assert(varlink_object_unref(s) == NULL);
+        free(input);
+}
+
+static void test_float_round_trip(void) {
+        uint64_t state = 0x9e3779b97f4a7c15;
+
+        for (unsigned long i = 0; i < 100000; i += 1) {
+                _cleanup_(varlink_object_unrefp) VarlinkObject *object = NULL;
+                _cleanup_(varlink_object_unrefp) VarlinkObject *parsed = NULL;
+                _cleanup_(freep) char *json = NULL;
+                uint64_t bits;
+                double f, g;
+
+                /* xorshift over all bit patterns, skipping inf and nan */
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                bits = state;
+                memcpy(&f, &bits, sizeof(double));
+                if (!isfinite(f))
+                        continue;
+
+                assert(varlink_object_new(&object) == 0);
+                assert(varlink_object_set_float(object, "f", f) == 0);
+                assert(varlink_object_to_json(object, &json) > 0);
+
+                assert(varlink_object_new_from_json(&parsed, json) == 0);
+                assert(varlink_object_get_float(parsed, "f", &g) == 0);
+                assert(memcmp(&f, &g, sizeof(double)) == 0);
+        }
+}
+
+static void test_int(const char *json, int64_t expected) {
+        VarlinkObject *s;
+        char *input;
+        int64_t i;
+
+        assert(asprintf(&input, "{ \"i\": %s }", json) > 0);
+        assert(varlink_object_new_from_json(&s, input) == 0);
+        assert(varlink_object_get_int(s, "i", &i) == 0);
+        assert(i == expected);
+
+        assert(varlink_object_unref(s) == NULL);
+        free(input);
+}
+
+static void test_numbers(void) {
+        VarlinkObject *s;
+
+        test_int("0", 0);
+        test_int("-0", 0);
+        test_int("+17", 17);
+        test_int("-01", -1);
+        test_int("9223372036854775807", INT64_MAX);
+        test_int("-9223372036854775808", INT64_MIN);
+        test_int("000000000000000000000000042", 42);
+
+        test_float("42.2", 42.2);
+        test_float("0.1", 0.1);
+        test_float("-2.", -2.0);
+        test_float("-0.0", -0.0);
+        test_float("1e23", 1e23);
+        test_float("1E-22", 1e-22);
+        test_float("8.98846567431158e307", 8.98846567431158e307);
+        test_float("1.7976931348623157e308", 1.7976931348623157e308);
+        test_float("2.2250738585072014e-308", 2.2250738585072014e-308);
+        test_float("4.9e-324", 4.9e-324);
+        test_float("1e-400", 0.0);
+        test_float("0e999999999999", 0.0);
+        test_float("9007199254740993.0", 9007199254740993.0);
+        test_float("123456789012345678901234567890.5", 123456789012345678901234567890.5);
+        test_float("0.30000000000000000000000000000000000001", 0.30000000000000000000000000000000000001);
+
+        /* 17 digits, beyond the exact doubles */
+        test_float("0.30000000000000004", 0.30000000000000004);
+        test_float("1.2345678901234567e-100", 1.2345678901234567e-100);
+        test_float("7.2057594037927933e16", 7.2057594037927933e16);
+        test_float("-6.0221407600000003e23", -6.0221407600000003e23);
+        test_float("2.2250738585072011e-308", 2.2250738585072011e-308);
+
+        /* exactly halfway between two doubles */
+        test_float("9007199254740993e0", 9007199254740993e0);
+        test_float("9007199254740995e0", 9007199254740995e0);
+
+        assert(varlink_object_new_from_json(&s, "{ \"i\": 9223372036854775808 }") == -VARLINK_ERROR_INVALID_JSON);
+        assert(varlink_object_new_from_json(&s, "{ \"i\": -9223372036854775809 }") == -VARLINK_ERROR_INVALID_JSON);
+        assert(varlink_object_new_from_json(&s, "{ \"i\": 100000000000000000000 }") == -VARLINK_ERROR_INVALID_JSON);
+        assert(varlink_object_new_from_json(&s, "{ \"f\": 1e309 }") == -VARLINK_ERROR_INVALID_JSON);
+        assert(varlink_object_new_from_json(&s, "{ \"f\": -1e309 }") == -VARLINK_ERROR_INVALID_JSON);
+        assert(varlink_object_new_from_json(&s, "{ \"f\": 1.0e+ }") == -VARLINK_ERROR_INVALID_JSON);
+        assert(varlink_object_new_from_json(&s, "{ \"f\": .5 }") == -VARLINK_ERROR_INVALID_JSON);
+        assert(varlink_object_new_from_json(&s, "{ \"f\": 0x10 }") == -VARLINK_ERROR_INVALID_JSON);
+}
+
+static void test_string(const char *json, const char *expected) {
+        VarlinkObject *s;
+        const char *string;
+        char *input;
+
+        assert(asprintf(&input, "{ \"s\": \"%s\" }", json) > 0);
+        assert(varlink_object_new_from_json(&s, input) == 0);
+        assert(varlink_object_get_string(s, "s", &string) == 0);
+        assert(strcmp(string, expected) == 0);
+
+        assert(varlink_object_unref(s) == NULL);
+        free(input);
+}
+
+static void test_strings(void) {
+        VarlinkObject *s;
+
+        test_string("", "");
+        test_string("short", "short");
+        test_string("a string which is longer than one vector", "a string which is longer than one vector");
+        test_string("ä string wïth nön-ASCII characters spread över it, €", "ä string wïth nön-ASCII characters spread över it, €");
+        test_string("escapes at the end of a long run of plain text\\n", "escapes at the end of a long run of plain text\n");
+        test_string("\\\"quoted\\\" in the middle of a string, \\\\ and \\/ too", "\"quoted\" in the middle of a string, \\ and / too");
+        test_string("\\u00e4\\u20ac\\ud83d\\ude00 after escapes, a long plain run follows",
+                    "ä€😀 after escapes, a long plain run follows");
+        test_string("carriage\rreturn", "carriage\rreturn");
+
+        /* invalid UTF-8 in and after long runs */
+        assert(varlink_object_new_from_json(&s, "{ \"s\": \"0123456789abcdef0123456789\xff\" }") == -VARLINK_ERROR_INVALID_JSON);
+        assert(varlink_object_new_from_json(&s, "{ \"s\": \"0123456789abcdef\\n0123456789\xc3\" }") == -VARLINK_ERROR_INVALID_JSON);
+
+        /* unterminated, raw tab and newline, NUL */
+        assert(varlink_object_new_from_json(&s, "{ \"s\": \"0123456789abcdef0123456789 }") == -VARLINK_ERROR_INVALID_JSON);
+        assert(varlink_object_new_from_json(&s, "{ \"s\": \"0123456789abcdef\\n0123456789\\") == -VARLINK_ERROR_INVALID_JSON);
+        assert(varlink_object_new_from_json(&s, "{ \"s\": \"a\tb\" }") == -VARLINK_ERROR_INVALID_JSON);
+        assert(varlink_object_new_from_json(&s, "{ \"s\": \"\\\\a\nb\" }") == -VARLINK_ERROR_INVALID_JSON);
+        assert(varlink_object_new_from_json(&s, "{ \"s\": \"a\\u0000b\" }") == -VARLINK_ERROR_INVALID_JSON);
+        assert(varlink_object_new_from_json(&s, "{ \"s\": \"a\\ud83d\" }") == -VARLINK_ERROR_INVALID_JSON);
+        assert(varlink_object_new_from_json(&s, "{ \"s\": \"a\\x\" }") == -VARLINK_ERROR_INVALID_JSON);
+}
+
+static void test_keys(void) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *object = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *parsed = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *other = NULL;
+        _cleanup_(freep) const char **parsed_names = NULL;
+        _cleanup_(freep) const char **other_names = NULL;
+        _cleanup_(freep) char *json = NULL;
+        char long_key[256];
+        int64_t i;
+
+        memset(long_key, 'k', sizeof(long_key) - 1);
+        long_key[sizeof(long_key) - 1] = '\0';
+
+        /* more keys than atoms, and keys too long to be atoms */
+        assert(varlink_object_new(&object) == 0);
+        for (int64_t n = 0; n < 3000; n += 1) {
+                char key[32];
+
+                sprintf(key, "key%" PRIi64, n);
+                assert(varlink_object_set_int(object, key, n) == 0);
+        }
+        assert(varlink_object_set_int(object, long_key, -1) == 0);
+        assert(varlink_object_get_field_names(object, NULL) == 3001);
+
+        for (int64_t n = 0; n < 3000; n += 1) {
+                char key[32];
+
+                sprintf(key, "key%" PRIi64, n);
+                assert(varlink_object_get_int(object, key, &i) == 0);
+                assert(i == n);
+        }
+        assert(varlink_object_get_int(object, long_key, &i) == 0);
+        assert(i == -1);
+
+        assert(varlink_object_set_null(object, "key7") == 0);
+        assert(varlink_object_get_int(object, "key7", &i) == -VARLINK_ERROR_UNKNOWN_FIELD);
+
+        assert(varlink_object_new_from_json(&parsed, "{\"key1\":1,\"key2\":2}") == 0);
+        assert(varlink_object_get_int(parsed, "key2", &i) == 0);
+        assert(i == 2);
+
+        /* keys which are not atoms are copied for every object */
+        assert(varlink_object_get_field_names(parsed, &parsed_names) == 2);
+        assert(varlink_object_new(&other) == 0);
+        assert(varlink_object_set_int(other, "key2", 0) == 0);
+        assert(varlink_object_get_field_names(other, &other_names) == 1);
+        assert(strcmp(parsed_names[1], other_names[0]) == 0);
+
+        /* names which share the first eight bytes */
+        assert(varlink_object_set_int(other, "interface1", 1) == 0);
+        assert(varlink_object_set_int(other, "interface", 2) == 0);
+        assert(varlink_object_set_int(other, "interface2", 3) == 0);
+        assert(varlink_object_set_int(other, "interfac", 4) == 0);
+        assert(varlink_object_get_int(other, "interface", &i) == 0);
+        assert(i == 2);
+        assert(varlink_object_get_int(other, "interfac", &i) == 0);
+        assert(i == 4);
+        assert(varlink_object_get_int(other, "interface3", &i) == -VARLINK_ERROR_UNKNOWN_FIELD);
+        assert(varlink_object_to_json(other, &json) > 0);
+        assert(strcmp(json, "{\"interfac\":4,\"interface\":2,\"interface1\":1,\"interface2\":3,\"key2\":0}") == 0);
+}
+
 int main(int argc, char **argv) {
         // Uses `,` as the radix character
         assert(setlocale(LC_NUMERIC, "de_DE.UTF-8") != 0);
 
         test_api();
         test_json();
+        test_to_json();
+        test_escape();
+        test_freeze();
+        test_numbers();
+        test_float_round_trip();
+        test_strings();
+        test_keys();
 
         return EXIT_SUCCESS;
 }
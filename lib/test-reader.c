@@ -0,0 +1,231 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "object.h"
+#include "util.h"
+
+#include <assert.h>
+#include <string.h>
+
+static void test_events(void) {
+        _cleanup_(varlink_reader_freep) VarlinkReader *reader = NULL;
+        const char *json = "{ \"a\": [ 1, null, 3 ], \"b\": { \"c\": \"d\\u00e4\", \"e\": [] }, \"f\": 1.5, \"g\": true }";
+        const char *string;
+        int64_t i;
+        double f;
+        bool b;
+
+        assert(varlink_reader_new_from_json(&reader, json) == 0);
+
+        assert(varlink_reader_next(reader) == VARLINK_READER_OBJECT_BEGIN);
+        assert(varlink_reader_get_depth(reader) == 1);
+        assert(varlink_reader_next(reader) == VARLINK_READER_KEY);
+        assert(varlink_reader_get_string(reader, &string) == 0);
+        assert(strcmp(string, "a") == 0);
+        assert(varlink_reader_next(reader) == VARLINK_READER_ARRAY_BEGIN);
+        assert(varlink_reader_next(reader) == VARLINK_READER_INT);
+        assert(varlink_reader_get_int(reader, &i) == 0);
+        assert(i == 1);
+        assert(varlink_reader_get_string(reader, &string) == -VARLINK_ERROR_INVALID_TYPE);
+        assert(varlink_reader_next(reader) == VARLINK_READER_NULL);
+        assert(varlink_reader_next(reader) == VARLINK_READER_INT);
+        assert(varlink_reader_next(reader) == VARLINK_READER_ARRAY_END);
+
+        assert(varlink_reader_next(reader) == VARLINK_READER_KEY);
+        assert(varlink_reader_next(reader) == VARLINK_READER_OBJECT_BEGIN);
+        assert(varlink_reader_get_depth(reader) == 2);
+        assert(varlink_reader_next(reader) == VARLINK_READER_KEY);
+        assert(varlink_reader_next(reader) == VARLINK_READER_STRING);
+        assert(varlink_reader_get_string(reader, &string) == 0);
+        assert(strcmp(string, "dä") == 0);
+        assert(varlink_reader_next(reader) == VARLINK_READER_KEY);
+        assert(varlink_reader_next(reader) == VARLINK_READER_ARRAY_BEGIN);
+        assert(varlink_reader_next(reader) == VARLINK_READER_ARRAY_END);
+        assert(varlink_reader_next(reader) == VARLINK_READER_OBJECT_END);
+
+        assert(varlink_reader_next(reader) == VARLINK_READER_KEY);
+        assert(varlink_reader_next(reader) == VARLINK_READER_FLOAT);
+        assert(varlink_reader_get_float(reader, &f) == 0);
+        assert(f > 1.4 && f < 1.6);
+        assert(varlink_reader_next(reader) == VARLINK_READER_KEY);
+        assert(varlink_reader_next(reader) == VARLINK_READER_BOOL);
+        assert(varlink_reader_get_bool(reader, &b) == 0);
+        assert(b);
+
+        assert(varlink_reader_next(reader) == VARLINK_READER_OBJECT_END);
+        assert(varlink_reader_get_depth(reader) == 0);
+        assert(varlink_reader_next(reader) == VARLINK_READER_END);
+        assert(varlink_reader_next(reader) == VARLINK_READER_END);
+}
+
+static void test_skip(void) {
+        _cleanup_(varlink_reader_freep) VarlinkReader *reader = NULL;
+        const char *string;
+
+        assert(varlink_reader_new_from_json(&reader, "{\"a\":{\"b\":[[1],[2]]},\"c\":[],\"d\":\"e\"}") == 0);
+        assert(varlink_reader_next(reader) == VARLINK_READER_OBJECT_BEGIN);
+
+        assert(varlink_reader_next(reader) == VARLINK_READER_KEY);
+        assert(varlink_reader_skip(reader) == 0);
+        assert(varlink_reader_get_depth(reader) == 1);
+
+        assert(varlink_reader_next(reader) == VARLINK_READER_KEY);
+        assert(varlink_reader_next(reader) == VARLINK_READER_ARRAY_BEGIN);
+        assert(varlink_reader_skip(reader) == 0);
+        assert(varlink_reader_get_depth(reader) == 1);
+
+        assert(varlink_reader_next(reader) == VARLINK_READER_KEY);
+        assert(varlink_reader_get_string(reader, &string) == 0);
+        assert(strcmp(string, "d") == 0);
+        assert(varlink_reader_skip(reader) == 0);
+        assert(varlink_reader_next(reader) == VARLINK_READER_OBJECT_END);
+        assert(varlink_reader_next(reader) == VARLINK_READER_END);
+}
+
+static void test_invalid(void) {
+        const char *invalid[] = {
+                "",
+                "{\"a\":1,}",
+                "{\"a\" 1}",
+                "[1,\"two\"]",
+                "[1,1.5]",
+                "{\"a\":tru}",
+                "[1] [2]",
+                "[\"\\u0000\"]"
+        };
+
+        for (unsigned long i = 0; i < ARRAY_SIZE(invalid); i += 1) {
+                _cleanup_(varlink_reader_freep) VarlinkReader *reader = NULL;
+                long r;
+
+                assert(varlink_reader_new_from_json(&reader, invalid[i]) == 0);
+
+                do
+                        r = varlink_reader_next(reader);
+                while (r > 0);
+
+                assert(r == -VARLINK_ERROR_INVALID_JSON);
+        }
+}
+
+static VarlinkObject *message_new(const char *json) {
+        _cleanup_(scanner_buffer_unrefp) ScannerBuffer *buffer = NULL;
+        VarlinkObject *message;
+
+        assert(scanner_buffer_new(&buffer, strlen(json)) == 0);
+        memcpy(buffer->data, json, strlen(json));
+        assert(varlink_object_new_from_message(&message, buffer) == 0);
+
+        return message;
+}
+
+static void test_field(void) {
+        VarlinkObject *message;
+        VarlinkReader *reader;
+        VarlinkValue *value;
+        ScannerBuffer *message_buffer;
+        const char *json = "{\"elements\":[{\"n\":0,\"s\":\"a\\nb\"},{\"n\":1}],\"word\":\"plain\"}";
+        const char *string;
+        int64_t sum = 0;
+        long r;
+
+        message = message_new(json);
+        assert(varlink_reader_new_from_field(&reader, message, "elements") == 0);
+
+        /* the reader keeps the message alive */
+        assert(varlink_object_unref(message) == NULL);
+
+        assert(varlink_reader_next(reader) == VARLINK_READER_ARRAY_BEGIN);
+        while ((r = varlink_reader_next(reader)) != VARLINK_READER_ARRAY_END) {
+                assert(r == VARLINK_READER_OBJECT_BEGIN);
+
+                while ((r = varlink_reader_next(reader)) == VARLINK_READER_KEY) {
+                        int64_t n;
+
+                        assert(varlink_reader_get_string(reader, &string) == 0);
+                        if (strcmp(string, "n") == 0) {
+                                assert(varlink_reader_next(reader) == VARLINK_READER_INT);
+                                assert(varlink_reader_get_int(reader, &n) == 0);
+                                sum += n + 1;
+                        } else {
+                                assert(varlink_reader_next(reader) == VARLINK_READER_STRING);
+                                assert(varlink_reader_get_string(reader, &string) == 0);
+                                assert(strcmp(string, "a\nb") == 0);
+                        }
+                }
+
+                assert(r == VARLINK_READER_OBJECT_END);
+        }
+
+        assert(sum == 3);
+        assert(varlink_reader_next(reader) == VARLINK_READER_END);
+        assert(varlink_reader_free(reader) == NULL);
+
+        /* the array is not parsed */
+        message = message_new(json);
+        assert(varlink_reader_new_from_field(&reader, message, "elements") == 0);
+        assert(varlink_reader_next(reader) == VARLINK_READER_ARRAY_BEGIN);
+        assert(varlink_reader_skip(reader) == 0);
+        assert(varlink_reader_next(reader) == VARLINK_READER_END);
+        assert(varlink_reader_free(reader) == NULL);
+
+        assert(varlink_object_peek_value(message, "elements", &value, &message_buffer) == 0);
+        assert(value->lazy);
+
+        /* values which are not lazy are read as well */
+        assert(varlink_reader_new_from_field(&reader, message, "word") == 0);
+        assert(varlink_reader_next(reader) == VARLINK_READER_STRING);
+        assert(varlink_reader_get_string(reader, &string) == 0);
+        assert(strcmp(string, "plain") == 0);
+        assert(varlink_reader_next(reader) == VARLINK_READER_END);
+        assert(varlink_reader_free(reader) == NULL);
+
+        assert(varlink_reader_new_from_field(&reader, message, "none") == -VARLINK_ERROR_UNKNOWN_FIELD);
+        assert(varlink_object_unref(message) == NULL);
+}
+
+/*
+ * The message is not changed under a reader, when the value it reads
+ * is parsed at the same time.
+ */
+static void test_field_materialized(void) {
+        VarlinkObject *message;
+        VarlinkReader *reader;
+        VarlinkArray *elements;
+        _cleanup_(freep) char *json = NULL;
+        const char *string;
+        const char *words[] = { "abc", "d\"f", "ghi" };
+
+        message = message_new("{\"elements\":[\"abc\",\"d\\\"f\",\"ghi\"],\"w\":1}");
+        assert(varlink_reader_new_from_field(&reader, message, "elements") == 0);
+        assert(varlink_reader_next(reader) == VARLINK_READER_ARRAY_BEGIN);
+
+        assert(varlink_object_get_array(message, "elements", &elements) == 0);
+        assert(varlink_array_get_string(elements, 1, &string) == 0);
+        assert(strcmp(string, "d\"f") == 0);
+        assert(varlink_object_to_pretty_json(message, &json, -1, NULL, NULL, NULL, NULL) > 0);
+
+        for (unsigned long i = 0; i < ARRAY_SIZE(words); i += 1) {
+                assert(varlink_reader_next(reader) == VARLINK_READER_STRING);
+                assert(varlink_reader_get_string(reader, &string) == 0);
+                assert(strcmp(string, words[i]) == 0);
+        }
+
+        assert(varlink_reader_next(reader) == VARLINK_READER_ARRAY_END);
+        assert(varlink_reader_next(reader) == VARLINK_READER_END);
+        assert(varlink_reader_free(reader) == NULL);
+
+        /* the copy stays valid without the reader */
+        assert(varlink_array_get_string(elements, 2, &string) == 0);
+        assert(strcmp(string, "ghi") == 0);
+        assert(varlink_object_unref(message) == NULL);
+}
+
+int main(void) {
+        test_events();
+        test_skip();
+        test_invalid();
+        test_field();
+        test_field_materialized();
+
+        return EXIT_SUCCESS;
+}
@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -49,6 +50,61 @@ static long org_varlink_example_Later(VarlinkService *UNUSED(service),
         return 0;
 }
 
+typedef struct {
+        int64_t n;
+        int64_t sent;
+        unsigned long n_blocked;
+} Producer;
+
+static void producer_continue(VarlinkCall *call, void *userdata) {
+        Producer *producer = userdata;
+        char padding[1024];
+
+        memset(padding, 'x', sizeof(padding) - 1);
+        padding[sizeof(padding) - 1] = '\0';
+
+        for (;;) {
+                VarlinkObject *out;
+                uint64_t flags;
+                long r;
+
+                assert(varlink_object_new(&out) == 0);
+                assert(varlink_object_set_int(out, "i", producer->sent) == 0);
+                assert(varlink_object_set_string(out, "padding", padding) == 0);
+
+                flags = producer->sent + 1 < producer->n ? VARLINK_REPLY_CONTINUES : 0;
+                r = varlink_call_reply(call, out, flags);
+                assert(r >= 0);
+                assert(varlink_object_unref(out) == NULL);
+
+                producer->sent += 1;
+                if (!flags)
+                        return;
+
+                /* wait until the client caught up */
+                if (r == 1) {
+                        producer->n_blocked += 1;
+                        return;
+                }
+        }
+}
+
+static long org_varlink_example_Count(VarlinkService *UNUSED(service),
+                                      VarlinkCall *call,
+                                      VarlinkObject *parameters,
+                                      uint64_t flags,
+                                      void *userdata) {
+        Producer *producer = userdata;
+
+        assert(flags & VARLINK_CALL_MORE);
+        assert(varlink_object_get_int(parameters, "n", &producer->n) == 0);
+
+        assert(varlink_call_set_writable_callback(call, producer_continue, producer) == 0);
+        producer_continue(call, producer);
+
+        return 0;
+}
+
 static long test_process_events(Test *test) {
         struct epoll_event events[2];
         long n;
@@ -104,14 +160,57 @@ static long later_callback(VarlinkConnection *UNUSED(connection),
         return 0;
 }
 
-int main(void) {
+typedef struct {
+        char *error;
+        VarlinkObject *parameters;
+} ErrorCall;
+
+static long error_callback(VarlinkConnection *UNUSED(connection),
+                           const char *error,
+                           VarlinkObject *parameters,
+                           uint64_t UNUSED(flags),
+                           void *userdata) {
+        ErrorCall *call = userdata;
+
+        assert(error != NULL);
+        call->error = strdup(error);
+        call->parameters = varlink_object_ref(parameters);
+        return 0;
+}
+
+typedef struct {
+        int64_t n_received;
+        bool done;
+} CountCall;
+
+static long count_callback(VarlinkConnection *UNUSED(connection),
+                           const char *error,
+                           VarlinkObject *parameters,
+                           uint64_t flags,
+                           void *userdata) {
+        CountCall *call = userdata;
+        int64_t i;
+
+        assert(error == NULL);
+        assert(varlink_object_get_int(parameters, "i", &i) == 0);
+        assert(i == call->n_received);
+
+        call->n_received += 1;
+        call->done = !(flags & VARLINK_REPLY_CONTINUES);
+        return 0;
+}
+
+static void test_backend(long backend) {
         const char *interface = "interface org.varlink.example\n"
                                         "method Echo(word: string) -> (word: string)\n"
-                                        "method Later() -> ()";
+                                        "method Later() -> ()\n"
+                                        "method Count(n: int) -> (i: int, padding: string)";
         const char *words[] = { "one", "two", "three", "four", "five" };
 
         Test test = {};
         VarlinkCall *later_call = NULL;
+        Producer producer = {};
+        long r;
 
         assert(varlink_service_new(&test.service,
                                    "Varlink", "Test Service", "1", "http://example.com",
@@ -120,7 +219,12 @@ int main(void) {
         assert(varlink_service_add_interface(test.service, interface,
                                              "Echo", org_varlink_example_Echo, NULL,
                                              "Later", org_varlink_example_Later, &later_call,
+                                             "Count", org_varlink_example_Count, &producer,
                                              NULL) == 0);
+        assert(varlink_service_enable_statistics(test.service) == 0);
+
+        r = varlink_service_set_backend(test.service, backend);
+        assert(r == backend);
 
         assert(varlink_connection_new(&test.connection, "unix:@test.socket") == 0);
 
@@ -178,6 +282,29 @@ int main(void) {
                 assert(call.n_received == 0);
         }
 
+        {
+                ErrorCall call = {};
+                VarlinkObject *parameters;
+                const char *parameter;
+
+                /* the handler is not called with parameters of the wrong type */
+                assert(varlink_object_new(&parameters) == 0);
+                assert(varlink_object_set_int(parameters, "word", 42) == 0);
+                assert(varlink_connection_call(test.connection, "org.varlink.example.Echo", parameters, 0,
+                                               error_callback, &call) == 0);
+                assert(varlink_object_unref(parameters) == NULL);
+
+                for (long i = 0; call.error == NULL && i < 10; i += 1)
+                        assert(test_process_events(&test) == 0);
+
+                assert(call.error != NULL);
+                assert(strcmp(call.error, "org.varlink.service.InvalidParameter") == 0);
+                assert(varlink_object_get_string(call.parameters, "parameter", &parameter) == 0);
+                assert(strcmp(parameter, "word") == 0);
+                free(call.error);
+                assert(varlink_object_unref(call.parameters) == NULL);
+        }
+
         {
                 VarlinkObject *out = NULL;
 
@@ -199,9 +326,140 @@ int main(void) {
                 assert(varlink_object_unref(out) == NULL);
         }
 
+        {
+                EchoCall call = {
+                        .words = words,
+                        .n_received = 0
+                };
+
+                /* replies to pipelined calls are written all at once */
+                varlink_service_set_cork_threshold(test.service, 64 * 1024);
+
+                for (unsigned long i = 0; i < ARRAY_SIZE(words); i += 1) {
+                        VarlinkObject *parameters;
+
+                        assert(varlink_object_new(&parameters) == 0);
+                        assert(varlink_object_set_string(parameters, "word", words[i]) == 0);
+                        assert(varlink_connection_call(test.connection, "org.varlink.example.Echo", parameters, 0,
+                                                       echo_callback, &call) == 0);
+                        assert(varlink_object_unref(parameters) == NULL);
+                }
+
+                for (long i = 0; call.n_received < ARRAY_SIZE(words) && i < 10; i += 1)
+                        assert(test_process_events(&test) == 0);
+
+                assert(call.n_received == ARRAY_SIZE(words));
+        }
+
+        {
+                CountCall call = {};
+                VarlinkObject *parameters;
+
+                /* a producer which is faster than its client */
+                varlink_service_set_output_watermarks(test.service, 64 * 1024, 16 * 1024);
+
+                assert(varlink_object_new(&parameters) == 0);
+                assert(varlink_object_set_int(parameters, "n", 2000) == 0);
+                assert(varlink_connection_call(test.connection, "org.varlink.example.Count", parameters,
+                                               VARLINK_CALL_MORE, count_callback, &call) == 0);
+                assert(varlink_object_unref(parameters) == NULL);
+
+                for (long i = 0; !call.done && i < 10000; i += 1)
+                        assert(test_process_events(&test) == 0);
+
+                assert(call.done);
+                assert(call.n_received == 2000);
+                assert(producer.sent == 2000);
+                assert(producer.n_blocked > 0);
+        }
+
+        {
+                VarlinkObject *out = NULL;
+                VarlinkObject *total;
+                VarlinkArray *connections;
+                VarlinkObject *connection;
+                VarlinkObject *statistics;
+                int64_t accepted, bytes_read, bytes_written, writes_blocked, fd;
+
+                assert(varlink_connection_call(test.connection, "org.varlink.statistics.GetStatistics", NULL, 0,
+                                               later_callback, &out) == 0);
+                for (long i = 0; out == NULL && i < 10; i += 1)
+                        assert(test_process_events(&test) == 0);
+
+                assert(out != NULL);
+                assert(varlink_object_get_int(out, "accepted", &accepted) == 0);
+                assert(accepted == 1);
+
+                /* the producer above wrote faster than the client read */
+                assert(varlink_object_get_object(out, "total", &total) == 0);
+                assert(varlink_object_get_int(total, "bytesRead", &bytes_read) == 0);
+                assert(varlink_object_get_int(total, "bytesWritten", &bytes_written) == 0);
+                assert(bytes_read > 0);
+                assert(bytes_written > 2000 * 1024);
+
+                assert(varlink_object_get_array(out, "connections", &connections) == 0);
+                assert(varlink_array_get_n_elements(connections) == 1);
+                assert(varlink_array_get_object(connections, 0, &connection) == 0);
+                assert(varlink_object_get_int(connection, "fd", &fd) == 0);
+                assert(fd >= 0);
+                assert(varlink_object_get_object(connection, "statistics", &statistics) == 0);
+                assert(varlink_object_get_int(statistics, "writesBlocked", &writes_blocked) == 0);
+
+                /* with io_uring, a send waits for space instead of failing */
+                if (r == VARLINK_SERVICE_BACKEND_EPOLL)
+                        assert(writes_blocked > 0);
+
+                assert(varlink_object_unref(out) == NULL);
+        }
+
+        {
+                VarlinkObject *statistics;
+                int64_t borrowed, high_water;
+
+                /* the idle connection does not hold any buffers */
+                assert(varlink_service_get_buffer_statistics(test.service, &statistics) == 0);
+                assert(varlink_object_get_int(statistics, "borrowed", &borrowed) == 0);
+                assert(varlink_object_get_int(statistics, "highWater", &high_water) == 0);
+                assert(borrowed == 0);
+                assert(high_water > 0);
+                assert(varlink_object_unref(statistics) == NULL);
+        }
+
         assert(varlink_connection_free(test.connection) == NULL);
         assert(varlink_service_free(test.service) == NULL);
         close(test.epoll_fd);
+}
+
+/*
+ * The service falls back to epoll where io_uring is not available,
+ * which must not pass for a test of io_uring.
+ */
+static bool io_uring_available(void) {
+        VarlinkService *service;
+        long r;
+
+        assert(varlink_service_new(&service,
+                                   "Varlink", "Test Service", "1", "http://example.com",
+                                   "unix:@test.socket.probe",
+                                   -1) == 0);
+        r = varlink_service_set_backend(service, VARLINK_SERVICE_BACKEND_IO_URING);
+        assert(r == VARLINK_SERVICE_BACKEND_IO_URING || r == VARLINK_SERVICE_BACKEND_EPOLL);
+        assert(varlink_service_free(service) == NULL);
+
+        return r == VARLINK_SERVICE_BACKEND_IO_URING;
+}
+
+int main(void) {
+        test_backend(VARLINK_SERVICE_BACKEND_EPOLL);
+
+        if (!io_uring_available()) {
+                fprintf(stderr, "io_uring is not available, its backend was not tested\n");
+
+                /* reported as skipped by meson */
+                return 77;
+        }
+
+        test_backend(VARLINK_SERVICE_BACKEND_IO_URING);
 
         return EXIT_SUCCESS;
 }
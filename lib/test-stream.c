@@ -0,0 +1,739 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "stream.h"
+#include "util.h"
+#include "value.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+static void stream_pair(VarlinkStream **ap, VarlinkStream **bp) {
+        int sp[2];
+
+        assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sp) == 0);
+        assert(varlink_stream_new(ap, sp[0]) == 0);
+        assert(varlink_stream_new(bp, sp[1]) == 0);
+}
+
+static VarlinkObject *message_new(unsigned long length) {
+        VarlinkObject *message;
+        _cleanup_(freep) char *string = NULL;
+
+        string = malloc(length + 1);
+        assert(string);
+        memset(string, 'x', length);
+        string[length] = '\0';
+
+        assert(varlink_object_new(&message) == 0);
+        assert(varlink_object_set_string(message, "string", string) == 0);
+
+        return message;
+}
+
+static VarlinkObject *transfer(VarlinkStream *a, VarlinkStream *b) {
+        VarlinkObject *message = NULL;
+
+        for (long i = 0; i < 1000; i += 1) {
+                long r;
+
+                r = varlink_stream_read(b, &message);
+                assert(r >= 0);
+                if (r == 1)
+                        break;
+
+                assert((long) varlink_stream_flush(a) >= 0);
+        }
+
+        assert(message);
+        return message;
+}
+
+static void test_grow(void) {
+        VarlinkStream *a, *b;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *received = NULL;
+        const char *string;
+
+        stream_pair(&a, &b);
+
+        /* idle streams do not hold any buffers */
+        assert(a->in.data == NULL && a->out.data == NULL);
+        assert(b->in.data == NULL && b->out.data == NULL);
+
+        message = message_new(1024 * 1024);
+        assert(varlink_stream_write(a, message) >= 0);
+        assert(a->out.size > STREAM_BUFFER_SIZE);
+
+        received = transfer(a, b);
+        assert(varlink_object_get_string(received, "string", &string) == 0);
+        assert(strlen(string) == 1024 * 1024);
+
+        /* both buffers shrink back once they are drained */
+        assert(a->out.length == 0);
+        assert(a->out.size <= STREAM_BUFFER_SIZE);
+        assert(b->in.length == 0);
+        assert(b->in.size <= STREAM_BUFFER_SIZE);
+
+        varlink_stream_free(a);
+        varlink_stream_free(b);
+}
+
+static void test_spill(void) {
+        VarlinkStream *a, *b;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *received = NULL;
+        StreamStatistics statistics;
+        const char *string;
+
+        stream_pair(&a, &b);
+
+        /* larger than the default maximum */
+        varlink_stream_set_max_message_size(a, 64 * 1024 * 1024);
+        varlink_stream_set_max_message_size(b, 64 * 1024 * 1024);
+
+        message = message_new(20 * 1024 * 1024);
+        assert(varlink_stream_write(a, message) == 0);
+        assert(a->out.spill_fd >= 0);
+        assert(a->out.size > STREAM_MAX_MESSAGE_SIZE);
+
+        for (long i = 0; !received && i < 100000; i += 1) {
+                assert(varlink_stream_read(b, &received) >= 0);
+                assert((long) varlink_stream_flush(a) >= 0);
+        }
+
+        assert(received);
+        assert(varlink_object_get_string(received, "string", &string) == 0);
+        assert(strlen(string) == 20 * 1024 * 1024);
+
+        /* spilled buffers are unmapped once they are drained */
+        assert(a->out.spill_fd == -1 && a->out.data == NULL);
+        assert(b->in.spill_fd == -1 && b->in.data == NULL);
+        assert(b->in.moved < 20 * 1024 * 1024);
+
+        /* the message is parsed in the mapping, which it keeps alive */
+        varlink_stream_get_statistics(b, &statistics);
+        assert(statistics.copied == 0);
+
+        varlink_stream_free(a);
+        varlink_stream_free(b);
+}
+
+static void test_wrap(void) {
+        VarlinkStream *a, *b;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
+        StreamStatistics statistics;
+        const char *string;
+
+        stream_pair(&a, &b);
+
+        /* two pipelined messages, the second one wraps around the end of the ring */
+        message = message_new(3000);
+        assert(varlink_stream_write(a, message) == 1);
+        assert(varlink_stream_write(a, message) == 1);
+        message = varlink_object_unref(message);
+
+        for (long i = 0; i < 2; i += 1) {
+                _cleanup_(varlink_object_unrefp) VarlinkObject *received = NULL;
+
+                received = transfer(a, b);
+                assert(varlink_object_get_string(received, "string", &string) == 0);
+                assert(strlen(string) == 3000);
+        }
+
+        assert(b->in.data == NULL);
+        assert(b->in.length == 0);
+
+        /* only the wrapped message is copied out of the ring to be parsed */
+        varlink_stream_get_statistics(b, &statistics);
+        assert(statistics.copied > 0 && statistics.copied < 2 * 3000);
+        assert(a->out.moved == 0);
+
+        varlink_stream_free(a);
+        varlink_stream_free(b);
+}
+
+static void test_trickle(void) {
+        VarlinkStream *a, *b;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *received = NULL;
+        _cleanup_(freep) char *json = NULL;
+        long length;
+        const char *string;
+
+        stream_pair(&a, &b);
+
+        message = message_new(64 * 1024);
+        length = varlink_object_to_json(message, &json);
+        assert(length > 0);
+
+        /* a large message arriving in small chunks is only scanned once */
+        for (long i = 0; i < length; i += 100) {
+                long n = MIN(100, length - i);
+
+                assert(write(a->fd, json + i, n) == n);
+                assert(varlink_stream_read(b, &received) == 0);
+                assert(b->in_scanned == (unsigned long) (i + n));
+        }
+
+        assert(write(a->fd, "", 1) == 1);
+        assert(varlink_stream_read(b, &received) == 1);
+        assert(varlink_object_get_string(received, "string", &string) == 0);
+        assert(strlen(string) == 64 * 1024);
+        assert(b->in_scanned == 0);
+
+        varlink_stream_free(a);
+        varlink_stream_free(b);
+}
+
+static void test_read_batch(void) {
+        VarlinkStream *a, *b;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
+        VarlinkObject *messages[4];
+        const char *string;
+
+        stream_pair(&a, &b);
+
+        message = message_new(100);
+        for (long i = 0; i < 6; i += 1)
+                assert(varlink_stream_write(a, message) == 1);
+
+        /* one read returns all pipelined messages, limited by the array */
+        assert(varlink_stream_read_batch(b, messages, ARRAY_SIZE(messages)) == 4);
+        for (long i = 0; i < 4; i += 1) {
+                assert(varlink_object_get_string(messages[i], "string", &string) == 0);
+                assert(strlen(string) == 100);
+                varlink_object_unref(messages[i]);
+        }
+
+        assert(varlink_stream_read_batch(b, messages, ARRAY_SIZE(messages)) == 2);
+        for (long i = 0; i < 2; i += 1)
+                varlink_object_unref(messages[i]);
+
+        assert(varlink_stream_read_batch(b, messages, ARRAY_SIZE(messages)) == 0);
+        assert(b->in.length == 0);
+
+        /* messages before an invalid one are still returned */
+        assert(varlink_stream_write(a, message) == 1);
+        assert(write(a->fd, "{]", 3) == 3);
+        assert(varlink_stream_read_batch(b, messages, ARRAY_SIZE(messages)) == 1);
+        varlink_object_unref(messages[0]);
+        assert(varlink_stream_read_batch(b, messages, ARRAY_SIZE(messages)) == -VARLINK_ERROR_INVALID_JSON);
+
+        /* the invalid message was parsed in place, the error sticks */
+        assert(varlink_stream_read_batch(b, messages, ARRAY_SIZE(messages)) == -VARLINK_ERROR_INVALID_JSON);
+
+        varlink_stream_free(a);
+        varlink_stream_free(b);
+}
+
+static void test_pool(void) {
+        _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
+        BufferPool *pool;
+        BufferPoolStatistics statistics;
+        VarlinkStream *a, *b;
+
+        assert(buffer_pool_new(&pool) == 0);
+        stream_pair(&a, &b);
+        a->pool = pool;
+        b->pool = pool;
+
+        message = message_new(100);
+        for (long i = 0; i < 10; i += 1) {
+                _cleanup_(varlink_object_unrefp) VarlinkObject *received = NULL;
+
+                assert(varlink_stream_write(a, message) == 1);
+                received = transfer(a, b);
+        }
+
+        /* drained streams give their buffers back */
+        assert(a->out.data == NULL && b->in.data == NULL);
+
+        buffer_pool_get_statistics(pool, &statistics);
+        assert(statistics.borrowed == 0);
+        assert(statistics.high_water == 1);
+
+        /* every received message takes the chunk it was parsed in along */
+        assert(statistics.misses == 10);
+        assert(statistics.hits == 10);
+        assert(statistics.cached == 0);
+
+        /* buffers which grew are not kept */
+        message = varlink_object_unref(message);
+        message = message_new(512 * 1024);
+        assert(varlink_stream_write(a, message) == 0);
+        buffer_pool_get_statistics(pool, &statistics);
+        assert(statistics.borrowed == 1);
+        assert(statistics.cached == 0);
+
+        varlink_stream_free(a);
+        varlink_stream_free(b);
+
+        buffer_pool_get_statistics(pool, &statistics);
+        assert(statistics.borrowed == 0);
+        assert(statistics.cached == 0);
+
+        buffer_pool_free(pool);
+}
+
+static void test_write(void) {
+        VarlinkStream *a, *b;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
+        _cleanup_(freep) char *json = NULL;
+        char buffer[1024];
+        long length;
+
+        stream_pair(&a, &b);
+
+        assert(varlink_object_new_from_json(&message, "{"
+                                            "  \"bool\": true,"
+                                            "  \"int\": -42,"
+                                            "  \"float\": 42.2,"
+                                            "  \"string\": \"f\\\"o\\u0001o\\n\","
+                                            "  \"array\": [ 1, 2, 3 ],"
+                                            "  \"object\": { \"foo\": [], \"bar\": {} }"
+                                            "}") == 0);
+
+        /* the stream writes the same as varlink_object_to_json() */
+        length = varlink_object_to_json(message, &json);
+        assert(length > 0);
+        assert(strchr(json, ',') && !strstr(json, "42,2"));
+
+        assert(varlink_stream_write(a, message) == 1);
+        assert(read(b->fd, buffer, sizeof(buffer)) == length + 1);
+        assert(memcmp(buffer, json, length + 1) == 0);
+
+        /* a message that does not fit is dropped entirely */
+        varlink_stream_set_max_message_size(a, length);
+        assert(varlink_stream_write(a, message) == -VARLINK_ERROR_INVALID_MESSAGE);
+        assert(a->out.length == 0);
+
+        varlink_stream_free(a);
+        varlink_stream_free(b);
+}
+
+static void test_cork(void) {
+        VarlinkStream *a, *b;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
+        unsigned long length;
+
+        stream_pair(&a, &b);
+        varlink_stream_set_cork(a, 1024);
+
+        /* corked writes are only buffered */
+        message = message_new(100);
+        assert(varlink_stream_write(a, message) == 0);
+        length = a->out.length;
+        assert(length > 100);
+
+        for (long i = 1; (i + 1) * length < 1024; i += 1) {
+                assert(varlink_stream_write(a, message) == 0);
+                assert(a->out.length == (i + 1) * length);
+        }
+
+        /* reaching the threshold flushes everything */
+        assert(varlink_stream_write(a, message) == 1);
+        assert(a->out.length == 0);
+
+        for (long i = 0; i < (long) (1024 / length) + 1; i += 1) {
+                _cleanup_(varlink_object_unrefp) VarlinkObject *received = NULL;
+
+                assert(varlink_stream_read(b, &received) == 1);
+        }
+
+        /* the caller flushes what is left */
+        assert(varlink_stream_write(a, message) == 0);
+        assert(varlink_stream_flush(a) == 0);
+
+        varlink_stream_free(a);
+        varlink_stream_free(b);
+}
+
+static void test_max_message_size(void) {
+        VarlinkStream *a, *b;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *received = NULL;
+        char garbage[2048];
+
+        stream_pair(&a, &b);
+        varlink_stream_set_max_message_size(a, 1024);
+        varlink_stream_set_max_message_size(b, 1024);
+
+        message = message_new(2048);
+        assert(varlink_stream_write(a, message) == -VARLINK_ERROR_INVALID_MESSAGE);
+        message = varlink_object_unref(message);
+
+        message = message_new(512);
+        assert(varlink_stream_write(a, message) == 1);
+        received = transfer(a, b);
+
+        /* an unterminated message larger than the maximum */
+        memset(garbage, 'x', sizeof(garbage));
+        assert(write(a->fd, garbage, sizeof(garbage)) == sizeof(garbage));
+        assert(varlink_stream_read(b, &message) == -VARLINK_ERROR_INVALID_MESSAGE);
+
+        varlink_stream_free(a);
+        varlink_stream_free(b);
+}
+
+static void test_utf8(void) {
+        VarlinkStream *a, *b;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *received = NULL;
+        VarlinkObject *message = NULL;
+        const char *valid = "{\"string\":\"Grüße aus Köln, €100 und 😀, a message long enough to be verified in blocks\"}";
+        const char *invalid = "{\"string\":\"a message which is long enough to be verified in blocks, \xc3\x28 in the end\"}";
+        const char *string;
+
+        stream_pair(&a, &b);
+
+        /* the message is verified as a whole when it is read */
+        assert(write(a->fd, valid, strlen(valid) + 1) == (ssize_t) strlen(valid) + 1);
+        assert(varlink_stream_read(b, &received) == 1);
+        assert(varlink_object_get_string(received, "string", &string) == 0);
+        assert(strncmp(string, "Grüße aus Köln, €100 und 😀", strlen("Grüße aus Köln, €100 und 😀")) == 0);
+
+        assert(write(a->fd, invalid, strlen(invalid) + 1) == (ssize_t) strlen(invalid) + 1);
+        assert(varlink_stream_read(b, &message) == -VARLINK_ERROR_INVALID_JSON);
+
+        varlink_stream_free(a);
+        varlink_stream_free(b);
+}
+
+static void test_in_place(void) {
+        VarlinkStream *a, *b;
+        VarlinkObject *received = NULL;
+        VarlinkObject *nested;
+        VarlinkArray *array;
+        const char *json = "{\"plain\":\"text\",\"escaped\":\"a\\\"b\\\\c\\u00e4\\n\","
+                           "\"nested\":{\"w\\u00f6rds\":[\"one\",\"t\\two\"]}}";
+        const char *string;
+
+        stream_pair(&a, &b);
+
+        assert(write(a->fd, json, strlen(json) + 1) == (ssize_t) strlen(json) + 1);
+        assert(varlink_stream_read(b, &received) == 1);
+
+        assert(varlink_object_get_string(received, "plain", &string) == 0);
+        assert(strcmp(string, "text") == 0);
+        assert(varlink_object_get_string(received, "escaped", &string) == 0);
+        assert(strcmp(string, "a\"b\\cä\n") == 0);
+
+        /* nested values keep the message alive on their own */
+        assert(varlink_object_get_object(received, "nested", &nested) == 0);
+        varlink_object_ref(nested);
+        assert(varlink_object_unref(received) == NULL);
+
+        assert(varlink_object_get_array(nested, "wörds", &array) == 0);
+        assert(varlink_array_get_string(array, 1, &string) == 0);
+        assert(strcmp(string, "t\two") == 0);
+
+        /* parsed objects can still be changed */
+        assert(varlink_object_set_string(nested, "wörds", "replaced") == 0);
+        assert(varlink_object_get_string(nested, "wörds", &string) == 0);
+        assert(strcmp(string, "replaced") == 0);
+        assert(varlink_object_unref(nested) == NULL);
+
+        /* the stream does not write over messages which are still alive */
+        assert(write(a->fd, "{\"n\":\"one\"}", 12) == 12);
+        assert(write(a->fd, "{\"n\":", 5) == 5);
+        assert(varlink_stream_read(b, &received) == 1);
+        assert(write(a->fd, "\"two\"}", 7) == 7);
+        assert(varlink_stream_read(b, &nested) == 1);
+
+        assert(varlink_object_get_string(received, "n", &string) == 0);
+        assert(strcmp(string, "one") == 0);
+        assert(varlink_object_get_string(nested, "n", &string) == 0);
+        assert(strcmp(string, "two") == 0);
+        assert(varlink_object_unref(received) == NULL);
+        assert(varlink_object_unref(nested) == NULL);
+        assert(b->in.data == NULL);
+
+        varlink_stream_free(a);
+        varlink_stream_free(b);
+}
+
+static void test_lazy(void) {
+        VarlinkStream *a, *b;
+        VarlinkObject *received = NULL;
+        VarlinkObject *message = NULL;
+        VarlinkObject *nested;
+        VarlinkArray *array;
+        const char *json = "{\"list\":[{\"n\":1},{\"n\":2,\"s\":\"t\\u00e4\"}],"
+                           "\"nested\":{\"b\":{\"c\":[[1.5],[]]},\"a\":\"x\\ny\"},"
+                           "\"word\":\"plain\"}";
+        const char *null_key = "{\"nested\":{\"a\":null,\"a\":2}}";
+        const char *invalid[] = {
+                "{\"nested\":{\"a\":1,\"a\":2}}",
+                "{\"nested\":{\"a\":\"{\",\"a\":1}}",
+                "{\"nested\":[{\"a\":\"}\",\"\\u0061\":1}]}",
+                "{\"nested\":{\"a\":1,\"b\":1,\"c\":1,\"d\":1,\"e\":1,\"f\":1,\"g\":1,\"h\":1,\"i\":1,"
+                "\"j\":1,\"k\":1,\"l\":1,\"m\":1,\"n\":1,\"o\":1,\"p\":1,\"q\":null,\"q\":1,\"a\":2}}",
+                "{\"nested\":{\"a\":[1,\"two\"]}}",
+                "{\"nested\":{\"a\":tru}}",
+                "{\"nested\":[\"\\u0000\"]}",
+                "{\"nested\":[1,]}"
+        };
+        char buffer[1024];
+        int64_t n;
+        double f;
+
+        stream_pair(&a, &b);
+
+        /* nested values are written out as they were received */
+        assert(write(a->fd, json, strlen(json) + 1) == (ssize_t) strlen(json) + 1);
+        assert(varlink_stream_read(b, &received) == 1);
+        assert(varlink_stream_write(b, received) == 1);
+        assert(read(a->fd, buffer, sizeof(buffer)) == (ssize_t) strlen(json) + 1);
+        assert(memcmp(buffer, json, strlen(json) + 1) == 0);
+
+        /* and parsed when they are first accessed */
+        assert(varlink_object_get_array(received, "list", &array) == 0);
+        assert(varlink_array_get_object(array, 1, &nested) == 0);
+        assert(varlink_object_get_int(nested, "n", &n) == 0);
+        assert(n == 2);
+
+        assert(varlink_object_get_object(received, "nested", &nested) == 0);
+        varlink_object_ref(nested);
+        assert(varlink_object_unref(received) == NULL);
+
+        assert(varlink_object_get_object(nested, "b", &message) == 0);
+        assert(varlink_object_get_array(message, "c", &array) == 0);
+        assert(varlink_array_get_array(array, 0, &array) == 0);
+        assert(varlink_array_get_float(array, 0, &f) == 0);
+        assert(f > 1.4 && f < 1.6);
+        message = NULL;
+        assert(varlink_object_unref(nested) == NULL);
+
+        /* keys of `null` values may appear again, like in parsed objects */
+        assert(write(a->fd, null_key, strlen(null_key) + 1) == (ssize_t) strlen(null_key) + 1);
+        assert(varlink_stream_read(b, &received) == 1);
+        assert(varlink_object_get_object(received, "nested", &nested) == 0);
+        assert(varlink_object_get_int(nested, "a", &n) == 0);
+        assert(n == 2);
+        assert(varlink_object_unref(received) == NULL);
+
+        /* invalid nested values are rejected when the message is read */
+        for (unsigned long i = 0; i < ARRAY_SIZE(invalid); i += 1) {
+                assert(write(a->fd, invalid[i], strlen(invalid[i]) + 1) == (ssize_t) strlen(invalid[i]) + 1);
+                assert(varlink_stream_read(b, &message) == -VARLINK_ERROR_INVALID_JSON);
+                assert(message == NULL);
+        }
+
+        varlink_stream_free(a);
+        varlink_stream_free(b);
+}
+
+/*
+ * Nested objects are validated without building anything for their
+ * keys; the keys of one object are dropped before the next one is read.
+ */
+static void test_lazy_keys(void) {
+        _cleanup_(scanner_buffer_unrefp) ScannerBuffer *buffer = NULL;
+        _cleanup_(scanner_freep) Scanner *scanner = NULL;
+        const char *element = "{\"a\":1,\"b\":{\"a\":null,\"\\u0061\":[]},\"c\":\"x\"},";
+        unsigned long n_elements = 1000;
+        unsigned long length = 1 + n_elements * strlen(element);
+        VarlinkValue value = {};
+        char *p;
+
+        assert(scanner_buffer_new(&buffer, length) == 0);
+        p = buffer->data;
+        *p++ = '[';
+        for (unsigned long i = 0; i < n_elements; i += 1)
+                p = stpcpy(p, element);
+        p[-1] = ']';
+
+        assert(scanner_new_in_place(&scanner, buffer) == 0);
+        scanner->lazy = true;
+
+        assert(varlink_value_read_from_scanner(&value, scanner, 0));
+        assert(value.lazy);
+        assert(value.kind == VARLINK_VALUE_ARRAY);
+        assert(scanner_peek(scanner) == '\0');
+
+        /* the keys are compared where they are in the message */
+        assert(scanner->n_keys == 0);
+        assert(scanner->n_keys_allocated <= 16);
+        assert(strncmp(buffer->data + 1, element, strlen(element)) == 0);
+
+        varlink_value_clear(&value);
+}
+
+/*
+ * Parsing in place changes the message; a value which failed to parse
+ * must not be read from it again.
+ */
+static void test_lazy_failed(void) {
+        _cleanup_(scanner_buffer_unrefp) ScannerBuffer *buffer = NULL;
+        const char *json = "{\"a\":\"}\",\"a\":1}";
+        VarlinkValue value = {
+                .kind = VARLINK_VALUE_OBJECT,
+                .lazy = true
+        };
+        StringWriter w;
+
+        assert(scanner_buffer_new(&buffer, strlen(json)) == 0);
+        memcpy(buffer->data, json, strlen(json));
+        value.raw = buffer->data;
+
+        assert(varlink_value_materialize(&value, buffer) < 0);
+        assert(value.lazy);
+        assert(varlink_value_materialize(&value, buffer) == -VARLINK_ERROR_INVALID_JSON);
+
+        string_writer_init(&w);
+        assert(varlink_value_write_compact_json(&value, buffer, &w.writer) == -VARLINK_ERROR_INVALID_JSON);
+        string_writer_clear(&w);
+
+        varlink_value_clear(&value);
+}
+
+static void echo_server(int fd) {
+        uint8_t buffer[8192];
+
+        for (;;) {
+                long n;
+
+                n = read(fd, buffer, sizeof(buffer));
+                assert(n >= 0);
+                if (n == 0)
+                        return;
+
+                for (long written = 0; written < n;) {
+                        long w;
+
+                        w = write(fd, buffer + written, n - written);
+                        assert(w > 0);
+                        written += w;
+                }
+        }
+}
+
+static void test_bridge(void) {
+        const char prefix[] = "buffered";
+        const unsigned long length = 4 * 1024 * 1024;
+        _cleanup_(freep) uint8_t *data = NULL;
+        _cleanup_(freep) uint8_t *received = NULL;
+        unsigned long n_written = 0, n_received = 0;
+        int in[2], out[2], server[2], signal[2];
+        pid_t bridge, echo;
+        int status;
+
+        /* stdin and stdout of `varlink bridge` are pipes when it runs under ssh */
+        assert(pipe2(in, O_CLOEXEC) == 0);
+        assert(pipe2(out, O_CLOEXEC) == 0);
+        assert(pipe2(signal, O_CLOEXEC) == 0);
+        assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, server) == 0);
+
+        echo = fork();
+        assert(echo >= 0);
+        if (echo == 0) {
+                close(in[0]);
+                close(in[1]);
+                close(out[0]);
+                close(out[1]);
+                close(server[1]);
+                echo_server(server[0]);
+                _exit(EXIT_SUCCESS);
+        }
+
+        bridge = fork();
+        assert(bridge >= 0);
+        if (bridge == 0) {
+                VarlinkStream *client_in, *client_out, *stream;
+
+                close(in[1]);
+                close(out[0]);
+                close(server[0]);
+                assert(varlink_stream_new(&client_in, in[0]) == 0);
+                assert(varlink_stream_new(&client_out, out[1]) == 0);
+                assert(varlink_stream_new(&stream, server[1]) == 0);
+
+                /* data which was already read goes out first */
+                assert(varlink_stream_feed(client_in, (const uint8_t *) prefix, strlen(prefix)) == 0);
+
+                assert(varlink_stream_bridge(signal[0], client_in, client_out, stream) == 0);
+                _exit(EXIT_SUCCESS);
+        }
+
+        close(in[0]);
+        close(out[1]);
+        close(server[0]);
+        close(server[1]);
+        assert(fcntl(in[1], F_SETFL, O_NONBLOCK) == 0);
+
+        data = malloc(length);
+        assert(data);
+        for (unsigned long i = 0; i < length; i += 1)
+                data[i] = i % 251;
+
+        received = malloc(strlen(prefix) + length + 1);
+        assert(received);
+
+        for (;;) {
+                struct pollfd pollfds[] = {
+                        { .fd = out[0], .events = POLLIN },
+                        { .fd = in[1], .events = POLLOUT }
+                };
+                long n;
+
+                assert(poll(pollfds, n_written < length ? 2 : 1, -1) > 0);
+
+                if (pollfds[1].revents & POLLOUT) {
+                        n = write(in[1], data + n_written, MIN(length - n_written, 64 * 1024));
+                        assert(n > 0);
+                        n_written += n;
+
+                        if (n_written == length)
+                                close(in[1]);
+                }
+
+                if (pollfds[0].revents) {
+                        n = read(out[0], received + n_received, strlen(prefix) + length + 1 - n_received);
+                        assert(n >= 0);
+                        if (n == 0)
+                                break;
+
+                        n_received += n;
+                }
+        }
+
+        assert(n_received == strlen(prefix) + length);
+        assert(memcmp(received, prefix, strlen(prefix)) == 0);
+        assert(memcmp(received + strlen(prefix), data, length) == 0);
+
+        assert(waitpid(bridge, &status, 0) == bridge);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        assert(waitpid(echo, &status, 0) == echo);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+        close(out[0]);
+        close(signal[0]);
+        close(signal[1]);
+}
+
+int main(void) {
+        // Uses `,` as the radix character
+        assert(setlocale(LC_NUMERIC, "de_DE.UTF-8") != 0);
+
+        test_grow();
+        test_spill();
+        test_wrap();
+        test_trickle();
+        test_read_batch();
+        test_pool();
+        test_write();
+        test_cork();
+        test_max_message_size();
+        test_utf8();
+        test_in_place();
+        test_lazy();
+        test_lazy_keys();
+        test_lazy_failed();
+        test_bridge();
+
+        return EXIT_SUCCESS;
+}
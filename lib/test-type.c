@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: Apache-2.0
 
+#include "atom.h"
 #include "interface.h"
 #include "service.h"
 #include "util.h"
@@ -173,6 +174,51 @@ static void test_interface_type_lookup(void) {
         assert(varlink_service_free(service) == NULL);
 }
 
+/*
+ * Only the field names of registered interfaces become atoms, the keys
+ * of received and changed objects are only looked up.
+ */
+static void test_interface_atoms(void) {
+        VarlinkService *service;
+        VarlinkObject *object;
+        const char *description;
+        const char **names;
+
+        description = "interface foo.atoms\n"
+                      "type Color (atom_red, atom_green)\n"
+                      "method Get(atom_key: string) -> (atom_entry: ?[](atom_inner: int))\n"
+                      "error NotFound (atom_missing: string)\n";
+        assert(varlink_service_new(&service,
+                                   "Varlink", "Test Service", "1", "http://example.com",
+                                   "unix:@org.example.atoms",
+                                   -1) == 0);
+        assert(atom_find("atom_inner") == NULL);
+        assert(varlink_service_add_interface(service, description, NULL) == 0);
+
+        assert(atom_find("atom_key") != NULL);
+        assert(atom_find("atom_entry") != NULL);
+        assert(atom_find("atom_inner") != NULL);
+        assert(atom_find("atom_missing") != NULL);
+        assert(atom_find("atom_red") == NULL);
+
+        assert(varlink_object_new_from_json(&object, "{\"atom_inner\":1,\"atom_peer\":2}") == 0);
+        assert(atom_find("atom_peer") == NULL);
+        assert(varlink_object_get_field_names(object, &names) == 2);
+        assert(names[0] == atom_find("atom_inner"));
+        free(names);
+
+        /* setting fields uses the atoms, but does not add any */
+        assert(varlink_object_set_int(object, "atom_key", 3) == 0);
+        assert(varlink_object_set_int(object, "atom_set", 4) == 0);
+        assert(atom_find("atom_set") == NULL);
+        assert(varlink_object_get_field_names(object, &names) == 4);
+        assert(names[1] == atom_find("atom_key"));
+        free(names);
+        assert(varlink_object_unref(object) == NULL);
+
+        assert(varlink_service_free(service) == NULL);
+}
+
 static void test_type_get_typestring(void) {
         const char *cases[] = {
                 "int",
@@ -233,6 +279,7 @@ int main(void) {
         test_enum();
         test_interface_type_add();
         test_interface_type_lookup();
+        test_interface_atoms();
         test_type_get_typestring();
         test_recursive_types();
         test_nonexisting();
@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: Apache-2.0
 
+#include "atom.h"
 #include "interface.h"
 #include "scanner.h"
 #include "util.h"
@@ -221,6 +222,18 @@ VarlinkType *varlink_type_field_get_type(VarlinkType *type, const char *name) {
         return field->type;
 }
 
+void varlink_type_intern_field_names(VarlinkType *type) {
+        if (type->kind == VARLINK_TYPE_OBJECT) {
+                for (unsigned long i = 0; i < type->n_fields; i += 1) {
+                        atom_intern(type->fields[i]->name);
+                        varlink_type_intern_field_names(type->fields[i]->type);
+                }
+        }
+
+        if (type->element_type)
+                varlink_type_intern_field_names(type->element_type);
+}
+
 static long field_compare(const void *key, void *value) {
         VarlinkTypeField *field = value;
 
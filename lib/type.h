@@ -55,6 +55,12 @@ long varlink_type_allocate(VarlinkType **typep, VarlinkTypeKind kind);
 void varlink_type_field_freep(VarlinkTypeField **fieldp);
 const char *varlink_type_get_typestring(VarlinkType *type);
 VarlinkType *varlink_type_field_get_type(VarlinkType *type, const char *name);
+
+/*
+ * Interns the field names of all objects in the type, so that the keys
+ * of received messages are found in the atom table.
+ */
+void varlink_type_intern_field_names(VarlinkType *type);
 long varlink_type_write_typestring(VarlinkType *type,
                                    FILE *stream,
                                    long indent,
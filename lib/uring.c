@@ -0,0 +1,432 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "uring.h"
+#include "util.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define URING_ENTRIES 256
+#define URING_BUFFER_GROUP 0
+#define URING_N_BUFFERS 64
+#define URING_BUFFER_SIZE (16 * 1024)
+
+struct Uring {
+        int fd;
+
+        void *sq_ring;
+        size_t sq_ring_size;
+        void *cq_ring;
+        size_t cq_ring_size;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+
+        unsigned int *sq_head;
+        unsigned int *sq_tail;
+        unsigned int *sq_flags;
+        unsigned int *sq_array;
+        unsigned int sq_mask;
+        unsigned int sq_entries;
+        /* the tail of queued, but not yet submitted entries */
+        unsigned int sq_queued;
+
+        unsigned int *cq_head;
+        unsigned int *cq_tail;
+        unsigned int cq_mask;
+        struct io_uring_cqe *cqes;
+
+        struct io_uring_buf_ring *buffer_ring;
+        size_t buffer_ring_size;
+        uint16_t buffer_tail;
+        uint8_t *buffers;
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *params) {
+        return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+        return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int n_args) {
+        return (int) syscall(__NR_io_uring_register, fd, opcode, arg, n_args);
+}
+
+static long uring_setup_buffers(Uring *uring) {
+        struct io_uring_buf_reg reg = {};
+
+        uring->buffer_ring_size = URING_N_BUFFERS * sizeof(struct io_uring_buf);
+        uring->buffer_ring = mmap(NULL, uring->buffer_ring_size, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (uring->buffer_ring == MAP_FAILED) {
+                uring->buffer_ring = NULL;
+                return -VARLINK_ERROR_PANIC;
+        }
+
+        uring->buffers = malloc(URING_N_BUFFERS * URING_BUFFER_SIZE);
+        if (!uring->buffers)
+                return -VARLINK_ERROR_PANIC;
+
+        reg.ring_addr = (uint64_t)(uintptr_t) uring->buffer_ring;
+        reg.ring_entries = URING_N_BUFFERS;
+        reg.bgid = URING_BUFFER_GROUP;
+        if (sys_io_uring_register(uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+                return -VARLINK_ERROR_PANIC;
+
+        for (long i = 0; i < URING_N_BUFFERS; i += 1)
+                uring_recycle_buffer(uring, i);
+
+        return 0;
+}
+
+static void uring_freep(Uring **uringp) {
+        if (*uringp)
+                uring_free(*uringp);
+}
+
+long uring_new(Uring **uringp) {
+        _cleanup_(uring_freep) Uring *uring = NULL;
+        struct io_uring_params params = {
+                .flags = IORING_SETUP_CQSIZE,
+                .cq_entries = URING_ENTRIES * 4
+        };
+
+        long r;
+
+        uring = calloc(1, sizeof(Uring));
+        if (!uring)
+                return -VARLINK_ERROR_PANIC;
+
+        uring->fd = sys_io_uring_setup(URING_ENTRIES, &params);
+        if (uring->fd < 0)
+                return -VARLINK_ERROR_PANIC;
+
+        uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+                uring->sq_ring_size = uring->cq_ring_size = MAX(uring->sq_ring_size, uring->cq_ring_size);
+
+        uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+        if (uring->sq_ring == MAP_FAILED) {
+                uring->sq_ring = NULL;
+                return -VARLINK_ERROR_PANIC;
+        }
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+                uring->cq_ring = uring->sq_ring;
+        else {
+                uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+                if (uring->cq_ring == MAP_FAILED) {
+                        uring->cq_ring = NULL;
+                        return -VARLINK_ERROR_PANIC;
+                }
+        }
+
+        uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+        if (uring->sqes == MAP_FAILED) {
+                uring->sqes = NULL;
+                return -VARLINK_ERROR_PANIC;
+        }
+
+        uring->sq_head = (unsigned int *)((uint8_t *) uring->sq_ring + params.sq_off.head);
+        uring->sq_tail = (unsigned int *)((uint8_t *) uring->sq_ring + params.sq_off.tail);
+        uring->sq_flags = (unsigned int *)((uint8_t *) uring->sq_ring + params.sq_off.flags);
+        uring->sq_array = (unsigned int *)((uint8_t *) uring->sq_ring + params.sq_off.array);
+        uring->sq_mask = *(unsigned int *)((uint8_t *) uring->sq_ring + params.sq_off.ring_mask);
+        uring->sq_entries = params.sq_entries;
+        uring->sq_queued = *uring->sq_tail;
+
+        uring->cq_head = (unsigned int *)((uint8_t *) uring->cq_ring + params.cq_off.head);
+        uring->cq_tail = (unsigned int *)((uint8_t *) uring->cq_ring + params.cq_off.tail);
+        uring->cq_mask = *(unsigned int *)((uint8_t *) uring->cq_ring + params.cq_off.ring_mask);
+        uring->cqes = (struct io_uring_cqe *)((uint8_t *) uring->cq_ring + params.cq_off.cqes);
+
+        r = uring_setup_buffers(uring);
+        if (r < 0)
+                return r;
+
+        *uringp = uring;
+        uring = NULL;
+
+        return 0;
+}
+
+Uring *uring_free(Uring *uring) {
+        if (uring->fd >= 0)
+                close(uring->fd);
+
+        if (uring->sqes)
+                munmap(uring->sqes, uring->sqes_size);
+
+        if (uring->cq_ring && uring->cq_ring != uring->sq_ring)
+                munmap(uring->cq_ring, uring->cq_ring_size);
+
+        if (uring->sq_ring)
+                munmap(uring->sq_ring, uring->sq_ring_size);
+
+        if (uring->buffer_ring)
+                munmap(uring->buffer_ring, uring->buffer_ring_size);
+
+        free(uring->buffers);
+        free(uring);
+
+        return NULL;
+}
+
+int uring_get_fd(Uring *uring) {
+        return uring->fd;
+}
+
+long uring_submit(Uring *uring) {
+        unsigned int n;
+
+        __atomic_store_n(uring->sq_tail, uring->sq_queued, __ATOMIC_RELEASE);
+
+        /* also the requests the kernel did not take the last time */
+        n = uring->sq_queued - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+        if (n == 0)
+                return 0;
+
+        for (;;) {
+                if (sys_io_uring_enter(uring->fd, n, 0, 0) >= 0)
+                        return 0;
+
+                switch (errno) {
+                        case EINTR:
+                                continue;
+
+                        /* completions need to be reaped first, the requests stay queued */
+                        case EAGAIN:
+                        case EBUSY:
+                                return 0;
+
+                        default:
+                                return -VARLINK_ERROR_PANIC;
+                }
+        }
+}
+
+/*
+ * Returns a zeroed submission queue entry, submitting the queue if it
+ * is full.
+ */
+static struct io_uring_sqe *uring_get_sqe(Uring *uring) {
+        struct io_uring_sqe *sqe;
+        unsigned int index;
+
+        if (uring->sq_queued - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries) {
+                if (uring_submit(uring) < 0)
+                        return NULL;
+
+                if (uring->sq_queued - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries)
+                        return NULL;
+        }
+
+        index = uring->sq_queued & uring->sq_mask;
+        uring->sq_array[index] = index;
+        uring->sq_queued += 1;
+
+        sqe = &uring->sqes[index];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+        return sqe;
+}
+
+long uring_accept(Uring *uring, int fd, bool multishot, uint64_t user_data) {
+        struct io_uring_sqe *sqe;
+
+        sqe = uring_get_sqe(uring);
+        if (!sqe)
+                return -VARLINK_ERROR_PANIC;
+
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = fd;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->ioprio = multishot ? IORING_ACCEPT_MULTISHOT : 0;
+        sqe->user_data = user_data;
+
+        return 0;
+}
+
+long uring_recv(Uring *uring, int fd, bool multishot, uint64_t user_data) {
+        struct io_uring_sqe *sqe;
+
+        sqe = uring_get_sqe(uring);
+        if (!sqe)
+                return -VARLINK_ERROR_PANIC;
+
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        sqe->ioprio = multishot ? IORING_RECV_MULTISHOT : 0;
+        sqe->user_data = user_data;
+
+        return 0;
+}
+
+long uring_send(Uring *uring, int fd, const struct msghdr *message, uint64_t user_data) {
+        struct io_uring_sqe *sqe;
+
+        sqe = uring_get_sqe(uring);
+        if (!sqe)
+                return -VARLINK_ERROR_PANIC;
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t) message;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = user_data;
+
+        return 0;
+}
+
+long uring_nop(Uring *uring, uint64_t user_data) {
+        struct io_uring_sqe *sqe;
+
+        sqe = uring_get_sqe(uring);
+        if (!sqe)
+                return -VARLINK_ERROR_PANIC;
+
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = user_data;
+
+        return 0;
+}
+
+long uring_cancel(Uring *uring, uint64_t key, int fd, uint64_t user_data) {
+        struct io_uring_sqe *sqe;
+
+        sqe = uring_get_sqe(uring);
+        if (!sqe)
+                return -VARLINK_ERROR_PANIC;
+
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->user_data = user_data;
+
+        if (key != 0) {
+                sqe->addr = key;
+                sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+        } else if (fd >= 0) {
+                sqe->fd = fd;
+                sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        } else
+                sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+
+        return 0;
+}
+
+bool uring_next_completion(Uring *uring, bool wait, UringCompletion *completion) {
+        unsigned int head = *uring->cq_head;
+        struct io_uring_cqe *cqe;
+
+        while (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+                unsigned int flags = 0;
+
+                /* completions which did not fit into the queue are flushed by the kernel */
+                if (__atomic_load_n(uring->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)
+                        flags = IORING_ENTER_GETEVENTS;
+                else if (!wait)
+                        return false;
+
+                if (sys_io_uring_enter(uring->fd, 0, wait ? 1 : 0, IORING_ENTER_GETEVENTS | flags) < 0 &&
+                    errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                        return false;
+        }
+
+        cqe = &uring->cqes[head & uring->cq_mask];
+
+        completion->user_data = cqe->user_data;
+        completion->res = cqe->res;
+        completion->more = cqe->flags & IORING_CQE_F_MORE;
+        completion->data = NULL;
+        completion->buffer_id = -1;
+
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+                completion->buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                completion->data = uring->buffers + completion->buffer_id * URING_BUFFER_SIZE;
+        }
+
+        __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        return true;
+}
+
+void uring_recycle_buffer(Uring *uring, long buffer_id) {
+        struct io_uring_buf *buffer;
+
+        if (buffer_id < 0)
+                return;
+
+        buffer = &uring->buffer_ring->bufs[uring->buffer_tail & (URING_N_BUFFERS - 1)];
+        buffer->addr = (uint64_t)(uintptr_t)(uring->buffers + buffer_id * URING_BUFFER_SIZE);
+        buffer->len = URING_BUFFER_SIZE;
+        buffer->bid = buffer_id;
+
+        uring->buffer_tail += 1;
+        __atomic_store_n(&uring->buffer_ring->tail, uring->buffer_tail, __ATOMIC_RELEASE);
+}
+
+#else
+
+long uring_new(Uring **UNUSED(uringp)) {
+        return -VARLINK_ERROR_PANIC;
+}
+
+Uring *uring_free(Uring *UNUSED(uring)) {
+        return NULL;
+}
+
+int uring_get_fd(Uring *UNUSED(uring)) {
+        return -1;
+}
+
+long uring_accept(Uring *UNUSED(uring), int UNUSED(fd), bool UNUSED(multishot), uint64_t UNUSED(user_data)) {
+        return -VARLINK_ERROR_PANIC;
+}
+
+long uring_recv(Uring *UNUSED(uring), int UNUSED(fd), bool UNUSED(multishot), uint64_t UNUSED(user_data)) {
+        return -VARLINK_ERROR_PANIC;
+}
+
+long uring_send(Uring *UNUSED(uring), int UNUSED(fd), const struct msghdr *UNUSED(message), uint64_t UNUSED(user_data)) {
+        return -VARLINK_ERROR_PANIC;
+}
+
+long uring_nop(Uring *UNUSED(uring), uint64_t UNUSED(user_data)) {
+        return -VARLINK_ERROR_PANIC;
+}
+
+long uring_cancel(Uring *UNUSED(uring), uint64_t UNUSED(key), int UNUSED(fd), uint64_t UNUSED(user_data)) {
+        return -VARLINK_ERROR_PANIC;
+}
+
+long uring_submit(Uring *UNUSED(uring)) {
+        return -VARLINK_ERROR_PANIC;
+}
+
+bool uring_next_completion(Uring *UNUSED(uring), bool UNUSED(wait), UringCompletion *UNUSED(completion)) {
+        return false;
+}
+
+void uring_recycle_buffer(Uring *UNUSED(uring), long UNUSED(buffer_id)) {
+}
+
+#endif
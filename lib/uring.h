@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "varlink.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * A minimal io_uring, set up with plain system calls. Received data
+ * lands in a ring of buffers provided by us, so that requests to
+ * receive do not tie up memory while they wait for data.
+ */
+typedef struct Uring Uring;
+
+typedef struct {
+        uint64_t user_data;
+        int res;
+
+        /* the request stays active and produces more completions */
+        bool more;
+
+        /* the received data, to be given back with uring_recycle_buffer() */
+        const uint8_t *data;
+        long buffer_id;
+} UringCompletion;
+
+/*
+ * Sets up a ring. Fails if the kernel does not support io_uring or
+ * provided buffer rings.
+ */
+long uring_new(Uring **uringp);
+Uring *uring_free(Uring *uring);
+
+/*
+ * The file descriptor of the ring, it becomes readable when there are
+ * completions.
+ */
+int uring_get_fd(Uring *uring);
+
+/*
+ * Queue requests; they are submitted with the next uring_submit(). If
+ * the submission queue is full, it is submitted right away.
+ */
+long uring_accept(Uring *uring, int fd, bool multishot, uint64_t user_data);
+long uring_recv(Uring *uring, int fd, bool multishot, uint64_t user_data);
+long uring_nop(Uring *uring, uint64_t user_data);
+
+/*
+ * Queues one sendmsg() of the segments of message. It completes once,
+ * with the number of bytes sent, which may be short. The message and its
+ * segments must stay valid until then.
+ */
+long uring_send(Uring *uring, int fd, const struct msghdr *message, uint64_t user_data);
+
+/*
+ * Cancel all requests with the user data key, all requests on fd if
+ * fd is not negative, or all requests if key is 0 and fd is negative.
+ */
+long uring_cancel(Uring *uring, uint64_t key, int fd, uint64_t user_data);
+
+/*
+ * Submits the queued requests. If the kernel cannot take them before
+ * completions are reaped, they stay queued; the event loop processes
+ * the completions and submits them with its next call.
+ */
+long uring_submit(Uring *uring);
+
+/*
+ * Retrieves the next completion. Returns false if there is none. With
+ * wait, blocks until there is one.
+ */
+bool uring_next_completion(Uring *uring, bool wait, UringCompletion *completion);
+
+void uring_recycle_buffer(Uring *uring, long buffer_id);
@@ -1,13 +1,19 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include "array.h"
+#include "dtoa.h"
 #include "object.h"
 #include "scanner.h"
+#include "util.h"
 #include "value.h"
 
-#include <float.h>
 #include <inttypes.h>
 #include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 void varlink_value_clear(VarlinkValue *value) {
         switch (value->kind) {
@@ -19,25 +25,256 @@ void varlink_value_clear(VarlinkValue *value) {
                         break;
 
                 case VARLINK_VALUE_STRING:
-                        free(value->s);
+                        if (!value->borrowed)
+                                free(value->s);
                         break;
 
                 case VARLINK_VALUE_ARRAY:
-                        if (value->array)
+                        if (!value->lazy && value->array)
                                 varlink_array_unref(value->array);
                         break;
 
                 case VARLINK_VALUE_OBJECT:
-                        if (value->object)
+                        if (!value->lazy && value->object)
                                 varlink_object_unref(value->object);
                         break;
         }
 }
 
-long varlink_value_read_from_scanner(VarlinkValue *value, Scanner *scanner, locale_t locale, unsigned long depth_cnt) {
+static bool value_skip_from_scanner(Scanner *scanner, unsigned long depth_cnt, VarlinkValueKind *kindp);
+
+static int key_compare(const void *a, const void *b) {
+        const ScannerKey *key_a = a;
+        const ScannerKey *key_b = b;
+        int r;
+
+        if (key_a->length != key_b->length)
+                return key_a->length < key_b->length ? -1 : 1;
+
+        r = memcmp(key_a->name, key_b->name, key_a->length);
+        if (r != 0)
+                return r;
+
+        return key_a->index < key_b->index ? -1 : 1;
+}
+
+static bool key_equal(const ScannerKey *a, const ScannerKey *b) {
+        return a->length == b->length && memcmp(a->name, b->name, a->length) == 0;
+}
+
+/*
+ * A key may only appear again if all its earlier values were `null`,
+ * the same rule as when the object is parsed.
+ */
+static bool keys_unique(ScannerKey *keys, unsigned long n_keys) {
+        /* most objects have a few keys, which are compared with each other */
+        if (n_keys <= 16) {
+                for (unsigned long i = 0; i < n_keys; i += 1) {
+                        if (keys[i].null)
+                                continue;
+
+                        for (unsigned long j = i + 1; j < n_keys; j += 1)
+                                if (key_equal(&keys[i], &keys[j]))
+                                        return false;
+                }
+
+                return true;
+        }
+
+        qsort(keys, n_keys, sizeof(ScannerKey), key_compare);
+
+        for (unsigned long i = 0; i + 1 < n_keys; i += 1)
+                if (!keys[i].null && key_equal(&keys[i], &keys[i + 1]))
+                        return false;
+
+        return true;
+}
+
+static void keys_truncate(Scanner *scanner, unsigned long n_keys) {
+        for (unsigned long i = n_keys; i < scanner->n_keys; i += 1)
+                free(scanner->keys[i].copy);
+
+        scanner->n_keys = n_keys;
+}
+
+/*
+ * Reads the next key into the scanner's keys. The key is not copied,
+ * so that the message is not changed before the object is parsed in
+ * place; only keys with escape sequences are decoded into a copy.
+ */
+static bool key_skip_from_scanner(Scanner *scanner) {
+        ScannerKey *key;
+        const char *start;
+        const char *end;
+
+        if (scanner->n_keys == scanner->n_keys_allocated) {
+                unsigned long n_allocated = MAX(scanner->n_keys_allocated * 2, 16UL);
+                ScannerKey *keys;
+
+                keys = realloc(scanner->keys, n_allocated * sizeof(ScannerKey));
+                if (!keys)
+                        return false;
+
+                scanner->keys = keys;
+                scanner->n_keys_allocated = n_allocated;
+        }
+
+        if (scanner_peek(scanner) != '"')
+                return false;
+
+        start = scanner->p;
+        if (scanner_expect_string(scanner, NULL) < 0)
+                return false;
+
+        end = scanner->p;
+
+        key = &scanner->keys[scanner->n_keys];
+        key->name = start + 1;
+        key->length = end - start - 2;
+        key->index = scanner->n_keys;
+        key->copy = NULL;
+        key->null = false;
+
+        if (memchr(key->name, '\\', key->length)) {
+                scanner->p = start;
+                if (scanner_expect_string_copy(scanner, &key->copy) < 0)
+                        return false;
+
+                key->name = key->copy;
+                key->length = strlen(key->copy);
+        }
+
+        scanner->n_keys += 1;
+
+        return true;
+}
+
+static bool object_skip_from_scanner(Scanner *scanner, unsigned long depth_cnt) {
+        unsigned long first_key = scanner->n_keys;
+        bool first = true;
+
+        scanner->p += 1;
+
+        while (scanner_peek(scanner) != '}') {
+                VarlinkValueKind kind;
+                unsigned long key;
+
+                if (!first) {
+                        if (scanner_expect_operator(scanner, ",") < 0)
+                                return false;
+                }
+
+                key = scanner->n_keys;
+                if (!key_skip_from_scanner(scanner))
+                        return false;
+
+                if (scanner_expect_operator(scanner, ":") < 0)
+                        return false;
+
+                /* nested objects append their keys and drop them again */
+                if (!value_skip_from_scanner(scanner, depth_cnt, &kind))
+                        return false;
+
+                scanner->keys[key].null = kind == VARLINK_VALUE_NULL;
+                first = false;
+        }
+
+        if (!keys_unique(scanner->keys + first_key, scanner->n_keys - first_key))
+                return false;
+
+        keys_truncate(scanner, first_key);
+        scanner->p += 1;
+
+        return true;
+}
+
+/*
+ * Validates a value like varlink_value_read_from_scanner(), without
+ * building it, and returns its kind.
+ */
+static bool value_skip_from_scanner(Scanner *scanner, unsigned long depth_cnt, VarlinkValueKind *kindp) {
+        ScannerNumber number;
+        bool first = true;
+
+        depth_cnt++;
+
+        if (depth_cnt >= JSON_MAX_DEPTH) {
+                scanner_error(scanner, SCANNER_ERROR_UNKNOWN_TYPE);
+                return false;
+        }
+
+        if (scanner_peek(scanner) == '{') {
+                if (!object_skip_from_scanner(scanner, depth_cnt))
+                        return false;
+
+                *kindp = VARLINK_VALUE_OBJECT;
+
+        } else if (scanner_peek(scanner) == '[') {
+                VarlinkValueKind element_kind = VARLINK_VALUE_UNDEFINED;
+
+                scanner->p += 1;
+
+                while (scanner_peek(scanner) != ']') {
+                        VarlinkValueKind kind;
+
+                        if (!first) {
+                                if (scanner_expect_operator(scanner, ",") < 0)
+                                        return false;
+                        }
+
+                        if (!value_skip_from_scanner(scanner, depth_cnt, &kind))
+                                return false;
+
+                        /* Accept `null` value for any element kind */
+                        if (kind != VARLINK_VALUE_NULL) {
+                                if (element_kind == VARLINK_VALUE_UNDEFINED)
+                                        element_kind = kind;
+                                else if (element_kind != kind)
+                                        return false;
+                        }
+
+                        first = false;
+                }
+
+                scanner->p += 1;
+                *kindp = VARLINK_VALUE_ARRAY;
+
+        } else if (scanner_read_keyword(scanner, "null")) {
+                *kindp = VARLINK_VALUE_NULL;
+
+        } else if (scanner_read_keyword(scanner, "true") || scanner_read_keyword(scanner, "false")) {
+                *kindp = VARLINK_VALUE_BOOL;
+
+        } else if (scanner_peek(scanner) == '"') {
+                if (scanner_expect_string(scanner, NULL) < 0)
+                        return false;
+
+                *kindp = VARLINK_VALUE_STRING;
+
+        } else if (scanner_read_number(scanner, &number)) {
+                *kindp = number.is_double ? VARLINK_VALUE_FLOAT : VARLINK_VALUE_INT;
+
+        } else {
+                scanner_error(scanner, SCANNER_ERROR_JSON_EXPECTED);
+                return false;
+        }
+
+        return true;
+}
+
+long varlink_value_read_from_scanner(VarlinkValue *value, Scanner *scanner, unsigned long depth_cnt) {
         ScannerNumber number;
         long r;
 
+        if (scanner->lazy && (scanner_peek(scanner) == '{' || scanner_peek(scanner) == '[')) {
+                value->raw = scanner->p;
+                if (!value_skip_from_scanner(scanner, depth_cnt, &value->kind))
+                        return false;
+
+                value->lazy = true;
+                return true;
+        }
+
         depth_cnt++;
 
         if (depth_cnt >= JSON_MAX_DEPTH) {
@@ -46,14 +283,14 @@ long varlink_value_read_from_scanner(VarlinkValue *value, Scanner *scanner, loca
         }
 
         if (scanner_peek(scanner) == '{') {
-                r = varlink_object_new_from_scanner(&value->object, scanner, locale, depth_cnt);
+                r = varlink_object_new_from_scanner(&value->object, scanner, depth_cnt);
                 if (r < 0)
                         return false;
 
                 value->kind = VARLINK_VALUE_OBJECT;
 
         } else if (scanner_peek(scanner) == '[') {
-                r = varlink_array_new_from_scanner(&value->array, scanner, locale, depth_cnt);
+                r = varlink_array_new_from_scanner(&value->array, scanner, depth_cnt);
                 if (r < 0)
                         return false;
 
@@ -75,9 +312,11 @@ long varlink_value_read_from_scanner(VarlinkValue *value, Scanner *scanner, loca
                 if (r < 0)
                         return r;
 
+                value->borrowed = scanner->buffer != NULL;
+
                 value->kind = VARLINK_VALUE_STRING;
 
-        } else if (scanner_read_number(scanner, &number, locale)) {
+        } else if (scanner_read_number(scanner, &number)) {
                 if (number.is_double) {
                         value->f = number.d;
                         value->kind = VARLINK_VALUE_FLOAT;
@@ -94,60 +333,349 @@ long varlink_value_read_from_scanner(VarlinkValue *value, Scanner *scanner, loca
         return true;
 }
 
+/*
+ * Strings are scanned for characters which need to be escaped in blocks
+ * of 32 or 16 bytes; all of the others are copied in runs as they are.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define VALUE_AVX2 1
+
+__attribute__((target("avx2")))
+static const char *string_skip_plain_avx2(const char *p, const char *end) {
+        const __m256i quote = _mm256_set1_epi8('"');
+        const __m256i backslash = _mm256_set1_epi8('\\');
+        const __m256i control = _mm256_set1_epi8(0x1f);
+
+        while (end - p >= 32) {
+                __m256i chunk = _mm256_loadu_si256((const __m256i *)(const void *)p);
+                __m256i stop;
+                unsigned int stops;
+
+                stop = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote), _mm256_cmpeq_epi8(chunk, backslash));
+                stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, control), control));
+                stops = (unsigned int)_mm256_movemask_epi8(stop);
+                if (stops)
+                        return p + __builtin_ctz(stops);
+
+                p += 32;
+        }
+
+        return p;
+}
+#endif
+
+#ifdef __SSE2__
+static const char *string_skip_plain_sse2(const char *p, const char *end) {
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        const __m128i control = _mm_set1_epi8(0x1f);
+
+        while (end - p >= 16) {
+                __m128i chunk = _mm_loadu_si128((const __m128i *)(const void *)p);
+                __m128i stop;
+                unsigned int stops;
+
+                stop = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash));
+                stop = _mm_or_si128(stop, _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+                stops = (unsigned int)_mm_movemask_epi8(stop);
+                if (stops)
+                        return p + __builtin_ctz(stops);
+
+                p += 16;
+        }
+
+        return p;
+}
+#endif
+
+/*
+ * Returns the first character in [p, end) which needs to be escaped, or
+ * end. Long strings are scanned with AVX2, if the processor supports it.
+ */
+static const char *string_find_escape(const char *p, const char *end) {
+#ifdef VALUE_AVX2
+        if (end - p >= 64 && __builtin_cpu_supports("avx2"))
+                p = string_skip_plain_avx2(p, end);
+#endif
+
+#ifdef __SSE2__
+        p = string_skip_plain_sse2(p, end);
+#endif
+
+        for (; p < end; p += 1) {
+                unsigned char c = (unsigned char)*p;
+
+                if (c == '"' || c == '\\' || c < 0x20)
+                        break;
+        }
+
+        return p;
+}
+
+/*
+ * Returns the escape sequence for a character which cannot appear in a
+ * JSON string as it is. The buffer is used for the \u form.
+ */
+static const char *string_escape(char c, char unicode[7]) {
+        switch (c) {
+                case '\"':
+                        return "\\\"";
+
+                case '\\':
+                        return "\\\\";
+
+                case '\b':
+                        return "\\b";
+
+                case '\f':
+                        return "\\f";
+
+                case '\n':
+                        return "\\n";
+
+                case '\r':
+                        return "\\r";
+
+                case '\t':
+                        return "\\t";
+
+                default:
+                        snprintf(unicode, 7, "\\u%04x", c);
+                        return unicode;
+        }
+}
+
 static long json_write_string(FILE *stream, const char *s) {
-        while (*s != '\0') {
-                switch(*s) {
-                        case '\"':
-                                if (fprintf(stream, "\\\"") < 0)
-                                        return -VARLINK_ERROR_PANIC;
-                                break;
-
-                        case '\\':
-                                if (fprintf(stream, "\\\\") < 0)
-                                        return -VARLINK_ERROR_PANIC;
-                                break;
-
-                        case '\b':
-                                if (fprintf(stream, "\\b") < 0)
-                                        return -VARLINK_ERROR_PANIC;
-                                break;
-
-                        case '\f':
-                                if (fprintf(stream, "\\f") < 0)
-                                        return -VARLINK_ERROR_PANIC;
-                                break;
-
-                        case '\n':
-                                if (fprintf(stream, "\\n") < 0)
-                                        return -VARLINK_ERROR_PANIC;
-                                break;
-
-                        case '\r':
-                                if (fprintf(stream, "\\r") < 0)
-                                        return -VARLINK_ERROR_PANIC;
-                                break;
-
-                        case '\t':
-                                if (fprintf(stream, "\\t") < 0)
-                                        return -VARLINK_ERROR_PANIC;
-                                break;
-
-                        default:
-                                if (*(const uint8_t *)s < 0x20) {
-                                        if (fprintf(stream, "\\u%04x", *s) < 0)
-                                                return -VARLINK_ERROR_PANIC;
-                                } else {
-                                        if (fprintf(stream, "%c", *s) < 0)
-                                                return -VARLINK_ERROR_PANIC;
-                                }
+        const char *end = s + strlen(s);
+
+        for (;;) {
+                const char *run = string_find_escape(s, end);
+                char unicode[7];
+
+                /* write everything up to the next character to escape at once */
+                if (run > s) {
+                        if (fwrite(s, 1, run - s, stream) != (size_t)(run - s))
+                                return -VARLINK_ERROR_PANIC;
+
+                        s = run;
                 }
 
+                if (s == end)
+                        break;
+
+                if (fputs(string_escape(*s, unicode), stream) < 0)
+                        return -VARLINK_ERROR_PANIC;
+
                 s += 1;
         }
 
         return 0;
 }
 
+static long writer_put_json_string(Writer *writer, const char *s) {
+        const char *end = s + strlen(s);
+        long r;
+
+        for (;;) {
+                const char *run = string_find_escape(s, end);
+                char unicode[7];
+
+                /* copy everything up to the next character to escape at once */
+                if (run > s) {
+                        r = writer_write(writer, s, run - s);
+                        if (r < 0)
+                                return r;
+
+                        s = run;
+                }
+
+                if (s == end)
+                        break;
+
+                r = writer_put_string(writer, string_escape(*s, unicode));
+                if (r < 0)
+                        return r;
+
+                s += 1;
+        }
+
+        return 0;
+}
+
+long varlink_value_materialize(VarlinkValue *value, ScannerBuffer *buffer) {
+        _cleanup_(scanner_freep) Scanner *scanner = NULL;
+        long r;
+
+        if (!value->lazy)
+                return 0;
+
+        /* an earlier attempt failed and left the message half parsed */
+        if (!value->raw)
+                return -VARLINK_ERROR_INVALID_JSON;
+
+        if (buffer->n_readers == 0) {
+                r = scanner_new_in_place(&scanner, buffer);
+                if (r < 0)
+                        return r;
+
+                scanner->lazy = true;
+                scanner->p = value->raw;
+        } else {
+                /* a reader walks through the value, it is copied completely */
+                r = scanner_new(&scanner, value->raw, false);
+                if (r < 0)
+                        return r;
+        }
+
+        /* its strings were verified when it was skipped */
+        scanner->utf8_verified = true;
+
+        if (value->kind == VARLINK_VALUE_OBJECT) {
+                VarlinkObject *object;
+
+                r = varlink_object_new_from_scanner(&object, scanner, 0);
+                if (r < 0) {
+                        value->raw = NULL;
+                        return r;
+                }
+
+                value->object = object;
+        } else {
+                VarlinkArray *array;
+
+                r = varlink_array_new_from_scanner(&array, scanner, 0);
+                if (r < 0) {
+                        value->raw = NULL;
+                        return r;
+                }
+
+                value->array = array;
+        }
+
+        value->lazy = false;
+
+        return 0;
+}
+
+long varlink_value_freeze(VarlinkValue *value, ScannerBuffer *buffer) {
+        long r;
+
+        r = varlink_value_materialize(value, buffer);
+        if (r < 0)
+                return r;
+
+        switch (value->kind) {
+                case VARLINK_VALUE_ARRAY:
+                        return varlink_array_freeze(value->array);
+
+                case VARLINK_VALUE_OBJECT:
+                        return varlink_object_freeze(value->object);
+
+                default:
+                        return 0;
+        }
+}
+
+unsigned long varlink_value_get_generation(VarlinkValue *value, uint64_t *generations, unsigned long n) {
+        if (value->lazy)
+                return n;
+
+        switch (value->kind) {
+                case VARLINK_VALUE_ARRAY:
+                        if (generations)
+                                generations[n] = varlink_array_get_generation(value->array);
+                        return n + 1;
+
+                case VARLINK_VALUE_OBJECT:
+                        if (generations)
+                                generations[n] = varlink_object_get_generation(value->object);
+                        return n + 1;
+
+                default:
+                        return n;
+        }
+}
+
+bool varlink_value_json_valid(VarlinkValue *value, const uint64_t *generations, unsigned long *np) {
+        if (value->lazy)
+                return true;
+
+        switch (value->kind) {
+                case VARLINK_VALUE_ARRAY:
+                        if (varlink_array_get_generation(value->array) != generations[*np])
+                                return false;
+
+                        *np += 1;
+                        return varlink_array_json_valid(value->array);
+
+                case VARLINK_VALUE_OBJECT:
+                        if (varlink_object_get_generation(value->object) != generations[*np])
+                                return false;
+
+                        *np += 1;
+                        return varlink_object_json_valid(value->object);
+
+                default:
+                        return true;
+        }
+}
+
+long varlink_value_write_compact_json(VarlinkValue *value, ScannerBuffer *buffer, Writer *writer) {
+        char number[DTOA_BUFFER_SIZE];
+        long r;
+
+        if (value->lazy) {
+                Scanner scanner = {
+                        .string = buffer->data,
+                        .end = buffer->data + buffer->length
+                };
+
+                if (!value->raw)
+                        return -VARLINK_ERROR_INVALID_JSON;
+
+                return writer_write(writer, value->raw, scanner_skip_nested(&scanner, value->raw) - value->raw);
+        }
+
+        switch (value->kind) {
+                case VARLINK_VALUE_UNDEFINED:
+                        abort();
+
+                case VARLINK_VALUE_NULL:
+                        return writer_put_string(writer, "null");
+
+                case VARLINK_VALUE_BOOL:
+                        return writer_put_string(writer, value->b ? "true" : "false");
+
+                case VARLINK_VALUE_INT:
+                        return writer_put_int(writer, value->i);
+
+                case VARLINK_VALUE_FLOAT:
+                        if (finite(value->f) == 0)
+                                return -VARLINK_ERROR_PANIC;
+
+                        return writer_write(writer, number, dtoa(value->f, number));
+
+                case VARLINK_VALUE_STRING:
+                        r = writer_put_char(writer, '"');
+                        if (r < 0)
+                                return r;
+
+                        r = writer_put_json_string(writer, value->s);
+                        if (r < 0)
+                                return r;
+
+                        return writer_put_char(writer, '"');
+
+                case VARLINK_VALUE_ARRAY:
+                        return varlink_array_write_compact_json(value->array, writer);
+
+                case VARLINK_VALUE_OBJECT:
+                        return varlink_object_write_compact_json(value->object, writer);
+        }
+
+        abort();
+}
+
 long varlink_value_write_json(VarlinkValue *value,
                               FILE *stream,
                               long indent,
@@ -175,10 +703,13 @@ long varlink_value_write_json(VarlinkValue *value,
                         break;
 
                 case VARLINK_VALUE_FLOAT: {
+                        char number[DTOA_BUFFER_SIZE];
+
                         if (finite(value->f) == 0)
                                 return -VARLINK_ERROR_PANIC;
 
-                        if (fprintf(stream, "%s%.*e%s", value_pre, DECIMAL_DIG, value->f, value_post) < 0)
+                        dtoa(value->f, number);
+                        if (fprintf(stream, "%s%s%s", value_pre, number, value_post) < 0)
                                 return -VARLINK_ERROR_PANIC;
                         break;
                 }
@@ -5,9 +5,9 @@
 #include "scanner.h"
 #include "value.h"
 #include "varlink.h"
+#include "writer.h"
 
 #include <stdio.h>
-#include <locale.h>
 
 // Only accept a nested array/object depth to 1000
 #define JSON_MAX_DEPTH 1000
@@ -25,6 +25,16 @@ typedef enum {
 
 typedef struct {
         VarlinkValueKind kind;
+
+        /* the string points into the buffer of a parsed message */
+        bool borrowed;
+
+        /*
+         * The object or array was validated, but not parsed yet; raw
+         * points to it in the buffer of the parsed message.
+         */
+        bool lazy;
+
         union {
                 bool b;
                 int64_t i;
@@ -32,14 +42,47 @@ typedef struct {
                 char *s;
                 VarlinkArray *array;
                 VarlinkObject *object;
+                const char *raw;
         };
 } VarlinkValue;
 
-long varlink_value_read_from_scanner(VarlinkValue *value, Scanner *scanner, locale_t locale, unsigned long depth_cnt);
+long varlink_value_read_from_scanner(VarlinkValue *value, Scanner *scanner, unsigned long depth_cnt);
+
+/*
+ * Parses a lazy object or array, buffer is the message the value was
+ * read from. It is parsed in place, unless a reader walks through the
+ * message.
+ */
+long varlink_value_materialize(VarlinkValue *value, ScannerBuffer *buffer);
+
+/*
+ * Freezes a nested object or array; lazy values are parsed first, so
+ * that their generations can be checked.
+ */
+long varlink_value_freeze(VarlinkValue *value, ScannerBuffer *buffer);
+
+/*
+ * Stores the generation of a nested object or array at generations[n],
+ * if generations is not NULL. Returns the index of the next one.
+ */
+unsigned long varlink_value_get_generation(VarlinkValue *value, uint64_t *generations, unsigned long n);
+
+/*
+ * Returns true if a nested object or array has the generation stored
+ * at generations[*np] and its JSON is still valid; other values are
+ * always valid. Advances *np past nested objects and arrays.
+ */
+bool varlink_value_json_valid(VarlinkValue *value, const uint64_t *generations, unsigned long *np);
 long varlink_value_write_json(VarlinkValue *value,
                               FILE *stream,
                               long indent,
                               const char *key_pre, const char *key_post,
                               const char *value_pre, const char *value_post);
 
+/*
+ * Lazy values are written as they were received, without parsing them;
+ * buffer is the message they were read from.
+ */
+long varlink_value_write_compact_json(VarlinkValue *value, ScannerBuffer *buffer, Writer *writer);
+
 void varlink_value_clear(VarlinkValue *value);
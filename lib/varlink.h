@@ -52,6 +52,14 @@ enum {
         VARLINK_REPLY_CONTINUES = 1
 };
 
+/*
+ * Event loop backends of a service.
+ */
+enum {
+        VARLINK_SERVICE_BACKEND_EPOLL = 0,
+        VARLINK_SERVICE_BACKEND_IO_URING
+};
+
 /*
  * Objects and arrays represent basic data types corresponding with JSON
  * objects and arrays.
@@ -59,6 +67,29 @@ enum {
 typedef struct VarlinkObject VarlinkObject;
 typedef struct VarlinkArray VarlinkArray;
 
+/*
+ * A reader walks through JSON data event by event, without building
+ * objects and arrays from it.
+ */
+typedef struct VarlinkReader VarlinkReader;
+
+/*
+ * Events returned by varlink_reader_next().
+ */
+enum {
+        VARLINK_READER_END = 0,
+        VARLINK_READER_OBJECT_BEGIN,
+        VARLINK_READER_OBJECT_END,
+        VARLINK_READER_ARRAY_BEGIN,
+        VARLINK_READER_ARRAY_END,
+        VARLINK_READER_KEY,
+        VARLINK_READER_NULL,
+        VARLINK_READER_BOOL,
+        VARLINK_READER_INT,
+        VARLINK_READER_FLOAT,
+        VARLINK_READER_STRING
+};
+
 /*
  * A varlink service exports a set of interfaces and listens on a varlink
  * address for incoming calls.
@@ -97,6 +128,13 @@ typedef void (*VarlinkConnectionClosedFunc)(VarlinkConnection *connection,
 typedef void (*VarlinkCallConnectionClosed)(VarlinkCall *call,
                                             void *userdata);
 
+/*
+ * Called when the output of a connection, which went above the high
+ * watermark, drained to the low watermark.
+ */
+typedef void (*VarlinkCallWritable)(VarlinkCall *call,
+                                    void *userdata);
+
 /*
  * Called when a client receives a reply to its call.
  */
@@ -149,6 +187,16 @@ VarlinkObject *varlink_object_ref(VarlinkObject *object);
  */
 long varlink_object_to_json(VarlinkObject *object, char **stringp);
 
+/*
+ * Cache the JSON of an object and everything nested in it. It is
+ * written once and then copied whenever the object is sent, alone or
+ * as part of another object or array. Changing the object or anything
+ * nested in it drops the cache, until the object is frozen again.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_object_freeze(VarlinkObject *object);
+
 /*
  * Retrieve an array of strings with the filed names of the object.
  */
@@ -200,6 +248,14 @@ VarlinkArray *varlink_array_unref(VarlinkArray *array);
  */
 void varlink_array_unrefp(VarlinkArray **arrayp);
 
+/*
+ * Cache the JSON of an array and everything nested in it, like
+ * varlink_object_freeze().
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_array_freeze(VarlinkArray *array);
+
 /*
  * Returns the number of elements of an array.
  */
@@ -230,6 +286,66 @@ long varlink_array_append_string(VarlinkArray *array, const char *string);
 long varlink_array_append_array(VarlinkArray *array, VarlinkArray *element);
 long varlink_array_append_object(VarlinkArray *array, VarlinkObject *object);
 
+/*
+ * Create a reader for a JSON string.
+ */
+long varlink_reader_new_from_json(VarlinkReader **readerp, const char *json);
+
+/*
+ * Create a reader for the value of a field. Nested objects and arrays
+ * of received messages are read where they are in the message, without
+ * parsing them into objects; this way, a VarlinkReplyFunc can walk
+ * through a huge reply in constant memory. The reader keeps the object
+ * alive.
+ */
+long varlink_reader_new_from_field(VarlinkReader **readerp, VarlinkObject *object, const char *field);
+
+/*
+ * Free a reader.
+ *
+ * Returns NULL.
+ */
+VarlinkReader *varlink_reader_free(VarlinkReader *reader);
+
+/*
+ * varlink_reader_free() to be used with the cleanup attribute.
+ */
+void varlink_reader_freep(VarlinkReader **readerp);
+
+/*
+ * Advance to the next event. Values are checked the same way as by
+ * varlink_object_new_from_json(), except for duplicate keys.
+ *
+ * Returns a VARLINK_READER event, VARLINK_READER_END after the last
+ * one, or a negative VARLINK_ERROR.
+ */
+long varlink_reader_next(VarlinkReader *reader);
+
+/*
+ * Skip the value of the current key, or the rest of the object or
+ * array the current event began. The current event is then the one
+ * which ended the skipped value.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_reader_skip(VarlinkReader *reader);
+
+/*
+ * Returns the number of objects and arrays the reader is in.
+ */
+unsigned long varlink_reader_get_depth(VarlinkReader *reader);
+
+/*
+ * Get the value of the current event. The string of a key or a string
+ * value is valid until the next call to varlink_reader_next().
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_reader_get_bool(VarlinkReader *reader, bool *bp);
+long varlink_reader_get_int(VarlinkReader *reader, int64_t *ip);
+long varlink_reader_get_float(VarlinkReader *reader, double *fp);
+long varlink_reader_get_string(VarlinkReader *reader, const char **stringp);
+
 /*
  * Create a new varlink service with the given name and version and
  * listen for requests on the given address.
@@ -293,6 +409,87 @@ long varlink_service_add_interface(VarlinkService *service,
  */
 int varlink_service_get_fd(VarlinkService *service);
 
+/*
+ * Select the backend which receives and sends the data of the service,
+ * right after creating it. With VARLINK_SERVICE_BACKEND_IO_URING, the
+ * service accepts connections and receives data with multishot
+ * requests on an io_uring, and sends all replies of one
+ * varlink_service_process_events() with a single system call. The file
+ * descriptor of varlink_service_get_fd() stays the same. If the kernel
+ * does not support io_uring, the service keeps using epoll.
+ *
+ * Returns the backend in use, or a negative VARLINK_ERROR if the
+ * service already has connections.
+ */
+long varlink_service_set_backend(VarlinkService *service, long backend);
+
+/*
+ * Set the maximum size in bytes of a single message sent or received on
+ * the connections of the service. Connection buffers start small and
+ * grow on demand up to this size. Zero restores the default of 16 MiB.
+ */
+void varlink_service_set_max_message_size(VarlinkService *service, unsigned long size);
+
+/*
+ * Cork the connections of the service: replies are collected in the
+ * output buffer and written with a single system call at the end of
+ * varlink_service_process_events(), or as soon as threshold bytes are
+ * pending. This saves system calls for methods which send many replies
+ * at once, or clients which pipeline their calls. Zero, the default,
+ * writes every reply immediately.
+ */
+void varlink_service_set_cork_threshold(VarlinkService *service, unsigned long threshold);
+
+/*
+ * Set watermarks for the output buffered on a connection. When a reply
+ * leaves more than high bytes unsent, varlink_call_reply() returns 1
+ * for replies which continue the call, and the connection does not read
+ * further calls. Once the output drained to low bytes, the writable
+ * callback of the call is invoked. This lets a method stream replies at
+ * the pace of its client. A low watermark above high is lowered to
+ * high. Zero, the default, disables the watermarks.
+ */
+void varlink_service_set_output_watermarks(VarlinkService *service, unsigned long high, unsigned long low);
+
+/*
+ * Connections of a service borrow their buffers from a pool shared by
+ * the service, and only while they have data to receive or send. Get
+ * the statistics of this pool as an object with the integer fields
+ * "hits" and "misses" (buffers taken from the pool or newly allocated),
+ * "borrowed" (buffers currently in use), "highWater" (the maximum of
+ * "borrowed" so far) and "cached" (buffers kept in the pool).
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_service_get_buffer_statistics(VarlinkService *service, VarlinkObject **statisticsp);
+
+/*
+ * Get the I/O counters of a service as an object with the fields
+ * "accepted" (the number of connections accepted so far), "total" (the
+ * counters of all connections so far) and "connections" (an array of
+ * the open connections with their "fd", the amount of their output
+ * which is "pending", and their "statistics"). The counters are the
+ * integer fields "bytesRead", "bytesWritten", "reads", "writes",
+ * "readsBlocked" and "writesBlocked" (system calls which found no data
+ * or no space), "partialWrites", "moved" (bytes which were moved
+ * inside a buffer to make room), "copied" (bytes of received messages
+ * which were copied to be parsed), "inHighWater" and "outHighWater" (the
+ * most data which was buffered at once).
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_service_get_statistics(VarlinkService *service, VarlinkObject **statisticsp);
+
+/*
+ * Provide the interface org.varlink.statistics, whose method
+ * GetStatistics() returns the object of varlink_service_get_statistics()
+ * to clients. It is not provided by default, because it reveals the
+ * load of the service to every client.
+ *
+ * Returns 0 or a negative VARLINK_ERROR.
+ */
+long varlink_service_enable_statistics(VarlinkService *service);
+
 /*
  * Create a listen file descriptor for a varlink address and return it.
  * If the address is for a UNIX domain socket in the file system, it's
@@ -333,6 +530,16 @@ long varlink_call_set_connection_closed_callback(VarlinkCall *call,
  */
 void *varlink_call_get_connection_userdata(VarlinkCall *call);
 
+/*
+ * Sets a function which is called when the output of the connection
+ * drained after varlink_call_reply() returned 1.
+ *
+ * Only one such function can be set.
+ */
+long varlink_call_set_writable_callback(VarlinkCall *call,
+                                        VarlinkCallWritable callback,
+                                        void *userdata);
+
 /*
  * Get the file descriptor of the connection of the current call.
  *
@@ -344,7 +551,13 @@ void *varlink_call_get_connection_userdata(VarlinkCall *call);
 int varlink_call_get_connection_fd(VarlinkCall *call);
 
 /*
- * Reply to a method call. After this function, the call is finished.
+ * Reply to a method call. After this function, the call is finished,
+ * unless flags contains VARLINK_REPLY_CONTINUES.
+ *
+ * Returns 0, 1 if the reply continues the call and the output of the
+ * connection went above the high watermark, or a negative VARLINK_ERROR.
+ * The reply was queued in both cases; after 1, wait for the writable
+ * callback before sending more.
  */
 long varlink_call_reply(VarlinkCall *call,
                         VarlinkObject *parameters,
@@ -413,6 +626,12 @@ long varlink_connection_process_events(VarlinkConnection *connection, uint32_t e
 
 uint32_t varlink_connection_get_events(VarlinkConnection *connection);
 
+/*
+ * Set the maximum size in bytes of a single message sent or received on
+ * the connection. Zero restores the default of 16 MiB.
+ */
+void varlink_connection_set_max_message_size(VarlinkConnection *connection, unsigned long size);
+
 /*
  * Call the specified method with the given argument. The reply will execute
  * the given callback.
@@ -0,0 +1,111 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "util.h"
+#include "varlink.h"
+#include "writer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+long writer_write_slow(Writer *writer, const void *data, size_t length) {
+        while (length > 0) {
+                size_t n;
+
+                if (writer->p == writer->end) {
+                        long r;
+
+                        r = writer->refill(writer);
+                        if (r < 0)
+                                return r;
+                }
+
+                n = MIN(length, (size_t)(writer->end - writer->p));
+                memcpy(writer->p, data, n);
+
+                writer->p += n;
+                data = (const char *) data + n;
+                length -= n;
+        }
+
+        return 0;
+}
+
+/* The digits of 00 to 99, to convert two digits at once. */
+static const char digit_pairs[] =
+        "0001020304050607080910111213141516171819"
+        "2021222324252627282930313233343536373839"
+        "4041424344454647484950515253545556575859"
+        "6061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+long writer_put_int(Writer *writer, int64_t i) {
+        char buffer[20];
+        char *p = buffer + sizeof(buffer);
+        uint64_t u = i < 0 ? -(uint64_t) i : (uint64_t) i;
+
+        while (u >= 100) {
+                p -= 2;
+                memcpy(p, digit_pairs + (u % 100) * 2, 2);
+                u /= 100;
+        }
+
+        if (u >= 10) {
+                p -= 2;
+                memcpy(p, digit_pairs + u * 2, 2);
+        } else {
+                p -= 1;
+                *p = '0' + u;
+        }
+
+        if (i < 0) {
+                p -= 1;
+                *p = '-';
+        }
+
+        return writer_write(writer, p, buffer + sizeof(buffer) - p);
+}
+
+static long string_writer_refill(Writer *writer) {
+        StringWriter *w = (StringWriter *) writer;
+        size_t length = w->data ? (size_t)(writer->p - w->data) : 0;
+        size_t size = MAX(w->size * 2, 4096);
+        char *data;
+
+        data = realloc(w->data, size);
+        if (!data)
+                return -VARLINK_ERROR_PANIC;
+
+        w->data = data;
+        w->size = size;
+        writer->p = data + length;
+        writer->end = data + size;
+
+        return 0;
+}
+
+void string_writer_init(StringWriter *w) {
+        *w = (StringWriter) {
+                .writer.refill = string_writer_refill
+        };
+}
+
+long string_writer_steal(StringWriter *w, char **stringp) {
+        long length;
+        long r;
+
+        r = writer_put_char(&w->writer, '\0');
+        if (r < 0)
+                return r;
+
+        length = w->writer.p - w->data - 1;
+
+        *stringp = w->data;
+        string_writer_init(w);
+
+        return length;
+}
+
+void string_writer_clear(StringWriter *w) {
+        free(w->data);
+        string_writer_init(w);
+}
@@ -0,0 +1,86 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef struct Writer Writer;
+
+/*
+ * Called when the current window of a writer is full. It must point p
+ * and end to a new, non-empty window, or return a negative
+ * VARLINK_ERROR.
+ */
+typedef long (*WriterRefillFunc)(Writer *writer);
+
+/*
+ * A writer appends bytes to the window between p and end, and asks its
+ * owner for the next window when it runs out of space. Owners embed it
+ * as the first member of their own state.
+ */
+struct Writer {
+        char *p;
+        char *end;
+
+        WriterRefillFunc refill;
+};
+
+long writer_write_slow(Writer *writer, const void *data, size_t length);
+
+/*
+ * The common case, that the data fits into the current window, is
+ * inlined.
+ */
+static inline long writer_write(Writer *writer, const void *data, size_t length) {
+        if (length > (size_t)(writer->end - writer->p))
+                return writer_write_slow(writer, data, length);
+
+        memcpy(writer->p, data, length);
+        writer->p += length;
+
+        return 0;
+}
+
+static inline long writer_put_char(Writer *writer, char c) {
+        if (writer->p == writer->end)
+                return writer_write_slow(writer, &c, 1);
+
+        *writer->p = c;
+        writer->p += 1;
+
+        return 0;
+}
+
+static inline long writer_put_string(Writer *writer, const char *string) {
+        return writer_write(writer, string, strlen(string));
+}
+
+/*
+ * Writes the decimal representation of an integer.
+ */
+long writer_put_int(Writer *writer, int64_t i);
+
+/*
+ * A writer which collects everything in an allocated string.
+ */
+typedef struct {
+        Writer writer;
+        char *data;
+        size_t size;
+} StringWriter;
+
+void string_writer_init(StringWriter *w);
+
+/*
+ * Terminates the string and hands it over to the caller.
+ *
+ * Returns the length of the string or a negative VARLINK_ERROR.
+ */
+long string_writer_steal(StringWriter *w, char **stringp);
+
+/*
+ * Frees the string, if it was not handed over.
+ */
+void string_writer_clear(StringWriter *w);
@@ -14,25 +14,163 @@
 #include <getopt.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/queue.h>
+
+/*
+ * Calls to the same service run in parallel on up to this many
+ * connections, further calls are queued on the least busy one. Calls
+ * with more replies are never queued behind, their connections do not
+ * count.
+ */
+#define BRIDGE_MAX_CONNECTIONS 8
+
+/* The reply to calls which were in flight on a connection which was closed. */
+#define BRIDGE_ERROR_CONNECTION_CLOSED "org.varlink.bridge.ConnectionClosed"
+
+typedef struct Bridge Bridge;
+typedef struct Backend Backend;
+
+/* A cached result of the resolver. */
+typedef struct {
+        char *interface;
+        char *address;
+} BridgeAddress;
 
 typedef struct {
+        Backend *backend;
+        VarlinkConnection *connection;
+
+        /* calls which did not receive their last reply */
+        unsigned long n_pending;
+
+        /* those of them which asked for more replies, they may never end */
+        unsigned long n_more;
+        uint32_t events;
+} BackendConnection;
+
+/* The open connections to the service at an address. */
+struct Backend {
+        Bridge *bridge;
+        char *address;
+
+        BackendConnection **connections;
+        unsigned long n_connections;
+        unsigned long n_connections_allocated;
+};
+
+typedef struct BridgeReply {
+        VarlinkObject *message;
+        STAILQ_ENTRY(BridgeReply) entry;
+} BridgeReply;
+
+/*
+ * A call read from standard input. Replies are written in the order of
+ * the calls; replies to a call which is not the oldest one are queued
+ * until all calls before it are done.
+ */
+typedef struct BridgeCall {
+        Bridge *bridge;
+        BackendConnection *connection;
+        bool more;
+        bool done;
+
+        STAILQ_HEAD(replies, BridgeReply) replies;
+        STAILQ_ENTRY(BridgeCall) entry;
+} BridgeCall;
+
+struct Bridge {
         Cli *cli;
         int epoll_fd;
         long status;
-        AVLTree *services;
+        AVLTree *addresses;
+        AVLTree *backends;
         VarlinkObject *info;
         VarlinkStream *in;
-} Bridge;
+        VarlinkStream *out;
+        uint32_t out_events;
+
+        /* standard output is a file, which cannot be polled */
+        bool out_unpollable;
+
+        STAILQ_HEAD(calls, BridgeCall) calls;
+};
+
+static void bridge_address_freep(BridgeAddress **addressp) {
+        BridgeAddress *address = *addressp;
+
+        free(address->interface);
+        free(address->address);
+        free(address);
+}
+
+static long bridge_address_compare(const void *key, void *value) {
+        BridgeAddress *address = value;
+
+        return strcmp(key, address->interface);
+}
+
+static BackendConnection *backend_connection_free(BackendConnection *connection) {
+        if (connection->connection)
+                varlink_connection_free(connection->connection);
+
+        free(connection);
+
+        return NULL;
+}
+
+static void backend_freep(Backend **backendp) {
+        Backend *backend = *backendp;
+
+        for (unsigned long i = 0; i < backend->n_connections; i += 1)
+                backend_connection_free(backend->connections[i]);
+
+        free(backend->connections);
+        free(backend->address);
+        free(backend);
+}
+
+static long backend_compare(const void *key, void *value) {
+        Backend *backend = value;
+
+        return strcmp(key, backend->address);
+}
+
+static BridgeCall *bridge_call_free(BridgeCall *call) {
+        while (!STAILQ_EMPTY(&call->replies)) {
+                BridgeReply *reply = STAILQ_FIRST(&call->replies);
+
+                STAILQ_REMOVE_HEAD(&call->replies, entry);
+                varlink_object_unref(reply->message);
+                free(reply);
+        }
+
+        free(call);
+
+        return NULL;
+}
 
 static void bridge_free(Bridge *bridge) {
-        if (bridge->services)
-                avl_tree_free(bridge->services);
+        while (!STAILQ_EMPTY(&bridge->calls)) {
+                BridgeCall *call = STAILQ_FIRST(&bridge->calls);
+
+                STAILQ_REMOVE_HEAD(&bridge->calls, entry);
+                bridge_call_free(call);
+        }
+
+        if (bridge->backends)
+                avl_tree_free(bridge->backends);
+
+        if (bridge->addresses)
+                avl_tree_free(bridge->addresses);
 
         if (bridge->info)
                 varlink_object_unref(bridge->info);
 
         varlink_stream_free(bridge->in);
 
+        if (bridge->out)
+                varlink_stream_free(bridge->out);
+
         if (bridge->epoll_fd >= 0)
                 close(bridge->epoll_fd);
 
@@ -66,6 +204,7 @@ static long bridge_new(Bridge **bridgep, Cli *cli) {
 
         bridge = calloc(1, sizeof(Bridge));
         bridge->cli = cli;
+        STAILQ_INIT(&bridge->calls);
 
         if (fd_nonblock(STDIN_FILENO) < 0)
                 return -CLI_ERROR_PANIC;
@@ -79,7 +218,11 @@ static long bridge_new(Bridge **bridgep, Cli *cli) {
                 return -CLI_ERROR_PANIC;
 
         if (epoll_add(bridge->epoll_fd, cli->signal_fd, EPOLLIN, bridge) < 0 ||
-            epoll_add(bridge->epoll_fd, bridge->in->fd, EPOLLIN, NULL) < 0)
+            epoll_add(bridge->epoll_fd, bridge->in->fd, EPOLLIN, bridge->in) < 0)
+                return -CLI_ERROR_PANIC;
+
+        if (avl_tree_new(&bridge->addresses, bridge_address_compare, (AVLFreepFunc)bridge_address_freep) < 0 ||
+            avl_tree_new(&bridge->backends, backend_compare, (AVLFreepFunc)backend_freep) < 0)
                 return -CLI_ERROR_PANIC;
 
         *bridgep = bridge;
@@ -88,184 +231,492 @@ static long bridge_new(Bridge **bridgep, Cli *cli) {
         return 0;
 }
 
-static long bridge_reply(Bridge *UNUSED(bridge),
+/*
+ * Writes the replies of the calls in order, as far as they arrived.
+ */
+static long bridge_write_replies(Bridge *bridge) {
+        BridgeCall *call;
+        uint32_t events;
+
+        while ((call = STAILQ_FIRST(&bridge->calls))) {
+                while (!STAILQ_EMPTY(&call->replies)) {
+                        BridgeReply *reply = STAILQ_FIRST(&call->replies);
+                        long r;
+
+                        r = varlink_stream_write(bridge->out, reply->message);
+                        if (r < 0)
+                                return -CLI_ERROR_PANIC;
+
+                        STAILQ_REMOVE_HEAD(&call->replies, entry);
+                        varlink_object_unref(reply->message);
+                        free(reply);
+                }
+
+                if (!call->done)
+                        break;
+
+                STAILQ_REMOVE_HEAD(&bridge->calls, entry);
+                bridge_call_free(call);
+        }
+
+        if ((long) varlink_stream_flush(bridge->out) < 0)
+                return -CLI_ERROR_PANIC;
+
+        if (bridge->out_unpollable)
+                return 0;
+
+        /* Wait for standard output to become writable, if it did not take everything. */
+        events = bridge->out->out.length > 0 ? EPOLLOUT : 0;
+        if (events == bridge->out_events)
+                return 0;
+
+        if (epoll_mod(bridge->epoll_fd, bridge->out->fd, events, bridge->out) < 0)
+                return -CLI_ERROR_PANIC;
+
+        bridge->out_events = events;
+
+        return 0;
+}
+
+static long bridge_reply(BridgeCall *call,
                          const char *error,
                          VarlinkObject *parameters,
                          uint64_t flags) {
-        _cleanup_(varlink_object_unrefp) VarlinkObject *message = NULL;
-        _cleanup_(freep) char *json = NULL;
+        BridgeReply *reply;
         long r;
 
-        r = varlink_message_pack_reply(error, parameters, flags, &message);
-        if (r < 0)
+        reply = calloc(1, sizeof(BridgeReply));
+        if (!reply)
                 return -CLI_ERROR_PANIC;
 
-        r = varlink_object_to_json(message, &json);
-        if (r < 0)
+        r = varlink_message_pack_reply(error, parameters, flags, &reply->message);
+        if (r < 0) {
+                free(reply);
                 return -CLI_ERROR_PANIC;
+        }
+
+        STAILQ_INSERT_TAIL(&call->replies, reply, entry);
 
-        printf("%s%c", json, '\0');
-        fflush(stdout);
+        if (!(flags & VARLINK_REPLY_CONTINUES)) {
+                call->done = true;
+
+                if (call->connection) {
+                        call->connection->n_pending -= 1;
+                        if (call->more)
+                                call->connection->n_more -= 1;
+                }
+        }
 
         return 0;
 }
 
-static long reply_callback(VarlinkConnection *connection,
+static long reply_callback(VarlinkConnection *UNUSED(connection),
                            const char *error,
                            VarlinkObject *parameters,
                            uint64_t flags,
                            void *userdata) {
-        Bridge *bridge = userdata;
+        BridgeCall *call = userdata;
+        long r;
+
+        r = bridge_reply(call, error, parameters, flags);
+        if (r < 0)
+                call->bridge->status = r;
+
+        return 0;
+}
+
+/*
+ * Resolves the address of interface, asking the resolver only the first
+ * time, or again if refresh is set.
+ */
+static long bridge_resolve(Bridge *bridge, const char *interface, bool refresh, const char **addressp) {
+        BridgeAddress *address;
+        _cleanup_(freep) char *resolved = NULL;
         long r;
 
-        r = bridge_reply(bridge, error, parameters, flags);
+        address = avl_tree_find(bridge->addresses, interface);
+        if (address && !refresh) {
+                *addressp = address->address;
+                return 0;
+        }
+
+        r = cli_resolve(bridge->cli, interface, &resolved);
         if (r < 0)
-                bridge->status = r;
+                return r;
+
+        if (!address) {
+                address = calloc(1, sizeof(BridgeAddress));
+                if (!address)
+                        return -CLI_ERROR_PANIC;
 
-        if (!(flags & VARLINK_REPLY_CONTINUES))
-                varlink_connection_close(connection);
+                address->interface = strdup(interface);
+                if (!address->interface || avl_tree_insert(bridge->addresses, address->interface, address) < 0) {
+                        free(address->interface);
+                        free(address);
+                        return -CLI_ERROR_PANIC;
+                }
+        }
+
+        free(address->address);
+        address->address = resolved;
+        resolved = NULL;
+
+        *addressp = address->address;
 
         return 0;
 }
 
-static const struct option options[] = {
-        { "connect", required_argument, NULL, 'c' },
-        { "help",    no_argument,       NULL, 'h' },
-        {}
-};
+/*
+ * Picks a connection to the service at address: an idle one, a new one,
+ * or the least busy one if there are too many already. A connection
+ * which carries a call with more replies is never picked while that
+ * call runs.
+ */
+static long bridge_get_connection(Bridge *bridge, const char *address, BackendConnection **connectionp) {
+        Backend *backend;
+        BackendConnection *connection = NULL;
+        unsigned long n_available = 0;
+        long r;
 
-static long handleBridge(Cli *cli, Bridge *bridge) {
-        while (bridge->status >= 0) {
-                _cleanup_(varlink_object_unrefp) VarlinkObject *call = NULL;
-                _cleanup_(freep) char *method = NULL;
-                _cleanup_(varlink_object_unrefp) VarlinkObject *parameters = NULL;
-                uint64_t flags;
-                _cleanup_(varlink_connection_freep) VarlinkConnection *connection = NULL;
-                long r;
+        backend = avl_tree_find(bridge->backends, address);
+        if (!backend) {
+                backend = calloc(1, sizeof(Backend));
+                if (!backend)
+                        return -CLI_ERROR_PANIC;
+
+                backend->bridge = bridge;
+                backend->address = strdup(address);
+                if (!backend->address || avl_tree_insert(bridge->backends, backend->address, backend) < 0) {
+                        free(backend->address);
+                        free(backend);
+                        return -CLI_ERROR_PANIC;
+                }
+        }
 
-                /* Read one message. */
-                r = varlink_stream_read(bridge->in, &call);
-                switch (r) {
-                        case 0:
-                                if (bridge->in->hup)
-                                        return 0;
+        for (unsigned long i = 0; i < backend->n_connections; i += 1) {
+                if (backend->connections[i]->n_more > 0)
+                        continue;
 
-                                /* Wait for message from client. */
-                                for (;;) {
-                                        struct epoll_event ev;
+                n_available += 1;
+                if (!connection || backend->connections[i]->n_pending < connection->n_pending)
+                        connection = backend->connections[i];
+        }
 
-                                        r = epoll_wait(bridge->epoll_fd, &ev, 1, -1);
-                                        if (r < 0) {
-                                                if (errno == EINTR)
-                                                        continue;
+        if (connection && (connection->n_pending == 0 || n_available >= BRIDGE_MAX_CONNECTIONS)) {
+                *connectionp = connection;
+                return 0;
+        }
 
-                                                return -CLI_ERROR_PANIC;
-                                        }
+        if (backend->n_connections == backend->n_connections_allocated) {
+                unsigned long n_allocated = MAX(backend->n_connections_allocated * 2, BRIDGE_MAX_CONNECTIONS);
+                BackendConnection **connections;
 
-                                        if (ev.data.ptr == bridge)
-                                                return -CLI_ERROR_CANCELED;
+                connections = realloc(backend->connections, n_allocated * sizeof(BackendConnection *));
+                if (!connections)
+                        return -CLI_ERROR_PANIC;
 
-                                        break;
-                                }
-                                continue;
+                backend->connections = connections;
+                backend->n_connections_allocated = n_allocated;
+        }
 
-                        case 1:
-                                break;
+        connection = calloc(1, sizeof(BackendConnection));
+        if (!connection)
+                return -CLI_ERROR_PANIC;
 
-                        case -VARLINK_ERROR_INVALID_MESSAGE:
-                                return -CLI_ERROR_INVALID_MESSAGE;
+        connection->backend = backend;
 
-                        default:
-                                return -CLI_ERROR_PANIC;
+        r = varlink_connection_new(&connection->connection, address);
+        if (r < 0) {
+                backend_connection_free(connection);
+                return -CLI_ERROR_CANNOT_CONNECT;
+        }
+
+        /* Also listen while idle, to notice when the service closes the connection. */
+        connection->events = EPOLLIN;
+        if (epoll_add(bridge->epoll_fd, varlink_connection_get_fd(connection->connection),
+                      connection->events, connection) < 0) {
+                backend_connection_free(connection);
+                return -CLI_ERROR_PANIC;
+        }
+
+        backend->connections[backend->n_connections] = connection;
+        backend->n_connections += 1;
+
+        *connectionp = connection;
+
+        return 0;
+}
+
+static void bridge_drop_connection(BackendConnection *connection) {
+        Backend *backend = connection->backend;
+
+        for (unsigned long i = 0; i < backend->n_connections; i += 1) {
+                if (backend->connections[i] == connection) {
+                        backend->n_connections -= 1;
+                        backend->connections[i] = backend->connections[backend->n_connections];
+                        break;
                 }
+        }
+
+        backend_connection_free(connection);
+}
+
+static long bridge_update_connection(Bridge *bridge, BackendConnection *connection) {
+        uint32_t events = varlink_connection_get_events(connection->connection) | EPOLLIN;
+
+        if (events == connection->events)
+                return 0;
+
+        if (epoll_mod(bridge->epoll_fd,
+                      varlink_connection_get_fd(connection->connection),
+                      events,
+                      connection) < 0)
+                return -CLI_ERROR_PANIC;
+
+        connection->events = events;
+
+        return 0;
+}
+
+/*
+ * Forwards a call to the service which implements interface. A cached
+ * address which does not accept connections anymore is resolved again.
+ */
+static long bridge_forward(Bridge *bridge,
+                           BridgeCall *call,
+                           const char *interface,
+                           const char *method,
+                           VarlinkObject *parameters,
+                           uint64_t flags) {
+        BackendConnection *connection = NULL;
+        long r;
 
-                r = varlink_message_unpack_call(call, &method, &parameters, &flags);
+        for (unsigned long attempt = 0; !connection; attempt += 1) {
+                const char *address;
+
+                r = bridge_resolve(bridge, interface, attempt > 0, &address);
                 if (r < 0)
-                        return -CLI_ERROR_INVALID_MESSAGE;
+                        return bridge_reply(call, "org.varlink.service.InterfaceNotFound", NULL, 0);
 
-                if (strcmp(method, "org.varlink.service.GetInfo") == 0) {
-                        r = varlink_connection_new(&connection, cli->resolver);
-                        if (r < 0)
-                                return -CLI_ERROR_PANIC;
+                r = bridge_get_connection(bridge, address, &connection);
+                if (r == -CLI_ERROR_CANNOT_CONNECT && attempt == 0)
+                        continue;
 
-                        /* Forward org.varlink.service.GetInfo to org.varlink.resolver.GetInfo */
-                        r = varlink_connection_call(connection,
-                                                    "org.varlink.resolver.GetInfo",
-                                                    parameters,
-                                                    flags,
-                                                    reply_callback,
-                                                    bridge);
-                        if (r < 0)
-                                return -CLI_ERROR_PANIC;
+                if (r < 0)
+                        return r;
+        }
 
-                } else if (strcmp(method, "org.varlink.service.GetInterfaceDescription") == 0) {
-                        _cleanup_(freep) char *address = NULL;
-                        const char *interf;
+        r = varlink_connection_call(connection->connection, method, parameters, flags, reply_callback, call);
+        if (r < 0)
+                return -CLI_ERROR_PANIC;
 
-                        r = varlink_object_get_string(parameters, "interface", &interf);
-                        if (r < 0)
-                                return -CLI_ERROR_MISSING_ARGUMENT;
+        if (flags & VARLINK_CALL_ONEWAY)
+                call->done = true;
+        else {
+                call->connection = connection;
+                connection->n_pending += 1;
 
-                        r = cli_resolve(cli, interf, &address);
-                        if (r < 0) {
-                                bridge_reply(bridge, "org.varlink.service.InterfaceNotFound", NULL, 0);
-                                return -CLI_ERROR_PANIC;
-                        }
+                if (flags & VARLINK_CALL_MORE) {
+                        call->more = true;
+                        connection->n_more += 1;
+                }
+        }
 
-                        r = varlink_connection_new(&connection, address);
-                        if (r < 0)
-                                return -CLI_ERROR_PANIC;
+        return bridge_update_connection(bridge, connection);
+}
 
-                        r = varlink_connection_call(connection,
-                                                    "org.varlink.service.GetInterfaceDescription",
-                                                    parameters,
-                                                    flags,
-                                                    reply_callback,
-                                                    bridge);
-                        if (r < 0)
-                                return -CLI_ERROR_PANIC;
+static long bridge_handle_call(Bridge *bridge, VarlinkObject *message) {
+        _cleanup_(freep) char *method = NULL;
+        _cleanup_(varlink_object_unrefp) VarlinkObject *parameters = NULL;
+        _cleanup_(varlink_uri_freep) VarlinkURI *uri = NULL;
+        BridgeCall *call;
+        uint64_t flags;
+        long r;
 
-                } else {
-                        _cleanup_(varlink_uri_freep) VarlinkURI *uri = NULL;
-                        _cleanup_(freep) char *address = NULL;
+        r = varlink_message_unpack_call(message, &method, &parameters, &flags);
+        if (r < 0)
+                return -CLI_ERROR_INVALID_MESSAGE;
 
-                        r = varlink_uri_new(&uri, method, true, true);
-                        if (r < 0) {
-                                bridge_reply(bridge, "org.varlink.service.InvalidParameter", NULL, 0);
-                                return -CLI_ERROR_INVALID_MESSAGE;
-                        }
+        call = calloc(1, sizeof(BridgeCall));
+        if (!call)
+                return -CLI_ERROR_PANIC;
 
-                        r = cli_resolve(cli, uri->interface, &address);
-                        if (r < 0) {
-                                bridge_reply(bridge, "org.varlink.service.InterfaceNotFound", NULL, 0);
-                                return -CLI_ERROR_PANIC;
-                        }
+        call->bridge = bridge;
+        STAILQ_INIT(&call->replies);
+        STAILQ_INSERT_TAIL(&bridge->calls, call, entry);
 
-                        if (connection != NULL) {
-                                varlink_connection_free(connection);
-                        }
+        /* Forward org.varlink.service.GetInfo to org.varlink.resolver.GetInfo */
+        if (strcmp(method, "org.varlink.service.GetInfo") == 0)
+                return bridge_forward(bridge, call, "org.varlink.resolver", "org.varlink.resolver.GetInfo",
+                                      parameters, flags);
 
-                        r = varlink_connection_new(&connection, address);
-                        if (r < 0)
-                                return -CLI_ERROR_PANIC;
+        if (strcmp(method, "org.varlink.service.GetInterfaceDescription") == 0) {
+                const char *interface;
 
-                        r = varlink_connection_call(connection,
-                                                    method,
-                                                    parameters,
-                                                    flags,
-                                                    reply_callback,
-                                                    bridge);
+                r = varlink_object_get_string(parameters, "interface", &interface);
+                if (r < 0)
+                        return -CLI_ERROR_MISSING_ARGUMENT;
+
+                return bridge_forward(bridge, call, interface, method, parameters, flags);
+        }
+
+        r = varlink_uri_new(&uri, method, true, true);
+        if (r < 0) {
+                bridge_reply(call, "org.varlink.service.InvalidParameter", NULL, 0);
+                return -CLI_ERROR_INVALID_MESSAGE;
+        }
+
+        return bridge_forward(bridge, call, uri->interface, method, parameters, flags);
+}
+
+/*
+ * Fails the calls which are still waiting for replies on a connection
+ * which was closed, and drops it. A new connection is opened for later
+ * calls when needed.
+ */
+static long bridge_close_connection(Bridge *bridge, BackendConnection *connection) {
+        BridgeCall *call;
+
+        STAILQ_FOREACH(call, &bridge->calls, entry) {
+                long r;
+
+                if (call->connection != connection || call->done)
+                        continue;
+
+                r = bridge_reply(call, BRIDGE_ERROR_CONNECTION_CLOSED, NULL, 0);
+                if (r < 0)
+                        return r;
+
+                call->connection = NULL;
+        }
+
+        bridge_drop_connection(connection);
+
+        return 0;
+}
+
+static long bridge_process_connection(Bridge *bridge, BackendConnection *connection, uint32_t events) {
+        long r;
+
+        r = varlink_connection_process_events(connection->connection, events);
+        switch (r) {
+                case 0:
+                        break;
+
+                case -VARLINK_ERROR_CONNECTION_CLOSED:
+                        r = bridge_close_connection(bridge, connection);
                         if (r < 0)
-                                return -CLI_ERROR_PANIC;
+                                return r;
+
+                        return bridge->status;
+
+                case -VARLINK_ERROR_INVALID_MESSAGE:
+                        return -CLI_ERROR_INVALID_MESSAGE;
+
+                default:
+                        return -CLI_ERROR_PANIC;
+        }
+
+        if (bridge->status < 0)
+                return bridge->status;
+
+        return bridge_update_connection(bridge, connection);
+}
+
+static const struct option options[] = {
+        { "connect", required_argument, NULL, 'c' },
+        { "help",    no_argument,       NULL, 'h' },
+        {}
+};
+
+/*
+ * Reads calls from standard input and forwards them right away, without
+ * waiting for the replies to earlier calls. Replies are written back in
+ * the order of the calls, all that arrived at once with one write.
+ */
+static long handleBridge(Cli *cli, Bridge *bridge) {
+        bool in_ready = true;
+        long r;
+
+        if (fd_nonblock(STDOUT_FILENO) < 0)
+                return -CLI_ERROR_PANIC;
 
+        r = varlink_stream_new(&bridge->out, STDOUT_FILENO);
+        if (r < 0)
+                return -CLI_ERROR_PANIC;
+
+        varlink_stream_set_cork(bridge->out, STREAM_BUFFER_SIZE * 16);
+
+        if (epoll_add(bridge->epoll_fd, bridge->out->fd, 0, bridge->out) < 0) {
+                if (errno != EPERM)
+                        return -CLI_ERROR_PANIC;
+
+                bridge->out_unpollable = true;
+        }
+
+        for (;;) {
+                struct epoll_event ev;
+
+                while (in_ready) {
+                        _cleanup_(varlink_object_unrefp) VarlinkObject *call = NULL;
+
+                        r = varlink_stream_read(bridge->in, &call);
+                        switch (r) {
+                                case 0:
+                                        in_ready = false;
+
+                                        /* Stop listening once the client is done, its calls still finish. */
+                                        if (bridge->in->hup)
+                                                epoll_del(bridge->epoll_fd, bridge->in->fd);
+                                        break;
+
+                                case 1:
+                                        r = bridge_handle_call(bridge, call);
+                                        if (r < 0)
+                                                return r;
+                                        break;
+
+                                case -VARLINK_ERROR_INVALID_MESSAGE:
+                                        return -CLI_ERROR_INVALID_MESSAGE;
+
+                                default:
+                                        return -CLI_ERROR_PANIC;
+                        }
                 }
 
-                r = cli_process_all_events(cli, connection);
+                if (bridge->status < 0)
+                        return bridge->status;
+
+                r = bridge_write_replies(bridge);
                 if (r < 0)
                         return r;
-        }
 
-        return bridge->status;
+                if (bridge->in->hup && STAILQ_EMPTY(&bridge->calls) && bridge->out->out.length == 0)
+                        return 0;
+
+                r = epoll_wait(bridge->epoll_fd, &ev, 1, STAILQ_EMPTY(&bridge->calls) ? -1 : cli->timeout * 1000);
+                if (r < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        return -CLI_ERROR_PANIC;
+                }
+
+                if (r == 0)
+                        return -CLI_ERROR_TIMEOUT;
+
+                if (ev.data.ptr == bridge)
+                        return -CLI_ERROR_CANCELED;
+
+                if (ev.data.ptr == bridge->in)
+                        in_ready = true;
+                else if (ev.data.ptr != bridge->out) {
+                        /* Standard output is flushed with the replies. */
+                        r = bridge_process_connection(bridge, ev.data.ptr, ev.events);
+                        if (r < 0)
+                                return r;
+                }
+        }
 }
 
 static long handleDirectBridge(Cli *cli, Bridge *bridge, VarlinkURI *bridge_uri) {